@@ -0,0 +1,147 @@
+/*_____________________________________________________________________________
+atlas.c: This file provides the implementation of the function prototypes
+	given in atlas.h
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "atlas.h"
+
+
+#define ATLAS_LINE_LEN 256
+
+
+/* load_atlas: This function takes an atlas structure, the name of the atlas
+	bmp file, the name of its index file and a threshold. The image is read
+	with imread_binary (averaging to grey, then binarizing at the threshold)
+	and the index is read in the cells. Cells which are not inside the image
+	or whose label is not a letter from 'A' to 'Z' are skipped with a warning.
+	Returns 0 on success and 1 on failure */
+
+int load_atlas (atlas * a, char * imname, char * indexname, float t) {
+
+	FILE * fp;
+	char line[ATLAS_LINE_LEN];
+	int size = 0, lineno = 0;
+
+	if (a == NULL || imname == NULL || indexname == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: atlas = %p, image = %p, index = %p\n",a,imname,indexname);
+		return 1;
+		}
+
+	a->cells = NULL;
+	a->num_cells = 0;
+
+	fp = fopen(indexname,"r");
+	if (fp == NULL) {
+		fprintf(stderr,"ERROR %d: Opening the atlas index: %s failed\n",errno,indexname);
+		return 1;
+		}
+
+	memset(&a->im, 0, sizeof(image));
+	if (imread_binary(imname, &a->im, 'A', t)) {
+		fprintf(stderr,"ERROR: Reading the atlas image: %s failed\n",imname);
+		fclose(fp);
+		return 1;
+		}
+
+	while (fgets(line, ATLAS_LINE_LEN, fp)) {
+		atlas_cell c;
+		char label;
+
+		lineno++;
+		if (line[0] == '#' || line[strspn(line," \t\r\n")] == '\0')
+			continue;
+
+		if (sscanf(line,"%d %d %d %d %c",&c.x,&c.y,&c.width,&c.height,&label) != 5) {
+			fprintf(stderr,"WARNING: Skipping line %d of %s, expected 'x y width height label'\n",lineno,indexname);
+			continue;
+			}
+
+		if (c.x < 0 || c.y < 0 || c.width <= 0 || c.height <= 0 ||
+				c.x + c.width > a->im.width || c.y + c.height > a->im.height) {
+			fprintf(stderr,"WARNING: Skipping cell on line %d of %s, it is not inside the %d x %d atlas\n",
+				lineno,indexname,a->im.width,a->im.height);
+			continue;
+			}
+		if (label < 'A' || label > 'Z') {
+			fprintf(stderr,"WARNING: Skipping cell on line %d of %s, its label '%c' is not a letter from A to Z\n",
+				lineno,indexname,label);
+			continue;
+			}
+		c.label = label - 'A';
+
+		if (a->num_cells == size) {
+			atlas_cell * cells;
+			size = size ? 2 * size : 64;
+			cells = (atlas_cell *) realloc (a->cells, sizeof(atlas_cell) * size);
+			if (cells == NULL) {
+				fprintf(stderr,"ERROR: Could not allocate memory for the atlas index\n");
+				fclose(fp);
+				free_atlas(a);
+				return 1;
+				}
+			a->cells = cells;
+			}
+		a->cells[a->num_cells++] = c;
+		}
+
+	fclose(fp);
+	return 0;
+	}
+
+
+
+/* atlas_view: This function takes an atlas, the number of a cell and a
+	pointer to image structure, and makes the image a view of the character
+	in the cell. The view is valid until free_atlas.
+	Returns 0 on success and 1 on failure */
+
+int atlas_view (atlas * a, int k, image * view) {
+
+	atlas_cell * c;
+
+	if (k < 0 || k >= a->num_cells) {
+		fprintf(stderr,"ERROR: Atlas has no cell %d\n",k);
+		return 1;
+		}
+
+	c = &a->cells[k];
+	return image_view(&a->im, c->y, c->x, c->height, c->width, view);
+	}
+
+
+
+/* free_atlas: This function takes an atlas and releases its image and cells */
+
+void free_atlas (atlas * a) {
+
+	if (a == NULL)
+		return;
+
+	free_image(&a->im);
+	free(a->cells);
+	a->cells = NULL;
+	a->num_cells = 0;
+	}
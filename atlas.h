@@ -0,0 +1,86 @@
+/*_____________________________________________________________________________
+atlas.h: This is a header file for giving glyph atlases.
+	An atlas is one bmp image holding many characters, with a text index file
+	beside it listing the rectangle of every character in the image and its
+	label. Reading an atlas is one open and one mapping of the bmp file
+	instead of one for each character, and each character is then a view into
+	the pixels of the atlas (see image_view), not a copy of them.
+	The index file has one line per character:
+		x y width height label
+	where x and y are the column and row of the top left pixel of the
+	rectangle (row 0 being the top of the image) and the label is the letter
+	the character stands for, as in supervisor.txt. Lines starting with '#'
+	are comments.
+	Current functions include following:
+		load_atlas:				Read an atlas and its index
+		atlas_view:				Make a view of one character of an atlas
+		free_atlas:				Release the memory held by an atlas
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#ifndef _ATLAS_GUARD
+#define _ATLAS_GUARD
+
+#include "image.h"
+
+
+/* The structure for the rectangle of one character in an atlas */
+
+typedef struct {
+	int x, y;						// column and row of the top left pixel
+	int width, height;				// size of the rectangle
+	int label;						// 0 for 'A', 1 for 'B' and so on
+	} atlas_cell;
+
+
+/* The structure for an atlas. 'im' is the whole atlas, binarized */
+
+typedef struct {
+	image im;						// the atlas image
+	atlas_cell * cells;				// rectangles of the characters
+	int num_cells;					// number of characters
+	} atlas;
+
+
+/* load_atlas: This function takes an atlas structure, the name of the atlas
+	bmp file, the name of its index file and a threshold. The image is read
+	with imread_binary (averaging to grey, then binarizing at the threshold)
+	and the index is read in the cells. Cells which are not inside the image
+	or whose label is not a letter from 'A' to 'Z' are skipped with a warning.
+	Returns 0 on success and 1 on failure */
+
+int load_atlas (atlas *, char *, char *, float);
+
+
+/* atlas_view: This function takes an atlas, the number of a cell and a
+	pointer to image structure, and makes the image a view of the character
+	in the cell. The view is valid until free_atlas.
+	Returns 0 on success and 1 on failure */
+
+int atlas_view (atlas *, int, image *);
+
+
+/* free_atlas: This function takes an atlas and releases its image and cells */
+
+void free_atlas (atlas *);
+
+
+#endif
@@ -0,0 +1,676 @@
+/*_____________________________________________________________________________
+bitimage.c: This file provides the implementation of the function prototypes
+	given in bitimage.h
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "bitimage.h"
+
+
+/* allocate_bitimage: This function takes a bit image structure, a width and a
+	height. It allocates the packed rows for the image and clears them.
+	Returns 0 on success and 1 on failure */
+
+int allocate_bitimage (bitimage * b, int width, int height) {
+
+	void * data = NULL;
+	size_t size;
+
+	if (b == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: bit image = %p\n",b);
+		return 1;
+		}
+
+	if (width <= 0 || height <= 0) {
+		fprintf(stderr,"ERROR: Bit image can not be %d x %d\n",width,height);
+		return 1;
+		}
+
+	b->width = width;
+	b->height = height;
+	b->words = (width + 63) / 64;
+	b->inverted = 0;
+
+	size = sizeof(uint64_t) * b->words * height;
+	size = (size + IMAGE_ALIGN - 1) & ~((size_t) IMAGE_ALIGN - 1);
+	if (posix_memalign(&data, IMAGE_ALIGN, size)) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the bit image\n");
+		b->bits = NULL;
+		return 1;
+		}
+
+	/* the padding bits have to be 0, see bitimage.h */
+	memset(data, 0, size);
+	b->bits = (uint64_t *) data;
+	return 0;
+	}
+
+
+
+/* free_bitimage: This function takes a bit image and deallocates its rows */
+
+void free_bitimage (bitimage * b) {
+
+	if (b == NULL)
+		return;
+
+	free(b->bits);
+	b->bits = NULL;
+	b->width = b->height = b->words = 0;
+	}
+
+
+
+/* pack_row: packs a row of grey pixels into a row of the bit image, setting
+	the pixels at or above the threshold, or those below it if invert is 1. A
+	word is built up in a register and stored once, so each row is written
+	exactly once */
+
+static void pack_row (const float * src, int width, float t, int invert, uint64_t * dst) {
+
+	int j;
+
+	for (j=0; j < width; j += 64) {
+		int k, end = width - j < 64 ? width - j : 64;
+		uint64_t w = 0;
+		for (k=0; k < end; k++)
+			w |= (uint64_t) ((src[j+k] >= t) ^ invert) << k;
+		dst[j >> 6] = w;
+		}
+	}
+
+
+
+/* binarize_bits: This function does for a bit image what binarize does for
+	the image itself. It takes a greyscale image, a threshold, a flag telling
+	whether to set the pixels below the threshold instead of those at or
+	above it, and a bit image structure which is allocated and filled.
+	The greyscale image is not altered.
+	Returns 0 on success and 1 on failure */
+
+int binarize_bits (image * im, float t, int invert, bitimage * b) {
+
+	int i;
+
+	if (im == NULL || b == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: image = %p, bit image = %p\n",im,b);
+		return 1;
+		}
+
+	if (im->is_rgb == 1) {
+		fprintf(stderr,"ERROR: Image binarization should be done on greyscale images.\n");
+		return 1;
+		}
+
+	if (allocate_bitimage(b, im->width, im->height))
+		return 1;
+	b->inverted = invert ? 1 : 0;
+
+	for (i=0; i < im->height; i++)
+		pack_row(GREY_ROW(im,i), im->width, t, b->inverted, BIT_ROW(b,i));
+
+	return 0;
+	}
+
+
+
+/* bit_invert: This function takes a bit image and turns every pixel of it
+	over, so that the set pixels become unset and the unset ones set. The
+	'inverted' flag is turned over with them, so the image still stands for
+	the same binarized image */
+
+void bit_invert (bitimage * b) {
+
+	int i,k;
+	/* the bits past the width have to stay 0 */
+	uint64_t tail = b->width & 63 ? ((uint64_t) 1 << (b->width & 63)) - 1 : ~(uint64_t) 0;
+
+	for (i=0; i < b->height; i++) {
+		uint64_t * row = BIT_ROW(b,i);
+		for (k=0; k < b->words; k++)
+			row[k] = ~row[k];
+		row[b->words - 1] &= tail;
+		}
+
+	b->inverted = !b->inverted;
+	}
+
+
+
+/* A kernel counting the set bits of n words. Without -mpopcnt the compiler
+	turns __builtin_popcountll into a library call for every word, so the
+	kernel using the instruction is picked when the processor has it */
+
+typedef long (* popcount_kernel) (const uint64_t *, size_t);
+
+static long popcount_words (const uint64_t * w, size_t n) {
+	size_t i;
+	long count = 0;
+
+	for (i=0; i < n; i++)
+		count += __builtin_popcountll(w[i]);
+	return count;
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("popcnt")))
+static long popcount_words_popcnt (const uint64_t * w, size_t n) {
+	size_t i;
+	long count = 0;
+
+	for (i=0; i < n; i++)
+		count += __builtin_popcountll(w[i]);
+	return count;
+	}
+
+#endif
+
+
+/* select_popcount_kernel: returns the fastest popcount kernel that the
+	processor we are running on supports */
+
+static popcount_kernel select_popcount_kernel (void) {
+#if defined(__x86_64__) || defined(__i386__)
+	static popcount_kernel best = NULL;
+	if (best == NULL) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("popcnt"))
+			best = popcount_words_popcnt;
+		else
+			best = popcount_words;
+		}
+	return best;
+#else
+	return popcount_words;
+#endif
+	}
+
+
+
+/* bit_count: This function takes a bit image and returns the number of
+	set pixels in it */
+
+long bit_count (bitimage * b) {
+
+	/* the padding bits are 0, so all the rows are one run of words */
+	return select_popcount_kernel()(b->bits, (size_t) b->words * b->height);
+	}
+
+
+
+/* bit_bounding_box: This function takes a bit image and four pointers to
+	int. It finds the smallest rectangle holding all the set pixels and stores
+	its first row, first column, last row and last column in them.
+	Returns 0 on success and 1 if there is no set pixel at all */
+
+int bit_bounding_box (bitimage * b, int * top, int * left, int * bottom, int * right) {
+
+	int i,k;
+	int first = -1, last = -1;
+	int lo = b->width, hi = -1;
+
+	/* the first and last set words of a row give its leftmost and rightmost
+	set pixels; the box spans the extremes of those over the rows */
+	for (i=0; i < b->height; i++) {
+		uint64_t * row = BIT_ROW(b,i);
+		int l,r;
+
+		for (l=0; l < b->words && row[l] == 0; l++)
+			;
+		if (l == b->words)
+			continue;
+		for (r=b->words-1; row[r] == 0; r--)
+			;
+
+		if (first < 0)
+			first = i;
+		last = i;
+		k = l * 64 + __builtin_ctzll(row[l]);
+		if (k < lo)
+			lo = k;
+		k = r * 64 + 63 - __builtin_clzll(row[r]);
+		if (k > hi)
+			hi = k;
+		}
+
+	if (first < 0)
+		return 1;
+
+	*top = first;
+	*bottom = last;
+	*left = lo;
+	*right = hi;
+	return 0;
+	}
+
+
+
+/* bit_row_profile: This function takes a bit image and an array of height
+	ints. It stores the number of set pixels of each row in the array. */
+
+void bit_row_profile (bitimage * b, int * prof) {
+
+	int i;
+	popcount_kernel count = select_popcount_kernel();
+
+	for (i=0; i < b->height; i++)
+		prof[i] = count(BIT_ROW(b,i), b->words);
+	}
+
+
+
+/* bit_column_profile: This function takes a bit image and an array of width
+	ints. It stores the number of set pixels of each column in the array. */
+
+void bit_column_profile (bitimage * b, int * prof) {
+
+	int i,k;
+
+	memset(prof, 0, sizeof(int) * b->width);
+
+	/* only visit the set bits. Glyphs are mostly background, so this skips
+	most of the image */
+	for (i=0; i < b->height; i++) {
+		uint64_t * row = BIT_ROW(b,i);
+		for (k=0; k < b->words; k++) {
+			uint64_t w = row[k];
+			while (w) {
+				prof[k * 64 + __builtin_ctzll(w)]++;
+				w &= w - 1;			// clear the lowest set bit
+				}
+			}
+		}
+	}
+
+
+
+/* bit_find: This function takes a packed row, its number of words, a column
+	and a value (0 or 1). It returns the first column at or after the given one
+	whose pixel has the value, or words * 64 if there is none. Whole words
+	without such a pixel are skipped at once */
+
+int bit_find (const uint64_t * row, int words, int pos, int value) {
+
+	uint64_t flip = value ? 0 : ~(uint64_t) 0;
+	int k = pos >> 6;
+	uint64_t w;
+
+	if (k >= words)
+		return words * 64;
+
+	w = (row[k] ^ flip) & (~(uint64_t) 0 << (pos & 63));
+	while (w == 0) {
+		if (++k == words)
+			return words * 64;
+		w = row[k] ^ flip;
+		}
+
+	return k * 64 + __builtin_ctzll(w);
+	}
+
+
+
+/* bit_set_range: This function takes a packed row, a first column and a
+	number of pixels. It sets that many pixels of the row from the column on,
+	a whole word at a time */
+
+void bit_set_range (uint64_t * row, int from, int count) {
+
+	int end = from + count;
+
+	while (from < end) {
+		int off = from & 63;
+		int n = 64 - off < end - from ? 64 - off : end - from;
+		row[from >> 6] |= (n == 64 ? ~(uint64_t) 0 : (((uint64_t) 1 << n) - 1)) << off;
+		from += n;
+		}
+	}
+
+
+
+/* bit_image_vector: This is get_image_vector for a bit image. It takes a bit
+	image and a pointer to an array of width * height floats and fills it
+	rowwise with the values binarize would have given the pixels, 1.0 or 0.0.
+	NOTE: Assumes enough memory is allocated for the vector */
+
+void bit_image_vector (bitimage * b, float * vect) {
+
+	int i,j;
+
+	for (i=0; i < b->height; i++) {
+		uint64_t * row = BIT_ROW(b,i);
+		float * dst = vect + (size_t) i * b->width;
+		for (j=0; j < b->width; j++)
+			dst[j] = (float) (((row[j >> 6] >> (j & 63)) & 1) ^ b->inverted);
+		}
+	}
+
+
+
+/* reverse_byte: returns byte c with the order of its bits reversed */
+
+static unsigned char reverse_byte (unsigned char c) {
+	return (unsigned char) (((c * 0x0202020202ULL) & 0x010884422010ULL) % 1023);
+	}
+
+
+
+/* bit_run: rle_run for a bit image. Only the runs of pixels that binarize
+	would make 1 are touched, whole words at a time, so the background is
+	never written at all */
+
+typedef struct {
+	bitimage * b;
+	unsigned char on[256];			// binary value of each pixel value
+	} bit_target;
+
+static void bit_run (void * arg, int i, int j, int count, const unsigned char * px, int repeat) {
+
+	bit_target * t = (bit_target *) arg;
+	uint64_t * row = BIT_ROW(t->b,i);
+	int k;
+
+	if (repeat) {
+		if (t->on[px[0]])
+			bit_set_range(row, j, count);
+		}
+	else {
+		for (k=0; k < count; k++)
+			if (t->on[px[k]])
+				row[(j+k) >> 6] |= (uint64_t) 1 << ((j+k) & 63);
+		}
+	}
+
+
+
+/* imdecode_bits: This function takes a buffer holding an entire bmp file, the
+	length of the buffer, a bit image structure and a threshold. It decodes
+	the file into the bit image, with the pixels set that imdecode_binary
+	(averaging) would make 1. The rows of a 1 bit image are copied into the
+	bit image as they are, only turning the bits of every byte around, so no
+	pixel is ever unpacked. Which palette entry is the set one is recorded in
+	'inverted'. The runs of RLE8 and RLE4 images are binarized as they are
+	expanded. Images of other depths are decoded with imdecode_binary and
+	packed with binarize_bits.
+	Returns 0 on success and 1 on failure */
+
+int imdecode_bits (const unsigned char * buf, size_t len, bitimage * b, float t) {
+
+	header h;
+	int i,k;
+	int on[2];
+
+	if (buf == NULL || b == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: buffer = %p, bit image = %p\n",buf,b);
+		return 1;
+		}
+
+	if (parse_header(&h, buf, len)) {
+		fprintf(stderr,"ERROR: Parsing the header failed\n");
+		return 1;
+		}
+
+	if (h.comp) {
+		/* run length encoded: the runs are binarized as they come */
+		bit_target bt;
+		const unsigned char * pal = buf + 14 + h.hsize;
+		for (i=0; i < 256; i++) {
+			int sum = i < h.num_c ? pal[4*i] + pal[4*i + 1] + pal[4*i + 2] : 0;
+			bt.on[i] = ((float) sum) / 3 >= t;		// as averaging would
+			}
+		if (allocate_bitimage(b, h.width, h.height))
+			return 1;
+		bt.b = b;
+		if (rle_decode(buf + h.offset, len - h.offset, &h, bit_run, &bt)) {
+			free_bitimage(b);
+			return 1;
+			}
+		return 0;
+		}
+
+	if (h.bits != 1) {
+		image im;
+		int ret;
+
+		memset(&im, 0, sizeof(image));
+		if (imdecode_binary(buf, len, &im, 'A', t))
+			return 1;
+		ret = binarize_bits(&im, 1.0, 0, b);
+		free_image(&im);
+		return ret;
+		}
+
+	/* binary value of the two palette entries. An entry missing from the
+	palette is black */
+	const unsigned char * pal = buf + 14 + h.hsize;
+	for (i=0; i < 2; i++) {
+		int sum = i < h.num_c ? pal[4*i] + pal[4*i + 1] + pal[4*i + 2] : 0;
+		on[i] = ((float) sum) / 3 >= t;		// as averaging would
+		}
+
+	if (allocate_bitimage(b, h.width, h.height))
+		return 1;
+
+	if (on[0] == on[1]) {
+		/* both entries are on the same side of the threshold, so all the
+		pixels are the same */
+		if (on[0]) {
+			for (i=0; i < b->height; i++) {
+				uint64_t * dst = BIT_ROW(b,i);
+				memset(dst, 0xff, sizeof(uint64_t) * b->words);
+				if (b->width & 63)
+					dst[b->words-1] = ((uint64_t) 1 << (b->width & 63)) - 1;
+				}
+			}
+		return 0;
+		}
+
+	/* pixels of palette entry 1 are the set bits of the file. They are the
+	ones at or above the threshold unless entry 0 is the brighter one */
+	b->inverted = on[0];
+
+	size_t row_bytes = (((size_t) h.width + 31) / 32) * 4;
+	size_t nbytes = ((size_t) h.width + 7) / 8;
+	const unsigned char * row = buf + h.offset;
+
+	for (i=h.height-1; i >= 0; i--, row += row_bytes) {
+		uint64_t * dst = BIT_ROW(b,i);
+		size_t n;
+		for (k=0; k < b->words; k++) {
+			uint64_t w = 0;
+			for (n=0; n < 8 && 8*(size_t)k + n < nbytes; n++)
+				w |= (uint64_t) reverse_byte(row[8*k + n]) << (8*n);
+			dst[k] = w;
+			}
+		/* the bits past the width have to stay 0 */
+		if (b->width & 63)
+			dst[b->words-1] &= ((uint64_t) 1 << (b->width & 63)) - 1;
+		}
+
+	return 0;
+	}
+
+
+
+/* imread_bits: This function takes a string, a bit image structure and a
+	threshold. It maps the named bmp file and decodes it into the bit image
+	(see imdecode_bits).
+	Returns 0 on success and 1 on failure */
+
+int imread_bits (char * imname, bitimage * b, float t) {
+
+	size_t len;
+	unsigned char * map = map_image(imname, &len);
+
+	if (map == NULL)
+		return 1;
+
+	int ret = imdecode_bits(map, len, b, t);
+
+	munmap(map, len);
+	return ret;
+	}
+
+
+
+/* bands_otsu: binarizes the bands of a reader at the Otsu threshold of the
+	histogram of all of them. Returns 0 on success and 1 on failure */
+
+static int bands_otsu (band_reader * br, bitimage * b) {
+
+	unsigned int hist[256] = {0};
+	image * band;
+	int i,j,got;
+	float t;
+
+	while ((got = read_band(br, &band)) > 0)
+		for (j=0; j < 256; j++)
+			hist[j] += band->hist[j];
+	if (got < 0)
+		return 1;
+
+	t = otsu_threshold(hist);
+	rewind_bands(br);
+	while ((got = read_band(br, &band)) > 0)
+		for (i=0; i < band->height; i++)
+			pack_row(GREY_ROW(band,i), band->width, t, 1, BIT_ROW(b, br->top + i));
+
+	return got < 0;
+	}
+
+
+
+/* bands_local: binarizes the bands of a reader by a local method. The grey
+	rows read but not yet binarized, and the half window of rows above them,
+	are kept in 'rows'. Every band read makes the rows up to half a window
+	above its bottom final (all of them after the last band): a copy of the
+	kept rows is binarized and those rows are packed.
+	Returns 0 on success and 1 on failure */
+
+static int bands_local (band_reader * br, char method, int window, float k, bitimage * b) {
+
+	int i,got,half = window / 2;
+	int top = 0, count = 0, done = 0;
+	size_t width = br->h.width;
+	size_t size = sizeof(float) * width * (br->rows + 2 * half);
+	float * rows, * work;
+	image chunk;
+	image * band;
+
+	rows = (float *) malloc (size);
+	work = (float *) malloc (size);
+	if (rows == NULL || work == NULL) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the rows around a band\n");
+		free(rows);
+		free(work);
+		return 1;
+		}
+
+	memset(&chunk, 0, sizeof(image));
+	chunk.g_data = work;
+	chunk.width = br->h.width;
+	chunk.stride = br->h.width;
+
+	while ((got = read_band(br, &band)) > 0) {
+		int end, keep = done - half > top ? done - half : top;
+
+		/* the rows more than half a window above the first row left to
+		binarize are not needed any more */
+		memmove(rows, rows + (size_t) (keep - top) * width, sizeof(float) * width * (top + count - keep));
+		count -= keep - top;
+		top = keep;
+		memcpy(rows + (size_t) count * width, GREY_ROW(band,0), sizeof(float) * width * band->height);
+		count += band->height;
+
+		end = br->next >= br->h.height ? br->h.height : top + count - half;
+		if (end <= done)
+			continue;
+
+		memcpy(work, rows, sizeof(float) * width * count);
+		chunk.height = count;
+		chunk.h.height = count;
+		if (binarize_local(&chunk, method, window, k, 0)) {
+			got = -1;
+			break;
+			}
+		for (i=done; i < end; i++)
+			pack_row(GREY_ROW(&chunk, i - top), chunk.width, 0.5, 1, BIT_ROW(b,i));
+		done = end;
+		}
+
+	free(rows);
+	free(work);
+	return got < 0;
+	}
+
+
+
+/* imread_bits_bands: This function takes a string, a number of rows, a
+	binarization method, a window size, a weight and a bit image structure.
+	It reads the named bmp file in bands of that many rows (see read_band) and
+	binarizes them into the bit image, the dark pixels being the set ones, so
+	only one band of greyscale pixels is in memory at any time whatever the
+	size of the page. The method is 'O' for one threshold picked by Otsu's
+	method from the histogram of the whole image (the file is then read
+	twice), or 'S' or 'N' for Sauvola's or Niblack's threshold over a window
+	of that many pixels, with that weight of the deviation (see
+	binarize_local). For those the grey rows within half a window of a band
+	are kept along with it, so the result is the one of the whole image.
+	Returns 0 on success and 1 on failure */
+
+int imread_bits_bands (char * imname, int rows, char method, int window, float k, bitimage * b) {
+
+	band_reader br;
+	int failed;
+
+	if (imname == NULL || b == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: image name = %p, bit image = %p\n",imname,b);
+		return 1;
+		}
+
+	if (method != 'O' && window < 1) {
+		fprintf(stderr,"ERROR: Window for local binarization can not be %d pixels\n",window);
+		return 1;
+		}
+
+	if (open_bands(&br, imname, rows, 'L'))
+		return 1;
+	if (allocate_bitimage(b, br.h.width, br.h.height)) {
+		close_bands(&br);
+		return 1;
+		}
+	b->inverted = 1;
+
+	if (method == 'O')
+		failed = bands_otsu(&br, b);
+	else
+		failed = bands_local(&br, method, window, k, b);
+
+	close_bands(&br);
+	if (failed)
+		free_bitimage(b);
+	return failed;
+	}
@@ -0,0 +1,193 @@
+/*_____________________________________________________________________________
+bitimage.h: This is a header file for giving binary images packed one bit per
+	pixel, and the basic operations on them.
+	After binarization every pixel is 0 or 1, so there is no need to keep it as
+	a float. A packed 46x46 glyph needs 368 bytes instead of about 8.5 KB, and
+	counting or finding pixels becomes a matter of popcounts over 64 bit words.
+	Current functions include following:
+		allocate_bitimage:		Allocate a cleared bit image of given size
+		free_bitimage:			Release the memory held by a bit image
+		binarize_bits:			Binarize a greyscale image into a bit image
+		bit_invert:				Turn every pixel of a bit image over
+		bit_count:				Count the set pixels of a bit image
+		bit_bounding_box:		Find the bounding box of the set pixels
+		bit_row_profile:		Count the set pixels in each row
+		bit_column_profile:		Count the set pixels in each column
+		bit_find:				Find the next pixel of a value in a packed row
+		bit_set_range:			Set a range of pixels of a packed row
+		bit_image_vector:		Convert a bit image to a network input vector
+		imdecode_bits:			Decode a bmp file held in memory in a bit image
+		imread_bits:			Read a bmp file in a bit image
+		imread_bits_bands:		Read and binarize a bmp file a band at a time
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#ifndef _BITIMAGE_GUARD
+#define _BITIMAGE_GUARD
+
+#include <stdint.h>
+#include "image.h"
+
+
+/* The structure for a packed binary image.
+	Every row is 'words' 64 bit words long, rows following each other in one
+	aligned block. Pixel j of a row is bit (j % 64) of word (j / 64), so the
+	leftmost pixel is the lowest bit of the first word. The bits past the
+	width of the image are always 0, so whole words can be counted.
+	'inverted' records which pixels are set. It is 0 when the set pixels are
+	those binarize would make 1 (at or above the threshold) and 1 when the set
+	pixels are those below the threshold, which is what we want when the ink
+	is darker than the paper. */
+
+typedef struct {
+	uint64_t * bits;				// the packed rows
+	int width, height;				// dimensions of the image
+	int words;						// 64 bit words in each row
+	int inverted;					// set pixels are the ones below threshold
+	} bitimage;
+
+
+/* accessors for the packed rows. BIT_ROW gives the first word of row i and
+	BIT_PIXEL gives the pixel at row i and column j as 0 or 1 */
+
+#define BIT_ROW(b,i)		((b)->bits + (size_t) (i) * (b)->words)
+#define BIT_PIXEL(b,i,j)	((int) ((BIT_ROW(b,i)[(j) >> 6] >> ((j) & 63)) & 1))
+#define BIT_SET(b,i,j)		(BIT_ROW(b,i)[(j) >> 6] |= (uint64_t) 1 << ((j) & 63))
+
+
+/* allocate_bitimage: This function takes a bit image structure, a width and a
+	height. It allocates the packed rows for the image and clears them.
+	Returns 0 on success and 1 on failure */
+
+int allocate_bitimage (bitimage *, int, int);
+
+
+/* free_bitimage: This function takes a bit image and deallocates its rows */
+
+void free_bitimage (bitimage *);
+
+
+/* binarize_bits: This function does for a bit image what binarize does for
+	the image itself. It takes a greyscale image, a threshold, a flag telling
+	whether to set the pixels below the threshold instead of those at or
+	above it, and a bit image structure which is allocated and filled.
+	The greyscale image is not altered.
+	Returns 0 on success and 1 on failure */
+
+int binarize_bits (image *, float, int, bitimage *);
+
+
+/* bit_invert: This function takes a bit image and turns every pixel of it
+	over, so that the set pixels become unset and the unset ones set. The
+	'inverted' flag is turned over with them, so the image still stands for
+	the same binarized image */
+
+void bit_invert (bitimage *);
+
+
+/* bit_count: This function takes a bit image and returns the number of
+	set pixels in it */
+
+long bit_count (bitimage *);
+
+
+/* bit_bounding_box: This function takes a bit image and four pointers to
+	int. It finds the smallest rectangle holding all the set pixels and stores
+	its first row, first column, last row and last column in them.
+	Returns 0 on success and 1 if there is no set pixel at all */
+
+int bit_bounding_box (bitimage *, int *, int *, int *, int *);
+
+
+/* bit_row_profile: This function takes a bit image and an array of height
+	ints. It stores the number of set pixels of each row in the array. */
+
+void bit_row_profile (bitimage *, int *);
+
+
+/* bit_column_profile: This function takes a bit image and an array of width
+	ints. It stores the number of set pixels of each column in the array. */
+
+void bit_column_profile (bitimage *, int *);
+
+
+/* bit_find: This function takes a packed row, its number of words, a column
+	and a value (0 or 1). It returns the first column at or after the given one
+	whose pixel has the value, or words * 64 if there is none. Whole words
+	without such a pixel are skipped at once */
+
+int bit_find (const uint64_t *, int, int, int);
+
+
+/* bit_set_range: This function takes a packed row, a first column and a
+	number of pixels. It sets that many pixels of the row from the column on,
+	a whole word at a time */
+
+void bit_set_range (uint64_t *, int, int);
+
+
+/* bit_image_vector: This is get_image_vector for a bit image. It takes a bit
+	image and a pointer to an array of width * height floats and fills it
+	rowwise with the values binarize would have given the pixels, 1.0 or 0.0.
+	NOTE: Assumes enough memory is allocated for the vector */
+
+void bit_image_vector (bitimage *, float *);
+
+
+/* imdecode_bits: This function takes a buffer holding an entire bmp file, the
+	length of the buffer, a bit image structure and a threshold. It decodes
+	the file into the bit image, with the pixels set that imdecode_binary
+	(averaging) would make 1. The rows of a 1 bit image are copied into the
+	bit image as they are, only turning the bits of every byte around, so no
+	pixel is ever unpacked. Which palette entry is the set one is recorded in
+	'inverted'. The runs of RLE8 and RLE4 images are binarized as they are
+	expanded. Images of other depths are decoded with imdecode_binary and
+	packed with binarize_bits.
+	Returns 0 on success and 1 on failure */
+
+int imdecode_bits (const unsigned char *, size_t, bitimage *, float);
+
+
+/* imread_bits: This function takes a string, a bit image structure and a
+	threshold. It maps the named bmp file and decodes it into the bit image
+	(see imdecode_bits).
+	Returns 0 on success and 1 on failure */
+
+int imread_bits (char *, bitimage *, float);
+
+
+/* imread_bits_bands: This function takes a string, a number of rows, a
+	binarization method, a window size, a weight and a bit image structure.
+	It reads the named bmp file in bands of that many rows (see read_band) and
+	binarizes them into the bit image, the dark pixels being the set ones, so
+	only one band of greyscale pixels is in memory at any time whatever the
+	size of the page. The method is 'O' for one threshold picked by Otsu's
+	method from the histogram of the whole image (the file is then read
+	twice), or 'S' or 'N' for Sauvola's or Niblack's threshold over a window
+	of that many pixels, with that weight of the deviation (see
+	binarize_local). For those the grey rows within half a window of a band
+	are kept along with it, so the result is the one of the whole image.
+	Returns 0 on success and 1 on failure */
+
+int imread_bits_bands (char *, int, char, int, float, bitimage *);
+
+
+#endif
@@ -31,21 +31,89 @@
 #include <string.h>
 #include "image.h"
 #include "neural.h"
+#include "dataset.h"
+#include "loader.h"
+#include "atlas.h"
+#include "normalize.h"
+#include "segment.h"
+#include "extractor.h"
+#include "trainer.h"
 
 
 #define TRAINING_DATA 52
 #define MAX_NAME_LEN 20
 #define TRAINING_SESSIONS 320
 #define TEST_DATA 24
+#define TRAINING_CACHE "supervisor.cache"
+#define LOADER_THREADS 0					// one loader thread per processor
+#define LOADER_DEPTH 0						// twice as many queued images as threads
+#define INGEST_DEPTH 64						// files in flight with -b
+#define INPUT_WIDTH 46						// glyphs are fed to the network at this size
+#define INPUT_HEIGHT 46
+#define GLYPH_LEN (INPUT_WIDTH*INPUT_HEIGHT)
+#define FEATURE_COLS 12						// grid of the zoning, pooling and histograms
+#define FEATURE_ROWS 12
+#define LINE_GAP 0.2						// blank rows between two lines, per row of line height
+#define WORD_GAP 0.35						// blank columns between two words, per row of line height
+#define LOCAL_K 0.34						// weight of the deviation in the Sauvola threshold
+#define PAGE_BAND 64						// rows of a page read and binarized at once
+#define DEFAULT_BATCH 32					// samples in a mini-batch with -j
 
 void parse_supervisor_data(char * charnames[],int charresults[]);
 void train (char * charnames[],int charresults[]);
 void unit_test(char * charnames[],int charresults[]);
 void test ();
+void prepare_atlas ();
+void prepare_dataset (char * charnames[],int charresults[]);
+int training_samples ();
+int training_sample (int k);
+void read_page (char * pagename);
 
 
-image im;
 ann n;
+dataset ds;
+atlas at;
+extractor fx;
+float glyph[GLYPH_LEN];
+
+/* image reader used for all the images. The stdio one by default, the mmap one
+   when the program is started with -m so that both can be timed against each other */
+int (* reader) (char *, image *) = imread;
+
+/* with -b the training images are read in batches through ingest_files (with -t
+   through its thread pool rather than io_uring) and the throughput is printed */
+char ingest_method = 0;
+
+/* with -a the training images are the cells of an atlas instead of the files
+   listed in supervisor.txt */
+char * atlas_image = NULL;
+char * atlas_index = NULL;
+
+/* with -p the network reads the page in the named bmp file instead of running
+   the unit tests. Glyphs cut from a page are normalized, so then the training
+   glyphs are normalized as well */
+char * page_image = NULL;
+
+/* with -L the page is binarized by Sauvola's method over windows of that many
+   pixels (see binarize_local), for pages lit unevenly, instead of at the one
+   threshold picked by Otsu's method (see binarize_auto) */
+int local_window = 0;
+
+/* with -f the network is fed the features of the glyphs (see extractor.h) and
+   not their pixels, and its input is as long as the features */
+char feature_method = 'R';
+
+/* with -B the network is trained on mini-batches of that many samples, its
+   weights being updated once for every batch (see err_backpropogation_batch)
+   instead of after every sample */
+int batch_size = 1;
+
+/* with -j the mini-batches are trained with that many threads (0 for one per
+   processor) through a trainer (see trainer.h), in batches of DEFAULT_BATCH
+   samples unless -B says otherwise. -H makes the threads step the weights
+   Hogwild style, without waiting for each other */
+int train_threads = 1;
+int hogwild = 0;
 
 
 void main (int argc, char ** argv) {
@@ -55,7 +123,39 @@ void main (int argc, char ** argv) {
 	char * charnames[TRAINING_DATA];
 	int charresults[TRAINING_DATA];
 
-	initialize_ann(&n,0.005, 2, 46*46,nnum);
+	for (i=1; i < argc; i++) {
+		if (strcmp(argv[i],"-m") == 0)
+			reader = imread_mmap;
+		else if (strcmp(argv[i],"-b") == 0 && ingest_method == 0)
+			ingest_method = 'U';
+		else if (strcmp(argv[i],"-t") == 0)
+			ingest_method = 'T';
+		else if (strcmp(argv[i],"-a") == 0 && i + 2 < argc) {
+			atlas_image = argv[++i];
+			atlas_index = argv[++i];
+			}
+		else if (strcmp(argv[i],"-p") == 0 && i + 1 < argc)
+			page_image = argv[++i];
+		else if (strcmp(argv[i],"-L") == 0 && i + 1 < argc)
+			local_window = atoi(argv[++i]);
+		else if (strcmp(argv[i],"-f") == 0 && i + 1 < argc)
+			feature_method = argv[++i][0];
+		else if (strcmp(argv[i],"-B") == 0 && i + 1 < argc)
+			batch_size = atoi(argv[++i]);
+		else if (strcmp(argv[i],"-j") == 0 && i + 1 < argc)
+			train_threads = atoi(argv[++i]);
+		else if (strcmp(argv[i],"-H") == 0)
+			hogwild = 1;
+		}
+
+	if ((train_threads != 1 || hogwild) && batch_size <= 1)
+		batch_size = DEFAULT_BATCH;
+
+	if (init_extractor(&fx, feature_method, INPUT_WIDTH, INPUT_HEIGHT, FEATURE_COLS, FEATURE_ROWS)) {
+		printf("Could not set up the feature extractor\n");
+		exit(0);
+		}
+	initialize_ann(&n,0.005, 2, fx.length,nnum);
 
 	for (i=0; i < TRAINING_DATA; i++) {
 		charnames[i] = (char *) malloc (sizeof(char) * MAX_NAME_LEN);
@@ -65,7 +165,10 @@ void main (int argc, char ** argv) {
 			}
 		}
 	train(charnames,charresults);
-	unit_test(charnames,charresults);
+	if (page_image)
+		read_page(page_image);
+	else
+		unit_test(charnames,charresults);
 //	test();
 //	print_ann(&n);
 
@@ -84,19 +187,16 @@ return;
 		scanf("%s",testname);
 
 		printf("Reading image %s\n",testname);
-		imread(testname,&im);
-		colour_to_grey(&im,'A');
-		binarize(&im,120);
-		get_image_vector(&im,n.in);
-		fwd_propogation (&n);
-		for (i=0; i < 26; i++ ) {
-			j = (int) n.outputs[1][i];
-			if (j != 0)
-				printf("%c ",i+'A');
+		if (imread_vector(testname, glyph, GLYPH_LEN, 120) == 0) {
+			extract_features(&fx, glyph, n.in);
+			fwd_propogation (&n);
+			for (i=0; i < 26; i++ ) {
+				j = (int) n.outputs[1][i];
+				if (j != 0)
+					printf("%c ",i+'A');
+				}
+			printf("\n");
 			}
-		printf("\n");
-
-		free_image(&im);
 
 		printf("Want to test another character? (y/n): ");
 		getc(stdin);
@@ -105,6 +205,7 @@ return;
 		} while ( choice == 'y' || choice == 'Y' );
 
 	free_ann(&n);
+	free_extractor(&fx);
 	}
 
 
@@ -113,33 +214,253 @@ return;
 void train (char * charnames[],int charresults[]) {
 	int i,j,k;
 	int max_sessions = TRAINING_SESSIONS;
-	char *imname;
 	int err = 0;
+	int samples;
+	int num_out = n.num_neurons[n.num_layers-1];
+	float * inputs, * targets, * outputs;
+	int * labels;
+	trainer tr;
 	
-	parse_supervisor_data(charnames,charresults);
+	if (atlas_image)
+		prepare_atlas();
+	else
+		prepare_dataset(charnames,charresults);
+
+	/* the inputs of the samples are made once, and not again in every session */
+	samples = training_samples();
+	inputs = (float *) malloc (sizeof(float) * samples * n.num_in);
+	labels = (int *) malloc (sizeof(int) * samples);
+	targets = (float *) calloc (samples * num_out, sizeof(float));
+	outputs = (float *) malloc (sizeof(float) * (batch_size > 1 ? batch_size : 1) * num_out);
+	if (inputs == NULL || labels == NULL || targets == NULL || outputs == NULL) {
+		printf("Could not allocate memory for the training inputs\n");
+		exit(0);
+		}
+	for (k=0; k < samples; k++) {
+		labels[k] = training_sample(k);
+		if (labels[k] < 0 || labels[k] >= num_out) {
+			printf("Training sample %d has label %d, but the network has only %d outputs\n",k,labels[k],num_out);
+			exit(0);
+			}
+		memcpy(inputs + k * n.num_in, n.in, sizeof(float) * n.num_in);
+		targets[k * num_out + labels[k]] = 1;
+		}
+
+	if ((train_threads != 1 || hogwild) && start_trainer(&tr, &n, batch_size, train_threads, hogwild)) {
+		printf("Could not start the trainer\n");
+		exit(0);
+		}
 
 	for (i=0; i < max_sessions; i++) {
 		err=0;
-		for (k=0; k < TRAINING_DATA; k++) {
+		for (k=0; batch_size > 1 && k < samples; k += batch_size) {
+			int count = (samples - k < batch_size ? samples - k : batch_size);
+			if (train_threads != 1 || hogwild) {
+				if (train_batch(&tr, inputs + k * n.num_in, count, targets + k * num_out, outputs))
+					exit(0);
+				}
+			else if (err_backpropogation_batch(&n, inputs + k * n.num_in, count,
+					targets + k * num_out, outputs) == 0)
+				exit(0);
+			for (j=0; j < count * num_out; j++) {
+				if (outputs[j] != targets[k * num_out + j])
+					err++;
+				}
+			}
+		for (k=0; batch_size <= 1 && k < samples; k++) {
 			for (j=0; j < 26; j++) 
 				n.ex_output[j] = 0;
 			
-			n.ex_output[charresults[k]]=1;
-			imname = charnames[k];
-			imread(imname, &im);
-			colour_to_grey(&im,'A');
-			binarize(&im,120);
-			get_image_vector(&im,n.in);
+			n.ex_output[labels[k]]=1;
+			memcpy(n.in, inputs + k * n.num_in, sizeof(float) * n.num_in);
 			fwd_propogation (&n);
 			for (j=0; j < 26; j++) {
 				if (n.outputs[1][j] != n.ex_output[j])
 					err++;
 				}
 			err_backpropogation (&n);
-			free_image(&im);
 			}
 		printf("session %d: error %d\n",i,err);		
 		}
+
+	if (train_threads != 1 || hogwild)
+		stop_trainer(&tr);
+	free(inputs);
+	free(labels);
+	free(targets);
+	free(outputs);
+	if (!atlas_image)
+		free_dataset(&ds);
+	}
+
+
+
+/* prepare_atlas: reads the training atlas. Its cells are used in place, as
+	views into the atlas */
+
+void prepare_atlas () {
+
+	if (load_atlas(&at, atlas_image, atlas_index, 120)) {
+		printf("Could not read the atlas %s\n",atlas_image);
+		exit(0);
+		}
+	}
+
+
+
+/* prepare_dataset: decodes the training images listed in supervisor.txt into
+	the dataset */
+
+void prepare_dataset (char * charnames[],int charresults[]) {
+
+	parse_supervisor_data(charnames,charresults);
+
+	/* decode the training images only once. If a cache of them is newer than the
+	images and the supervisor file, we do not even have to do that */
+	if (! (dataset_is_fresh(TRAINING_CACHE, "supervisor.txt", charnames, TRAINING_DATA) &&
+			load_dataset(&ds, TRAINING_CACHE) == 0 && ds.vec_len == GLYPH_LEN)) {
+		if (ds.map)
+			free_dataset(&ds);		// stale or wrong sized cache
+		if (ingest_method) {
+			ingest_stats st;
+			if (ingest_dataset(&ds, charnames, charresults, TRAINING_DATA, GLYPH_LEN, 120,
+					INGEST_DEPTH, ingest_method, &st)) {
+				printf("Could not decode the training images\n");
+				exit(0);
+				}
+			print_ingest_stats(&st);
+			}
+		else if (build_dataset(&ds, charnames, charresults, TRAINING_DATA, GLYPH_LEN, reader, 120)) {
+			printf("Could not decode the training images\n");
+			exit(0);
+			}
+		save_dataset(&ds, TRAINING_CACHE);
+		}
+	}
+
+
+
+/* training_samples: returns the number of samples in the training set */
+
+int training_samples () {
+	return atlas_image ? at.num_cells : ds.num_samples;
+	}
+
+
+
+/* training_sample: puts the features of the k-th training sample in the input
+	of the network and returns its label. Atlas cells are gathered straight from the atlas
+	pixels, with no copy of the glyph in between. Cells of the input size are
+	taken as they are, cells of any other size are normalized to it. When a
+	page is to be read every sample is normalized */
+
+int training_sample (int k) {
+
+	image view;
+
+	if (atlas_image) {
+		atlas_view(&at, k, &view);
+		if (view.width == INPUT_WIDTH && view.height == INPUT_HEIGHT && !page_image)
+			get_image_vector(&view, glyph);
+		else if (normalize_glyph(&view, 0.5, INPUT_WIDTH, INPUT_HEIGHT, glyph)) {
+			printf("Could not normalize the atlas cell %d\n",k);
+			exit(0);
+			}
+		extract_features(&fx, glyph, n.in);
+		return at.cells[k].label;
+		}
+
+	if (page_image) {
+		/* the row is a binarized glyph of the input size; look at it as an image */
+		memset(&view, 0, sizeof(image));
+		view.g_data = DATASET_ROW(&ds,k);
+		view.width = view.stride = INPUT_WIDTH;
+		view.height = INPUT_HEIGHT;
+		if (normalize_glyph(&view, 0.5, INPUT_WIDTH, INPUT_HEIGHT, glyph)) {
+			printf("Could not normalize the training sample %d\n",k);
+			exit(0);
+			}
+		extract_features(&fx, glyph, n.in);
+		}
+	else
+		extract_features(&fx, DATASET_ROW(&ds,k), n.in);
+	return ds.labels[k];
+	}
+
+
+
+/* read_page: reads the text of a page. The page is read and binarized a band
+	of rows at a time (see local_window and imread_bits_bands), its lines are measured and it is cut into lines and glyphs at gaps in
+	proportion to their height. The glyphs of every line are run through the
+	network as one batch. The first letter the network gives for a glyph is
+	printed, or '?' if it gives none */
+
+void read_page (char * pagename) {
+
+	bitimage b;
+	page_layout p;
+	float * batch, * features, * out;
+	int i,j,k,longest = 1;
+	int height,line_gap,word_gap;
+	int num_out = n.num_neurons[n.num_layers-1];
+
+	/* the ink is dark, so it is set in the bit image */
+	if (imread_bits_bands(pagename, PAGE_BAND, local_window > 0 ? 'S' : 'O', local_window, LOCAL_K, &b)) {
+		printf("Could not read the page %s\n",pagename);
+		return;
+		}
+
+	/* the gaps are rounded and kept at least 1 for lines a few rows high */
+	height = measure_line_height(&b);
+	line_gap = (int) (LINE_GAP * height + 0.5);
+	word_gap = (int) (WORD_GAP * height + 0.5);
+	if (height < 0 || segment_page(&b, line_gap > 1 ? line_gap : 1, word_gap > 1 ? word_gap : 1, &p)) {
+		free_bitimage(&b);
+		return;
+		}
+
+	for (i=0; i < p.num_lines; i++) {
+		if (p.lines[i].count > longest)
+			longest = p.lines[i].count;
+		}
+	batch = (float *) malloc (sizeof(float) * longest * GLYPH_LEN);
+	features = (float *) malloc (sizeof(float) * longest * n.num_in);
+	out = (float *) malloc (sizeof(float) * longest * num_out);
+	if (batch == NULL || features == NULL || out == NULL) {
+		printf("Could not allocate memory for the glyphs of a line\n");
+		free(batch);
+		free(features);
+		free(out);
+		free_layout(&p);
+		free_bitimage(&b);
+		return;
+		}
+
+	printf("Page %s: %d lines, %d glyphs\n",pagename,p.num_lines,p.num_glyphs);
+	for (i=0; i < p.num_lines; i++) {
+		text_line * l = &p.lines[i];
+		if (line_batch(&b, &p, i, INPUT_WIDTH, INPUT_HEIGHT, batch))
+			break;
+		for (k=0; k < l->count; k++)
+			extract_features(&fx, batch + k * GLYPH_LEN, features + k * n.num_in);
+		if (fwd_propogation_batch(&n, features, l->count, out) == 0)
+			break;
+		for (k=0; k < l->count; k++) {
+			float * o = out + k * num_out;
+			if (k > 0 && p.glyphs[l->first + k].word != p.glyphs[l->first + k - 1].word)
+				printf(" ");
+			for (j=0; j < num_out && ((int) o[j]) == 0; j++)
+				;
+			printf("%c",j < num_out ? j+'A' : '?');
+			}
+		printf("\n");
+		}
+
+	free(batch);
+	free(features);
+	free(out);
+	free_layout(&p);
+	free_bitimage(&b);
 	}
 
 
@@ -177,14 +498,31 @@ void unit_test(char * charnames[],int charresults[]) {
 
 	char * imname;
 	int i,j;
+	float * vect;
+	loader l;
 
 	printf("Starting unit tests\n");
-	for (i=0; i < TRAINING_DATA; i++) {
+	if (atlas_image) {
+		for (i=0; i < at.num_cells; i++) {
+			j = training_sample(i);
+			fwd_propogation (&n);
+			printf("Atlas cell: %d, expected result: %c, Actual result: ",i,j+'A');
+			for (j=0; j < 26; j++ ) {
+				if ( ((int) n.outputs[1][j]) != 0)
+					printf("%c ",j+'A');
+				}
+			printf("\n");
+			}
+		free_atlas(&at);
+		return;
+		}
+
+	/* the loader decodes the next images while the network runs on this one */
+	if (start_loader(&l, charnames, TRAINING_DATA, GLYPH_LEN, 120, LOADER_THREADS, LOADER_DEPTH))
+		return;
+	while (loader_next(&l, &vect, &i)) {
 		imname = charnames[i];
-		imread(imname, &im);
-		colour_to_grey(&im,'A');
-		binarize(&im,120);
-		get_image_vector(&im,n.in);
+		extract_features(&fx, vect, n.in);
 		fwd_propogation (&n);
 		printf("Test image name: %s, expected result: %c, Actual result: ",imname,charresults[i]+'A');
 		for (j=0; j < 26; j++ ) {
@@ -193,6 +531,7 @@ void unit_test(char * charnames[],int charresults[]) {
 			}
 		printf("\n");
 		}
+	stop_loader(&l);
 	}
 
 
@@ -200,9 +539,12 @@ void unit_test(char * charnames[],int charresults[]) {
 void test () {
 
 	char testlist[] = "test.txt";
-	char testname[MAX_NAME_LEN];
+	char testname[TEST_DATA][MAX_NAME_LEN];
+	char * testnames[TEST_DATA];
 	int i,j,k;
+	float * vect;
 	FILE * fp;
+	loader l;
 
 	fp = fopen(testlist,"r");
 	if (fp == NULL) {
@@ -210,22 +552,22 @@ void test () {
 		exit(0);
 		}
 	
-	for (i=0; i < TEST_DATA; i++) {
-		fscanf(fp,"%s\n",testname);
-		imread(testname,&im);
-		colour_to_grey(&im,'A');
-		binarize(&im,120);
-		get_image_vector(&im,n.in);
+	/* the whole list is read first, so that the loader can run ahead of the network */
+	for (k=0; k < TEST_DATA && fscanf(fp,"%19s\n",testname[k]) == 1; k++)
+		testnames[k] = testname[k];
+	fclose(fp);
+
+	if (start_loader(&l, testnames, k, GLYPH_LEN, 120, LOADER_THREADS, LOADER_DEPTH))
+		return;
+	while (loader_next(&l, &vect, &i)) {
+		extract_features(&fx, vect, n.in);
 		fwd_propogation (&n);
-		printf("Test image name: %s, Actual result: ",testname);
+		printf("Test image name: %s, Actual result: ",testnames[i]);
 		for (j=0; j < 26; j++ ) {
 			if ( ((int) n.outputs[1][j]) != 0)
 				printf("%c ",j+'A');
 			}
 		printf("\n");
-
-		free_image(&im);
 		}
-	
-	fclose(fp);
+	stop_loader(&l);
 	}
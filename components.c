@@ -0,0 +1,348 @@
+/*_____________________________________________________________________________
+components.c: This file provides the implementation of the function prototypes
+	given in components.h
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "components.h"
+
+
+/* A run of set pixels: pixels start to end - 1 of a row */
+
+typedef struct {
+	int row;
+	int start, end;
+	} run;
+
+
+/* The runs of one strip of rows, with their union-find forest. The runs of
+	row i of the strip are row_start[i - first] to row_start[i - first + 1] - 1 */
+
+typedef struct {
+	bitimage * b;
+	int first, last;				// rows of this strip, last excluded
+	int grow;						// 1 for 8 connectivity, 0 for 4
+	run * runs;
+	int * parent;					// parent of each run in the forest
+	int num_runs, size;				// runs found and runs allocated
+	int * row_start;				// first run of each row
+	int failed;
+	} label_strip;
+
+
+
+/* find_root: returns the root of run x, halving the path on the way up */
+
+static int find_root (int * parent, int x) {
+
+	while (parent[x] != x) {
+		parent[x] = parent[parent[x]];
+		x = parent[x];
+		}
+
+	return x;
+	}
+
+
+
+/* join_runs: puts runs a and b in one tree. The smaller index always becomes
+	the root, so the root of a component is its first run */
+
+static void join_runs (int * parent, int a, int b) {
+
+	a = find_root(parent, a);
+	b = find_root(parent, b);
+
+	if (a < b)
+		parent[b] = a;
+	else if (b < a)
+		parent[a] = b;
+	}
+
+
+
+/* connect_rows: joins the runs p to p_end - 1 of one row with the overlapping
+	runs c to c_end - 1 of the row below. Both lists are in order of column, so
+	one merge-like pass finds every overlapping pair */
+
+static void connect_rows (int * parent, run * runs, int p, int p_end, int c, int c_end, int grow) {
+
+	while (p < p_end && c < c_end) {
+		if (runs[p].start < runs[c].end + grow && runs[c].start < runs[p].end + grow)
+			join_runs(parent, p, c);
+
+		/* the run ending first can not touch any later run of the other row */
+		if (runs[p].end < runs[c].end)
+			p++;
+		else
+			c++;
+		}
+	}
+
+
+
+/* label_strip_runs: finds the runs of every row of a strip and joins them with
+	the runs of the row above, as long as that row is in the strip too */
+
+static void * label_strip_runs (void * arg) {
+
+	label_strip * s = (label_strip *) arg;
+	bitimage * b = s->b;
+	int i;
+
+	for (i=s->first; i < s->last; i++) {
+		uint64_t * row = BIT_ROW(b,i);
+		int pos = 0;
+
+		s->row_start[i - s->first] = s->num_runs;
+
+		while ((pos = bit_find(row, b->words, pos, 1)) < b->width) {
+			int end = bit_find(row, b->words, pos, 0);
+
+			if (s->num_runs == s->size) {
+				int size = 2 * s->size;
+				run * runs = (run *) realloc (s->runs, sizeof(run) * size);
+				int * parent = runs ? (int *) realloc (s->parent, sizeof(int) * size) : NULL;
+				if (runs)
+					s->runs = runs;
+				if (parent == NULL) {
+					s->failed = 1;
+					return NULL;
+					}
+				s->parent = parent;
+				s->size = size;
+				}
+
+			s->runs[s->num_runs].row = i;
+			s->runs[s->num_runs].start = pos;
+			s->runs[s->num_runs].end = end > b->width ? b->width : end;
+			s->parent[s->num_runs] = s->num_runs;
+			s->num_runs++;
+			pos = end;
+			}
+
+		if (i > s->first)
+			connect_rows(s->parent, s->runs, s->row_start[i - 1 - s->first],
+				s->row_start[i - s->first], s->row_start[i - s->first], s->num_runs, s->grow);
+		}
+
+	s->row_start[s->last - s->first] = s->num_runs;
+	return NULL;
+	}
+
+
+
+/* label_components: This function takes a bit image, the connectivity (4 or
+	8), the number of threads and a component set structure. It finds the
+	components of the set pixels of the image and stores them in the set, with
+	their boxes, areas and masks. With 4 connectivity pixels only touch their
+	neighbours above, below, left and right, with 8 also the diagonal ones.
+	Passing 0 threads uses one per processor. The image is not altered.
+	Returns 0 on success and 1 on failure */
+
+int label_components (bitimage * b, int connectivity, int threads, component_set * set) {
+
+	int i,k;
+	int total = 0, count = 0, failed = 0;
+	run * runs = NULL;
+	int * parent = NULL, * label = NULL;
+	component * list = NULL;
+
+	if (b == NULL || set == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: image = %p, set = %p\n",b,set);
+		return 1;
+		}
+
+	if (connectivity != 4 && connectivity != 8) {
+		fprintf(stderr,"ERROR: Connectivity of components can be 4 or 8, not %d\n",connectivity);
+		return 1;
+		}
+
+	set->list = NULL;
+	set->count = 0;
+	if (b->height <= 0)
+		return 0;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > b->height)
+		threads = b->height;
+	if (threads < 1)
+		threads = 1;
+
+	label_strip strips[threads];
+	pthread_t tid[threads];
+	int started = 0;
+	for (i=0; i < threads; i++) {
+		label_strip * s = &strips[i];
+		s->b = b;
+		s->first = (long) b->height * i / threads;
+		s->last = (long) b->height * (i + 1) / threads;
+		s->grow = connectivity == 8 ? 1 : 0;
+		s->num_runs = 0;
+		s->size = 64 + (s->last - s->first) * 4;
+		s->runs = (run *) malloc (sizeof(run) * s->size);
+		s->parent = (int *) malloc (sizeof(int) * s->size);
+		s->row_start = (int *) malloc (sizeof(int) * (s->last - s->first + 1));
+		s->failed = s->runs == NULL || s->parent == NULL || s->row_start == NULL;
+		}
+
+	/* every strip only reads the image and writes its own runs, so the strips
+	need no locking */
+	for (i=0; i < threads && !strips[i].failed; i++)
+		;
+	if (i == threads) {
+		for (i=1; i < threads; i++) {
+			if (pthread_create(&tid[i], NULL, label_strip_runs, &strips[i]))
+				break;
+			started++;
+			}
+		label_strip_runs(&strips[0]);
+		/* strips whose thread could not be started are done here */
+		for (i=started + 1; i < threads; i++)
+			label_strip_runs(&strips[i]);
+		for (i=1; i <= started; i++)
+			pthread_join(tid[i], NULL);
+		}
+
+	for (i=0; i < threads; i++) {
+		failed |= strips[i].failed;
+		total += strips[i].num_runs;
+		}
+
+	if (!failed) {
+		runs = (run *) malloc (sizeof(run) * (total + 1));
+		parent = (int *) malloc (sizeof(int) * (total + 1));
+		label = (int *) malloc (sizeof(int) * (total + 1));
+		failed = runs == NULL || parent == NULL || label == NULL;
+		}
+
+	if (!failed) {
+		/* put the strips one after the other. Runs keep their order, so a
+		strip's trees only have to be moved by the runs before it */
+		int offset = 0;
+		for (i=0; i < threads; i++) {
+			label_strip * s = &strips[i];
+			memcpy(runs + offset, s->runs, sizeof(run) * s->num_runs);
+			for (k=0; k < s->num_runs; k++)
+				parent[offset + k] = s->parent[k] + offset;
+
+			/* join the last row of the strip above with the first row of
+			this one */
+			if (i > 0) {
+				label_strip * up = &strips[i-1];
+				int up_offset = offset - up->num_runs;
+				connect_rows(parent, runs, up_offset + up->row_start[up->last - up->first - 1],
+					offset, offset, offset + s->row_start[1], s->grow);
+				}
+			offset += s->num_runs;
+			}
+
+		/* number the roots in order. A root is the first run of its
+		component, so every other run comes after its root's number is known */
+		for (k=0; k < total; k++) {
+			int r = find_root(parent, k);
+			label[k] = r == k ? count++ : label[r];
+			}
+
+		list = (component *) calloc (count > 0 ? count : 1, sizeof(component));
+		failed = list == NULL;
+		}
+
+	if (!failed) {
+		for (k=0; k < count; k++) {
+			list[k].top = list[k].left = b->width + b->height;
+			list[k].bottom = list[k].right = -1;
+			}
+
+		for (k=0; k < total; k++) {
+			component * c = &list[label[k]];
+			if (runs[k].row < c->top)
+				c->top = runs[k].row;
+			c->bottom = runs[k].row;
+			if (runs[k].start < c->left)
+				c->left = runs[k].start;
+			if (runs[k].end - 1 > c->right)
+				c->right = runs[k].end - 1;
+			c->area += runs[k].end - runs[k].start;
+			}
+
+		for (k=0; k < count && !failed; k++) {
+			component * c = &list[k];
+			if (allocate_bitimage(&c->mask, c->right - c->left + 1, c->bottom - c->top + 1))
+				failed = 1;
+			c->mask.inverted = b->inverted;
+			}
+
+		if (failed) {
+			fprintf(stderr,"ERROR: Could not allocate the masks of the components\n");
+			for (k=0; k < count; k++)
+				free_bitimage(&list[k].mask);
+			free(list);
+			}
+		else {
+			for (k=0; k < total; k++) {
+				component * c = &list[label[k]];
+				bit_set_range(BIT_ROW(&c->mask, runs[k].row - c->top),
+					runs[k].start - c->left, runs[k].end - runs[k].start);
+				}
+			set->list = list;
+			set->count = count;
+			}
+		}
+	else
+		fprintf(stderr,"ERROR: Could not allocate memory for labeling the components\n");
+
+	for (i=0; i < threads; i++) {
+		free(strips[i].runs);
+		free(strips[i].parent);
+		free(strips[i].row_start);
+		}
+	free(runs);
+	free(parent);
+	free(label);
+
+	return failed;
+	}
+
+
+
+/* free_components: This function takes a component set and deallocates the
+	masks and the list of the components */
+
+void free_components (component_set * set) {
+
+	int k;
+
+	if (set == NULL)
+		return;
+
+	for (k=0; k < set->count; k++)
+		free_bitimage(&set->list[k].mask);
+	free(set->list);
+	set->list = NULL;
+	set->count = 0;
+	}
@@ -0,0 +1,82 @@
+/*_____________________________________________________________________________
+components.h: This is a header file for giving connected component labeling of
+	binary images, which is how a page is cut into its glyphs.
+	A component is a largest group of set pixels which touch each other. The
+	labeling works on the runs of set pixels of the packed rows rather than on
+	single pixels: a run is found with a couple of bit scans and a glyph row
+	is usually one or two runs, so the work grows with the amount of ink and
+	not with the size of the page. Runs of neighbouring rows which overlap are
+	joined in a union-find forest, the roots of which are the components.
+	The page is cut in strips of rows labeled in parallel, and the runs across
+	the boundaries between the strips are joined afterwards.
+	Current functions include following:
+		label_components:		Find the connected components of a bit image
+		free_components:		Release the components found
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#ifndef _COMPONENTS_GUARD
+#define _COMPONENTS_GUARD
+
+#include "bitimage.h"
+
+
+/* The structure for one connected component.
+	The box is given as for bit_bounding_box, with the last row and column
+	included. The mask is a bit image of the size of the box holding only the
+	pixels of this component, so a neighbour reaching into the box is not in
+	it. The mask has the 'inverted' flag of the labeled image. */
+
+typedef struct {
+	int top, left;					// first row and column of the box
+	int bottom, right;				// last row and column of the box
+	long area;						// number of pixels of the component
+	bitimage mask;					// pixels of the component within the box
+	} component;
+
+
+/* The structure for the components of an image, in the order of their first
+	pixel, top to bottom and left to right */
+
+typedef struct {
+	component * list;
+	int count;
+	} component_set;
+
+
+/* label_components: This function takes a bit image, the connectivity (4 or
+	8), the number of threads and a component set structure. It finds the
+	components of the set pixels of the image and stores them in the set, with
+	their boxes, areas and masks. With 4 connectivity pixels only touch their
+	neighbours above, below, left and right, with 8 also the diagonal ones.
+	Passing 0 threads uses one per processor. The image is not altered.
+	Returns 0 on success and 1 on failure */
+
+int label_components (bitimage *, int, int, component_set *);
+
+
+/* free_components: This function takes a component set and deallocates the
+	masks and the list of the components */
+
+void free_components (component_set *);
+
+
+#endif
@@ -0,0 +1,410 @@
+/*_____________________________________________________________________________
+dataset.c: This file provides the implementation of the function prototypes
+	given in dataset.h
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dataset.h"
+
+
+/* The cache file starts with this header, padded to IMAGE_ALIGN bytes. It is
+	followed by the labels, again padded to IMAGE_ALIGN bytes, and then by the
+	input vectors exactly as they are laid out in memory. The file is only
+	meant to be read back on the machine that wrote it, so the fields are
+	written in native byte order. */
+
+#define CACHE_MAGIC "RDRDSET1"
+
+typedef struct {
+	char magic[8];
+	int num_samples;
+	int vec_len;
+	int stride;
+	int label_bytes;				// size of the padded label block
+	} cache_header;
+
+
+static size_t align_up (size_t n) {
+	return (n + IMAGE_ALIGN - 1) & ~((size_t) IMAGE_ALIGN - 1);
+	}
+
+
+
+/* allocate_dataset: sets up an empty dataset with room for count vectors of
+	vec_len floats. Returns 0 on success and 1 on failure */
+
+static int allocate_dataset (dataset * ds, int count, int vec_len) {
+
+	void * data = NULL;
+
+	ds->num_samples = 0;
+	ds->vec_len = vec_len;
+	ds->stride = align_up(sizeof(float) * vec_len) / sizeof(float);
+	ds->map = NULL;
+	ds->map_len = 0;
+
+	if (posix_memalign(&data, IMAGE_ALIGN, sizeof(float) * ds->stride * count)) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the dataset\n");
+		return 1;
+		}
+	ds->inputs = (float *) data;
+	/* padding between the vectors stays 0 so that it is well defined in the cache file */
+	memset(ds->inputs, 0, sizeof(float) * ds->stride * count);
+
+	ds->labels = (int *) malloc (sizeof(int) * count);
+	if (ds->labels == NULL) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the dataset labels\n");
+		free(ds->inputs);
+		ds->inputs = NULL;
+		return 1;
+		}
+
+	return 0;
+	}
+
+
+
+/* build_dataset: This function takes a dataset structure, an array of image
+	names and an array of their labels, the number of images, the length of
+	the input vector, the function to read images with (imread or imread_mmap)
+	and a threshold for binarization. Every image is read, converted to grey
+	scale by averaging, binarized and stored as an input vector.
+	Images which can not be read, or do not have vec_len pixels, are skipped
+	with a warning, so num_samples may be lesser than the number of images.
+	Returns 0 on success and 1 on failure */
+
+int build_dataset (dataset * ds, char ** names, int * labels, int count, int vec_len,
+		int (* reader) (char *, image *), float threshold) {
+
+	int i;
+	image im;
+
+	if (ds == NULL || names == NULL || labels == NULL || reader == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: dataset = %p, names = %p, labels = %p\n",ds,names,labels);
+		return 1;
+		}
+
+	if (count <= 0 || vec_len <= 0) {
+		fprintf(stderr,"ERROR: Dataset needs at least one sample of at least one input\n");
+		return 1;
+		}
+
+	if (allocate_dataset(ds, count, vec_len))
+		return 1;
+
+	memset(&im, 0, sizeof(image));
+	im.is_planar = 1;				// every sample is converted to grey right away
+	for (i=0; i < count; i++) {
+		if (reader(names[i], &im)) {
+			fprintf(stderr,"WARNING: Skipping sample %s which could not be read\n",names[i]);
+			continue;
+			}
+		colour_to_grey(&im,'A');
+
+		if (im.width * im.height != vec_len) {
+			fprintf(stderr,"WARNING: Skipping sample %s with %d pixels instead of %d\n",
+				names[i], im.width * im.height, vec_len);
+			free_image(&im);
+			continue;
+			}
+
+		binarize(&im,threshold);
+		get_image_vector(&im, DATASET_ROW(ds, ds->num_samples));
+		ds->labels[ds->num_samples] = labels[i];
+		ds->num_samples++;
+		free_image(&im);
+		}
+
+	return 0;
+	}
+
+
+
+
+/* ingest_handler for ingest_dataset. Files come in any order and maybe from
+	several threads, so each is decoded straight into the row of its position
+	in the list and the rows are packed together afterwards */
+
+typedef struct {
+	dataset * ds;
+	float threshold;
+	char * ok;						// decoded flag of each row
+	} ingest_target;
+
+
+static int decode_sample (int k, const unsigned char * buf, size_t len, void * arg) {
+
+	ingest_target * t = (ingest_target *) arg;
+
+	if (imdecode_vector(buf, len, DATASET_ROW(t->ds,k), t->ds->vec_len, t->threshold))
+		return 1;
+	t->ok[k] = 1;
+	return 0;
+	}
+
+
+
+/* ingest_dataset: This function does the job of build_dataset, but reads the
+	images with ingest_files, keeping depth files in flight at once, and
+	decodes them from memory with imdecode_vector. It takes a dataset
+	structure, the image names and labels, the number of images, the length of
+	the input vector, a threshold, the queue depth, the method for
+	ingest_files and a pointer for its statistics (may be NULL). The samples
+	keep the order of the list.
+	Returns 0 on success and 1 on failure */
+
+int ingest_dataset (dataset * ds, char ** names, int * labels, int count, int vec_len,
+		float threshold, int depth, char method, ingest_stats * st) {
+
+	int i;
+	ingest_target t;
+
+	if (ds == NULL || names == NULL || labels == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: dataset = %p, names = %p, labels = %p\n",ds,names,labels);
+		return 1;
+		}
+
+	if (count <= 0 || vec_len <= 0) {
+		fprintf(stderr,"ERROR: Dataset needs at least one sample of at least one input\n");
+		return 1;
+		}
+
+	if (allocate_dataset(ds, count, vec_len))
+		return 1;
+
+	t.ds = ds;
+	t.threshold = threshold;
+	t.ok = (char *) calloc (count, sizeof(char));
+	if (t.ok == NULL || ingest_files(names, count, depth, method, decode_sample, &t, st)) {
+		fprintf(stderr,"ERROR: Could not read the images of the dataset\n");
+		free(t.ok);
+		free_dataset(ds);
+		return 1;
+		}
+
+	for (i=0; i < count; i++) {
+		if (!t.ok[i]) {
+			fprintf(stderr,"WARNING: Skipping sample %s which could not be read\n",names[i]);
+			continue;
+			}
+		if (i != ds->num_samples)
+			memcpy(DATASET_ROW(ds, ds->num_samples), DATASET_ROW(ds,i), sizeof(float) * ds->stride);
+		ds->labels[ds->num_samples] = labels[i];
+		ds->num_samples++;
+		}
+
+	free(t.ok);
+	return 0;
+	}
+
+
+
+
+/* save_dataset: This function takes a dataset and a file name and writes the
+	dataset in the file in a form which load_dataset can map back.
+	Returns 0 on success and 1 on failure */
+
+int save_dataset (dataset * ds, char * filename) {
+
+	FILE * fp;
+	cache_header ch;
+	char pad[IMAGE_ALIGN] = {0};
+	size_t label_size, vect_size;
+
+	if (ds == NULL || filename == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: dataset = %p, file name = %p\n",ds,filename);
+		return 1;
+		}
+
+	label_size = sizeof(int) * ds->num_samples;
+	vect_size = sizeof(float) * ds->stride * ds->num_samples;
+
+	memset(&ch, 0, sizeof(cache_header));
+	memcpy(ch.magic, CACHE_MAGIC, sizeof(ch.magic));
+	ch.num_samples = ds->num_samples;
+	ch.vec_len = ds->vec_len;
+	ch.stride = ds->stride;
+	ch.label_bytes = align_up(label_size);
+
+	fp = fopen(filename,"wb");
+	if (fp == NULL) {
+		fprintf(stderr,"ERROR %d: Opening the cache file: %s failed\n",errno,filename);
+		return 1;
+		}
+
+	if (fwrite(&ch, sizeof(cache_header), 1, fp) != 1 ||
+			fwrite(pad, IMAGE_ALIGN - sizeof(cache_header), 1, fp) != 1 ||
+			fwrite(ds->labels, 1, label_size, fp) != label_size ||
+			fwrite(pad, 1, ch.label_bytes - label_size, fp) != ch.label_bytes - label_size ||
+			fwrite(ds->inputs, 1, vect_size, fp) != vect_size) {
+		fprintf(stderr,"ERROR %d: Writing the cache file: %s failed\n",errno,filename);
+		fclose(fp);
+		remove(filename);			// a partial cache would look fresh next time
+		return 1;
+		}
+
+	if (fclose(fp)) {
+		fprintf(stderr,"ERROR %d: Writing the cache file: %s failed\n",errno,filename);
+		remove(filename);
+		return 1;
+		}
+
+	return 0;
+	}
+
+
+
+
+/* load_dataset: This function takes a dataset structure and the name of a
+	cache file written by save_dataset. The file is mapped in memory and the
+	dataset arrays point straight into the mapping, nothing is copied.
+	Returns 0 on success and 1 on failure */
+
+int load_dataset (dataset * ds, char * filename) {
+
+	int fd;
+	struct stat st;
+	unsigned char * map;
+	cache_header ch;
+
+	if (ds == NULL || filename == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: dataset = %p, file name = %p\n",ds,filename);
+		return 1;
+		}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr,"ERROR %d: Opening the cache file: %s failed\n",errno,filename);
+		return 1;
+		}
+
+	if (fstat(fd, &st) || (size_t) st.st_size < IMAGE_ALIGN) {
+		fprintf(stderr,"ERROR: Cache file %s is too short\n",filename);
+		close(fd);
+		return 1;
+		}
+
+	map = (unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr,"ERROR %d: Mapping the cache file: %s failed\n",errno,filename);
+		return 1;
+		}
+
+	/* check that this is a cache file and that it is as long as it says */
+	memcpy(&ch, map, sizeof(cache_header));
+	if (memcmp(ch.magic, CACHE_MAGIC, sizeof(ch.magic)) || ch.num_samples < 0 ||
+			ch.vec_len <= 0 || ch.stride < ch.vec_len || ch.label_bytes < 0 ||
+			(size_t) ch.label_bytes < sizeof(int) * ch.num_samples ||
+			IMAGE_ALIGN + (size_t) ch.label_bytes + sizeof(float) * ch.stride * ch.num_samples
+				!= (size_t) st.st_size) {
+		fprintf(stderr,"ERROR: %s is not a valid dataset cache file\n",filename);
+		munmap(map, st.st_size);
+		return 1;
+		}
+
+	ds->num_samples = ch.num_samples;
+	ds->vec_len = ch.vec_len;
+	ds->stride = ch.stride;
+	ds->labels = (int *) (map + IMAGE_ALIGN);
+	ds->inputs = (float *) (map + IMAGE_ALIGN + ch.label_bytes);
+	ds->map = map;
+	ds->map_len = st.st_size;
+
+	return 0;
+	}
+
+
+
+
+/* older: returns 1 if the time a is before the time b and 0 otherwise */
+
+static int older (const struct timespec * a, const struct timespec * b) {
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+	}
+
+
+
+/* dataset_is_fresh: This function takes the name of a cache file, the name of
+	the list the images came from, the array of image names and their number.
+	It checks whether the cache file is newer than the list and every image,
+	to the nanosecond. A source as old as the cache may have been rewritten
+	after it in the same tick, so it makes the cache stale.
+	Returns 1 if the cache can be used and 0 if it has to be rebuilt */
+
+int dataset_is_fresh (char * cache, char * list, char ** names, int count) {
+
+	struct stat st;
+	struct timespec cache_time;
+	int i;
+
+	if (cache == NULL || stat(cache, &st))
+		return 0;
+	cache_time = st.st_mtim;
+
+	if (list != NULL && (stat(list, &st) || ! older(&st.st_mtim, &cache_time)))
+		return 0;
+
+	for (i=0; i < count; i++) {
+		/* a missing image was skipped when the cache was built, so it can not
+		make the cache stale */
+		if (stat(names[i], &st) == 0 && ! older(&st.st_mtim, &cache_time))
+			return 0;
+		}
+
+	return 1;
+	}
+
+
+
+
+/* free_dataset: This function takes a dataset and releases its arrays, or
+	unmaps the cache file if the dataset was loaded from one. */
+
+void free_dataset (dataset * ds) {
+
+	if (ds == NULL)
+		return;
+
+	if (ds->map) {
+		munmap(ds->map, ds->map_len);
+		}
+	else {
+		free(ds->inputs);
+		free(ds->labels);
+		}
+
+	ds->inputs = NULL;
+	ds->labels = NULL;
+	ds->map = NULL;
+	ds->map_len = 0;
+	ds->num_samples = 0;
+	}
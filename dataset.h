@@ -0,0 +1,122 @@
+/*_____________________________________________________________________________
+dataset.h: This is a header file for giving a pre-decoded set of training
+	samples.
+	Decoding a bmp image, converting it to grey scale and binarizing it gives
+	the same input vector every time, so a training set is decoded once into
+	a packed matrix of input vectors with a label for each of them. The matrix
+	can be saved to a binary cache file and mapped back in memory on a later
+	run. Current functions include following:
+		build_dataset:			Decode a list of images into a dataset
+		ingest_dataset:			Decode a list of images with batched reads
+		save_dataset:			Write a dataset to a cache file
+		load_dataset:			Map a dataset cache file in memory
+		dataset_is_fresh:		Check that a cache file is newer than its sources
+		free_dataset:			Release the memory held by a dataset
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#ifndef _DATASET_GUARD
+#define _DATASET_GUARD
+
+#include "image.h"
+#include "ingest.h"
+
+
+/* The structure for a decoded training set.
+	inputs is one aligned block holding num_samples input vectors of vec_len
+	floats each. Consecutive vectors start 'stride' floats apart, stride being
+	vec_len rounded up so that every vector starts on an IMAGE_ALIGN boundary.
+	labels holds the expected class of each vector.
+	When the dataset was loaded from a cache file, both arrays point into the
+	mapping of that file and map/map_len describe the mapping. */
+
+typedef struct {
+	int num_samples;				// number of input vectors
+	int vec_len;					// number of floats in each vector
+	int stride;						// floats from the start of a vector to the next
+	float * inputs;					// the input vectors, one after the other
+	int * labels;					// expected class of each input vector
+	void * map;						// mapping of the cache file (if any)
+	size_t map_len;					// length of the mapping
+	} dataset;
+
+
+/* DATASET_ROW gives a pointer to the k-th input vector of a dataset */
+
+#define DATASET_ROW(ds,k)	((ds)->inputs + (size_t) (k) * (ds)->stride)
+
+
+/* build_dataset: This function takes a dataset structure, an array of image
+	names and an array of their labels, the number of images, the length of
+	the input vector, the function to read images with (imread or imread_mmap)
+	and a threshold for binarization. Every image is read, converted to grey
+	scale by averaging, binarized and stored as an input vector.
+	Images which can not be read, or do not have vec_len pixels, are skipped
+	with a warning, so num_samples may be lesser than the number of images.
+	Returns 0 on success and 1 on failure */
+
+int build_dataset (dataset *, char **, int *, int, int, int (*) (char *, image *), float);
+
+
+/* ingest_dataset: This function does the job of build_dataset, but reads the
+	images with ingest_files, keeping depth files in flight at once, and
+	decodes them from memory with imdecode_vector. It takes a dataset
+	structure, the image names and labels, the number of images, the length of
+	the input vector, a threshold, the queue depth, the method for
+	ingest_files and a pointer for its statistics (may be NULL). The samples
+	keep the order of the list.
+	Returns 0 on success and 1 on failure */
+
+int ingest_dataset (dataset *, char **, int *, int, int, float, int, char, ingest_stats *);
+
+
+/* save_dataset: This function takes a dataset and a file name and writes the
+	dataset in the file in a form which load_dataset can map back.
+	Returns 0 on success and 1 on failure */
+
+int save_dataset (dataset *, char *);
+
+
+/* load_dataset: This function takes a dataset structure and the name of a
+	cache file written by save_dataset. The file is mapped in memory and the
+	dataset arrays point straight into the mapping, nothing is copied.
+	Returns 0 on success and 1 on failure */
+
+int load_dataset (dataset *, char *);
+
+
+/* dataset_is_fresh: This function takes the name of a cache file, the name of
+	the list the images came from, the array of image names and their number.
+	It checks whether the cache file is newer than the list and every image,
+	to the nanosecond. A source as old as the cache may have been rewritten
+	after it in the same tick, so it makes the cache stale.
+	Returns 1 if the cache can be used and 0 if it has to be rebuilt */
+
+int dataset_is_fresh (char *, char *, char **, int);
+
+
+/* free_dataset: This function takes a dataset and releases its arrays, or
+	unmaps the cache file if the dataset was loaded from one. */
+
+void free_dataset (dataset *);
+
+
+#endif
@@ -0,0 +1,238 @@
+/*_____________________________________________________________________________
+extractor.c: This file provides the implementation of the function prototypes
+	given in extractor.h
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "extractor.h"
+
+
+/* zone_table: puts each of the n pixels of an axis in one of bins zones of
+	(nearly) equal size, and stores 1 / (pixels in the zone) for each zone */
+
+static void zone_table (int n, int bins, int * bin, float * inv) {
+
+	int i;
+
+	for (i=0; i < bins; i++)
+		inv[i] = 0;
+	for (i=0; i < n; i++) {
+		bin[i] = (int) ((long) i * bins / n);
+		inv[bin[i]] += 1;
+		}
+	for (i=0; i < bins; i++)
+		inv[i] = 1 / inv[i];
+	}
+
+
+
+/* pool_table: shares each of the n pixels of an axis between the bins it
+	covers when the axis is cut in bins equal parts. As no bin is narrower
+	than a pixel, that is bin[i] and bin[i] + 1 at most. The weights wt[i] and
+	wt[n + i] are the parts of the pixel in them, divided by the width of a
+	bin, so each bin gets the average of its pixels */
+
+static void pool_table (int n, int bins, int * bin, float * wt) {
+
+	int i;
+	double scale = (double) n / bins;
+
+	for (i=0; i < n; i++) {
+		int b = (int) (i / scale);
+		double end = (b + 1) * scale;
+		double part = end < i + 1 ? end - i : 1;
+
+		if (b >= bins - 1) {
+			b = bins - 1;
+			part = 1;
+			}
+		bin[i] = b;
+		wt[i] = (float) (part / scale);
+		wt[n + i] = (float) ((1 - part) / scale);
+		}
+	}
+
+
+
+/* init_extractor: This function takes an extractor structure, a method ('R',
+	'Z', 'P' or 'H', see above), the width and height of the glyphs and the
+	columns and rows of the grid. It builds the tables of the extractor and
+	sets its length, which is the number of inputs the network needs. The grid
+	can not be finer than the glyph.
+	Returns 0 on success and 1 on failure */
+
+int init_extractor (extractor * e, char method, int width, int height, int cols, int rows) {
+
+	if (e == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: extractor = %p\n",e);
+		return 1;
+		}
+
+	if (method != 'R' && method != 'Z' && method != 'P' && method != 'H') {
+		fprintf(stderr,"ERROR: Unknown feature extraction method %c\n",method);
+		return 1;
+		}
+
+	if (width <= 0 || height <= 0) {
+		fprintf(stderr,"ERROR: Features can not be extracted from %d x %d glyphs\n",width,height);
+		return 1;
+		}
+
+	e->method = method;
+	e->width = width;
+	e->height = height;
+	e->cols = cols;
+	e->rows = rows;
+	e->col_bin = e->row_bin = NULL;
+	e->col_wt = e->row_wt = NULL;
+	e->scratch = NULL;
+
+	if (method == 'R') {
+		e->length = width * height;
+		return 0;
+		}
+
+	if (cols < 1 || cols > width || rows < 1 || rows > height) {
+		fprintf(stderr,"ERROR: A %d x %d grid does not fit %d x %d glyphs\n",cols,rows,width,height);
+		return 1;
+		}
+
+	e->length = method == 'H' ? cols + rows : cols * rows;
+	e->col_bin = (int *) malloc (sizeof(int) * width);
+	e->row_bin = (int *) malloc (sizeof(int) * height);
+	e->col_wt = (float *) malloc (sizeof(float) * 2 * width);
+	e->row_wt = (float *) malloc (sizeof(float) * 2 * height);
+	e->scratch = (float *) malloc (sizeof(float) * (cols + 1));
+	if (e->col_bin == NULL || e->row_bin == NULL || e->col_wt == NULL ||
+			e->row_wt == NULL || e->scratch == NULL) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the feature extractor\n");
+		free_extractor(e);
+		return 1;
+		}
+
+	if (method == 'P') {
+		pool_table(width, cols, e->col_bin, e->col_wt);
+		pool_table(height, rows, e->row_bin, e->row_wt);
+		}
+	else {
+		zone_table(width, cols, e->col_bin, e->col_wt);
+		zone_table(height, rows, e->row_bin, e->row_wt);
+		}
+
+	return 0;
+	}
+
+
+
+/* extract_features: This function takes an extractor, a glyph of width *
+	height floats and a pointer to an array of length floats. It fills the
+	array with the features of the glyph.
+	NOTE: Assumes enough memory is allocated for the features */
+
+void extract_features (extractor * e, float * glyph, float * f) {
+
+	int x,y,c;
+	int w = e->width, h = e->height;
+	float * tmp = e->scratch;
+
+	if (e->method == 'R') {
+		memcpy(f, glyph, sizeof(float) * w * h);
+		return;
+		}
+
+	memset(f, 0, sizeof(float) * e->length);
+
+	if (e->method == 'H') {
+		/* rows first, then the columns after them */
+		float * col = f + e->rows;
+		for (y=0; y < h; y++) {
+			float * g = glyph + (size_t) y * w;
+			float ink = 0;
+			for (x=0; x < w; x++) {
+				ink += 1 - g[x];
+				col[e->col_bin[x]] += 1 - g[x];
+				}
+			f[e->row_bin[y]] += ink;
+			}
+		for (y=0; y < e->rows; y++)
+			f[y] *= e->row_wt[y] / w;
+		for (c=0; c < e->cols; c++)
+			col[c] *= e->col_wt[c] / h;
+		return;
+		}
+
+	/* every glyph row is binned across first, and the row of bins is then
+	added to the one or two grid rows the glyph row falls in */
+	for (y=0; y < h; y++) {
+		float * g = glyph + (size_t) y * w;
+		float * out = f + (size_t) e->row_bin[y] * e->cols;
+
+		memset(tmp, 0, sizeof(float) * (e->cols + 1));
+		if (e->method == 'P') {
+			float wy = e->row_wt[y], wy1 = e->row_wt[h + y];
+			for (x=0; x < w; x++) {
+				tmp[e->col_bin[x]] += e->col_wt[x] * g[x];
+				tmp[e->col_bin[x] + 1] += e->col_wt[w + x] * g[x];
+				}
+			for (c=0; c < e->cols; c++)
+				out[c] += wy * tmp[c];
+			if (wy1 != 0)
+				for (c=0; c < e->cols; c++)
+					out[e->cols + c] += wy1 * tmp[c];
+			}
+		else {
+			for (x=0; x < w; x++)
+				tmp[e->col_bin[x]] += 1 - g[x];
+			for (c=0; c < e->cols; c++)
+				out[c] += tmp[c];
+			}
+		}
+
+	/* zones hold ink counts, which become shares of the zone area */
+	if (e->method == 'Z') {
+		for (y=0; y < e->rows; y++)
+			for (c=0; c < e->cols; c++)
+				f[y * e->cols + c] *= e->row_wt[y] * e->col_wt[c];
+		}
+	}
+
+
+
+/* free_extractor: This function takes an extractor and deallocates its
+	tables */
+
+void free_extractor (extractor * e) {
+
+	if (e == NULL)
+		return;
+
+	free(e->col_bin);
+	free(e->row_bin);
+	free(e->col_wt);
+	free(e->row_wt);
+	free(e->scratch);
+	e->col_bin = e->row_bin = NULL;
+	e->col_wt = e->row_wt = NULL;
+	e->scratch = NULL;
+	}
@@ -0,0 +1,85 @@
+/*_____________________________________________________________________________
+extractor.h: This is a header file for giving feature extraction, which turns a
+	glyph into a much shorter input vector for the network.
+	A 46x46 glyph is 2116 inputs, most of them blank paper, and every one of
+	them costs a weight in each neuron of the first layer. The extractors
+	here sum the glyph up in far fewer numbers:
+		'R': Raw-		the glyph itself, width * height values
+		'Z': Zoning-	the share of ink in each zone of a cols x rows grid
+		'P': Pooling-	the glyph area averaged down to cols x rows pixels
+		'H': Histogram-	the share of ink in each of rows bands of rows and
+						cols bands of columns (projection histograms)
+	Glyphs are taken as get_image_vector gives them after binarize (or as
+	normalize_bits gives them): 1.0 for paper, 0.0 for ink. The tables an
+	extractor needs are built once, so extracting is one pass over the glyph.
+	Current functions include following:
+		init_extractor:			Set up an extractor for glyphs of a size
+		extract_features:		Extract the features of a glyph
+		free_extractor:			Release the tables of an extractor
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#ifndef _EXTRACTOR_GUARD
+#define _EXTRACTOR_GUARD
+
+
+/* The structure for a feature extractor.
+	For zoning and histograms column x of the glyph falls in zone col_bin[x]
+	and row y in zone row_bin[y]. For pooling column x is shared between bins
+	col_bin[x] and col_bin[x] + 1, with weights col_wt[x] and
+	col_wt[width + x], and the same for the rows. */
+
+typedef struct {
+	char method;					// 'R', 'Z', 'P' or 'H'
+	int width, height;				// size of the glyphs
+	int cols, rows;					// size of the grid (not used for 'R')
+	int length;						// number of features of a glyph
+	int * col_bin, * row_bin;		// bin of every column and row
+	float * col_wt, * row_wt;		// weights of every column and row
+	float * scratch;				// one row of bins for every glyph row
+	} extractor;
+
+
+/* init_extractor: This function takes an extractor structure, a method ('R',
+	'Z', 'P' or 'H', see above), the width and height of the glyphs and the
+	columns and rows of the grid. It builds the tables of the extractor and
+	sets its length, which is the number of inputs the network needs. The grid
+	can not be finer than the glyph.
+	Returns 0 on success and 1 on failure */
+
+int init_extractor (extractor *, char, int, int, int, int);
+
+
+/* extract_features: This function takes an extractor, a glyph of width *
+	height floats and a pointer to an array of length floats. It fills the
+	array with the features of the glyph.
+	NOTE: Assumes enough memory is allocated for the features */
+
+void extract_features (extractor *, float *, float *);
+
+
+/* free_extractor: This function takes an extractor and deallocates its
+	tables */
+
+void free_extractor (extractor *);
+
+
+#endif
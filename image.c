@@ -28,11 +28,51 @@ _______________________________________________________________________________*
 #include "image.h"
 #include <errno.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdint.h>
 
 float luminosity (colour c);
 float lightness (colour c);
 float averaging (colour c);
 
+/* histogram bin of grey value v */
+#define HIST_BIN(v) ((v) <= 0 ? 0 : (v) >= 255 ? 255 : (int) (v))
+
+/* weights of red, green and blue for the luminosity method */
+#define LUM_R 0.21f
+#define LUM_G 0.72f
+#define LUM_B 0.07f
+
+typedef void (* grey_kernel) (char, const unsigned char *, const unsigned char *,
+		const unsigned char *, float *, int, float *, float *);
+static grey_kernel select_grey_kernel (void);
+static void palette_to_grey (header *, const unsigned char *, char, int, float, float *);
+static int decode_grey (const unsigned char *, size_t, image *, char, int, float);
+static void store_colour (image *, int, int, colour);
+static int decode_bmp (const unsigned char *, size_t, image *);
+static void release_block (image *, void *);
+static const unsigned char * row_indices (const unsigned char *, int, int, unsigned char *);
+static void colour_run (void *, int, int, int, const unsigned char *, int);
+static void grey_run (void *, int, int, int, const unsigned char *, int);
+
+/* destination of grey_run: rows of floats 'stride' apart, the table giving
+	the value of each pixel value, and the count of each pixel value (if
+	used is not NULL) */
+typedef struct {
+	float * data;
+	int stride;
+	const float * lut;
+	unsigned int * used;
+	} grey_target;
+
+/* rows of 1 and 4 bit images are unpacked to one byte per pixel before use.
+	Rows up to this wide are unpacked on the stack */
+#define UNPACK_LOCAL 4096
+
 /* imread: This function takes a string and a pointer to image structure. 
 	It then opens the image named the string (assumes it is a bmp image) and 
 	populates the image structure with pixel data, bmp header and index of
@@ -47,8 +87,14 @@ int imread (char * imname, image * im) {
 		}
 	
 	im->is_indexed = 0;					// set the indexed field to 0 for start
+	im->pool = NULL;					// stdio reads always allocate
+	im->parent = NULL;
 	im->max_val = im->min_val = 0;		// set min and max values to be 0
+	im->has_hist = 0;
 	im->is_rgb=0;						// set the rgb flag to 0 for now
+	im->g_data = NULL;
+	im->c_data = NULL;
+	im->planes = NULL;
 	
 
 	FILE * fp;
@@ -94,6 +140,10 @@ int imread (char * imname, image * im) {
 		fprintf(stderr,"ERROR: Error reading pixel data\n");
 		free(im->c_data);
 		free(im->g_data);
+		free(im->planes);
+		im->c_data = NULL;
+		im->g_data = NULL;
+		im->planes = NULL;
 		fclose(fp);
 		return 1;
 		}
@@ -108,6 +158,852 @@ int imread (char * imname, image * im) {
 
 
 
+/* imread_mmap: This function does the same job as imread, but instead of
+	reading the file through stdio, it maps the whole file in memory and
+	decodes the header and pixel rows straight out of the mapping (see
+	imdecode). It is meant as a drop in replacement for imread so that both
+	paths can be benchmarked against each other.
+	Returns 0 on success and 1 on failure */
+
+int imread_mmap (char * imname, image * im) {
+
+	size_t len;
+	unsigned char * map = map_image(imname, &len);
+
+	if (map == NULL)
+		return 1;
+
+	int ret = imdecode(map, len, im);
+
+	munmap(map, len);
+	return ret;
+	}
+
+
+
+/* map_image: maps the named file in memory for reading it from front to back
+	once. Returns the mapping and stores its length in len, or returns NULL on
+	failure. The caller unmaps it with munmap */
+
+unsigned char * map_image (char * imname, size_t * len) {
+
+	if (imname == NULL) {
+		fprintf(stderr,"ERROR: image name not specified %p\n",imname);
+		return NULL;
+		}
+
+	int fd;
+	struct stat st;
+	unsigned char * map;
+
+	fd = open(imname, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr,"ERROR %d: Reading the image file: %s failed\n",errno,imname);
+		return NULL;
+		}
+
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		fprintf(stderr,"ERROR %d: Could not get the size of image file: %s\n",errno,imname);
+		close(fd);
+		return NULL;
+		}
+
+	map = (unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);			// the mapping stays valid after the descriptor is closed
+	if (map == MAP_FAILED) {
+		fprintf(stderr,"ERROR %d: Mapping the image file: %s failed\n",errno,imname);
+		return NULL;
+		}
+
+	/* we walk the file from the pixel offset to the end exactly once */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	*len = st.st_size;
+	return map;
+	}
+
+
+
+
+/* imdecode: This function takes a buffer holding an entire bmp file, the
+	length of the buffer and a pointer to image structure. It then parses the
+	header in place and populates the image structure by walking the pixel rows
+	of the buffer using the row stride. No library call is made per pixel.
+	Returns 0 on success and 1 on failure */
+
+int imdecode (const unsigned char * buf, size_t len, image * im) {
+
+	if (buf == NULL || im == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: buffer = %p, image = %p\n",buf,im);
+		return 1;
+		}
+
+	im->pool = NULL;
+	im->parent = NULL;
+	return decode_bmp(buf, len, im);
+	}
+
+
+
+
+/* imread_into: This function takes a string, a pointer to image structure and
+	a pointer to an image pool. It reads the image like imread_mmap does, but
+	the pixel data, the palette and the grey data made later by colour_to_grey
+	all live in the buffers of the pool. free_image leaves the pool alone.
+	Returns 0 on success and 1 on failure */
+
+int imread_into (char * imname, image * im, image_pool * pool) {
+
+	size_t len;
+	unsigned char * map = map_image(imname, &len);
+
+	if (map == NULL)
+		return 1;
+
+	int ret = imdecode_into(map, len, im, pool);
+
+	munmap(map, len);
+	return ret;
+	}
+
+
+
+
+/* imdecode_into: This is imread_into for a bmp file held in memory. It takes
+	the buffer, its length, a pointer to image structure and an image pool.
+	Returns 0 on success and 1 on failure */
+
+int imdecode_into (const unsigned char * buf, size_t len, image * im, image_pool * pool) {
+
+	if (buf == NULL || im == NULL || pool == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: buffer = %p, image = %p, pool = %p\n",buf,im,pool);
+		return 1;
+		}
+
+	im->pool = pool;
+	im->parent = NULL;
+	return decode_bmp(buf, len, im);
+	}
+
+
+
+
+/* init_image_pool: This function takes a pointer to an image pool and sets it
+	up empty. Nothing is allocated until the first image is read into it. */
+
+void init_image_pool (image_pool * pool) {
+	pool->grey = NULL;
+	pool->grey_size = 0;
+	pool->colour = NULL;
+	pool->colour_size = 0;
+	}
+
+
+
+
+/* reset_image_pool: This function takes a pointer to an image pool and releases
+	all its buffers at once. Images read into the pool must not be used after
+	this. The pool can be used again afterwards. */
+
+void reset_image_pool (image_pool * pool) {
+	free(pool->grey);
+	free(pool->colour);
+	init_image_pool(pool);
+	}
+
+
+
+
+/* release_block: frees a block belonging to an image, unless the block is
+	owned by the pool of the image or the image is a view */
+
+static void release_block (image * im, void * p) {
+	if (im->pool == NULL && im->parent == NULL)
+		free(p);
+	}
+
+
+
+
+/* row_indices: returns the pixel values of a row of width pixels of bits bits
+	each, one byte per pixel. 8 bit rows already are that and are returned as
+	they are. 1 and 4 bit rows are unpacked into idx, which must hold width
+	bytes. The leftmost pixel is in the highest bits of the first byte */
+
+static const unsigned char * row_indices (const unsigned char * row, int width, int bits, unsigned char * idx) {
+
+	int j, k;
+
+	if (bits == 4) {
+		for (j=0; j + 1 < width; j += 2) {
+			idx[j] = row[j >> 1] >> 4;
+			idx[j+1] = row[j >> 1] & 15;
+			}
+		if (j < width)
+			idx[j] = row[j >> 1] >> 4;
+		return idx;
+		}
+
+	if (bits == 1) {
+		for (j=0; j + 8 <= width; j += 8) {
+			unsigned char b = row[j >> 3];
+			for (k=0; k < 8; k++)
+				idx[j+k] = (b >> (7 - k)) & 1;
+			}
+		for (k=0; j < width; j++, k++)
+			idx[j] = (row[j >> 3] >> (7 - k)) & 1;
+		return idx;
+		}
+
+	return row;
+	}
+
+
+
+
+/* rle_skip: hands the pixels from column from up to column to of file row y
+	over as a run of value 0 */
+
+static void rle_skip (header * h, rle_run run, void * arg, int y, int from, int to) {
+	static const unsigned char zero = 0;
+	if (to > h->width)
+		to = h->width;
+	if (y < h->height && from < to)
+		run(arg, h->height - 1 - y, from, to - from, &zero, 1);
+	}
+
+
+
+/* rle_decode: This function takes the compressed pixel data of an RLE8 or RLE4
+	bmp file, its length, the header of the file, a function to call for every
+	run of pixels and an argument for it. It walks the runs and hands each one
+	to the function as the image row and column where it starts, its length,
+	the pixel values and a flag. If the flag is set, the run is count copies of
+	px[0], otherwise px holds count different values. Every pixel of the image
+	is handed over exactly once; pixels the data skips (with an end of line,
+	a delta or the end of the bitmap) are given value 0. Runs going past the
+	right edge are cut at the edge.
+	Returns 0 on success and 1 if the data is not RLE8 or RLE4 */
+
+int rle_decode (const unsigned char * data, size_t len, header * h, rle_run run, void * arg) {
+
+	int rle4 = h->bits == 4;
+	int x = 0, y = 0;					// column and file row, row 0 at the bottom
+	size_t p = 0;
+	unsigned char px[256];
+	int k;
+
+	if (!((h->comp == 1 && h->bits == 8) || (h->comp == 2 && h->bits == 4))) {
+		fprintf(stderr,"ERROR: Image is not run length encoded\n");
+		return 1;
+		}
+
+	while (y < h->height && p + 2 <= len) {
+		int count = data[p], value = data[p+1];
+		int n = count < h->width - x ? count : h->width - x;
+		p += 2;
+
+		if (count > 0) {
+			/* encoded mode: count pixels of value. In RLE4 the two nibbles of
+			value take turns, so it is only a fill if they are the same */
+			if (n > 0) {
+				if (!rle4 || (value >> 4) == (value & 15)) {
+					px[0] = rle4 ? value & 15 : value;
+					run(arg, h->height - 1 - y, x, n, px, 1);
+					}
+				else {
+					for (k=0; k < n; k++)
+						px[k] = k & 1 ? value & 15 : value >> 4;
+					run(arg, h->height - 1 - y, x, n, px, 0);
+					}
+				}
+			x += count;
+			continue;
+			}
+
+		if (value == 0) {				// end of line
+			rle_skip(h, run, arg, y, x, h->width);
+			x = 0;
+			y++;
+			}
+		else if (value == 1) {			// end of bitmap
+			break;
+			}
+		else if (value == 2) {			// delta: move right and up
+			if (p + 2 > len)
+				break;
+			int dx = data[p], dy = data[p+1];
+			p += 2;
+			if (dy == 0)
+				rle_skip(h, run, arg, y, x, x + dx);
+			else {
+				rle_skip(h, run, arg, y, x, h->width);
+				for (k=1; k < dy; k++)
+					rle_skip(h, run, arg, y + k, 0, h->width);
+				rle_skip(h, run, arg, y + dy, 0, x + dx);
+				}
+			x += dx;
+			y += dy;
+			}
+		else {
+			/* absolute mode: value pixels follow as they are, padded to an
+			even number of bytes */
+			size_t bytes = rle4 ? (value + 1) / 2 : value;
+			if (p + bytes > len)
+				break;
+			n = value < h->width - x ? value : h->width - x;
+			if (n > 0) {
+				for (k=0; k < n; k++)
+					px[k] = rle4 ? (k & 1 ? data[p + k/2] & 15 : data[p + k/2] >> 4) : data[p + k];
+				run(arg, h->height - 1 - y, x, n, px, 0);
+				}
+			x += value;
+			p += bytes + (bytes & 1);
+			}
+		}
+
+	/* whatever the data did not reach is skipped */
+	rle_skip(h, run, arg, y, x, h->width);
+	for (y++; y < h->height; y++)
+		rle_skip(h, run, arg, y, 0, h->width);
+
+	return 0;
+	}
+
+
+
+/* colour_run: rle_run for an rgb image. The pixels are looked up in the
+	palette and stored in the triplets or in the planes. Runs of one colour
+	are plain byte fills of the planes */
+
+static void colour_run (void * arg, int i, int j, int count, const unsigned char * px, int repeat) {
+
+	image * im = (image *) arg;
+	int k;
+
+	if (repeat) {
+		colour c = im->c_index[px[0]];
+		if (im->is_planar) {
+			memset(PLANE_ROW(im,PLANE_R,i) + j, c.r, count);
+			memset(PLANE_ROW(im,PLANE_G,i) + j, c.g, count);
+			memset(PLANE_ROW(im,PLANE_B,i) + j, c.b, count);
+			}
+		else {
+			colour * dst = COLOUR_ROW(im,i) + j;
+			for (k=0; k < count; k++)
+				dst[k] = c;
+			}
+		}
+	else {
+		for (k=0; k < count; k++)
+			store_colour(im, i, j + k, im->c_index[px[k]]);
+		}
+	}
+
+
+
+/* grey_run: rle_run for a grey_target. A run of one value is a fill with its
+	value from the table, and is counted at once */
+
+static void grey_run (void * arg, int i, int j, int count, const unsigned char * px, int repeat) {
+
+	grey_target * g = (grey_target *) arg;
+	float * dst = g->data + (size_t) i * g->stride + j;
+	int k;
+
+	if (repeat) {
+		float v = g->lut[px[0]];
+		for (k=0; k < count; k++)
+			dst[k] = v;
+		if (g->used)
+			g->used[px[0]] += count;
+		}
+	else {
+		for (k=0; k < count; k++)
+			dst[k] = g->lut[px[k]];
+		if (g->used)
+			for (k=0; k < count; k++)
+				g->used[px[k]]++;
+		}
+	}
+
+
+
+
+/* decode_bmp: does the work for imdecode and imdecode_into. The buffers come
+	from im->pool when it is set */
+
+static int decode_bmp (const unsigned char * buf, size_t len, image * im) {
+
+	int i,j;
+
+	im->is_indexed = 0;
+	im->max_val = im->min_val = 0;
+	im->has_hist = 0;
+	im->is_rgb = 0;
+	im->c_index = NULL;
+	im->g_data = NULL;
+	im->c_data = NULL;
+	im->planes = NULL;
+
+	if (parse_header(&im->h, buf, len)) {
+		fprintf(stderr,"ERROR: Parsing the header failed\n");
+		return 1;
+		}
+
+	/* same rules as imread for deciding how the pixels are stored */
+	if (im->h.num_c > 0)
+		im->is_indexed = 1;
+	if (im->h.bits == 24 || im->h.num_c > 0)
+		im->is_rgb = 1;
+
+	int bits = im->h.bits;
+	if ((!im->is_rgb && bits != 8) || (im->is_indexed && bits != 1 && bits != 4 && bits != 8) ||
+			(!im->is_indexed && im->is_rgb && bits != 24)) {
+		fprintf(stderr,"Unsupported image with %d bit encoding\n",im->h.bits);
+		return 1;
+		}
+
+	/* the colour palette directly follows the info header. Each entry is
+	blue, green, red and a 0x00 */
+	if (im->is_indexed) {
+		const unsigned char * pal = buf + 14 + im->h.hsize;
+		if (im->pool)
+			im->c_index = im->pool->palette;
+		else
+			im->c_index = (colour *) malloc (sizeof(colour) * 256);
+		if (im->c_index == NULL) {
+			fprintf(stderr,"ERROR: Could not create colour index\n");
+			return 1;
+			}
+		/* indices outside the palette read as black instead of random memory */
+		memset(im->c_index, 0, sizeof(colour) * 256);
+		for (i=0; i < im->h.num_c && i < 256; i++) {
+			im->c_index[i].b = pal[4*i];
+			im->c_index[i].g = pal[4*i + 1];
+			im->c_index[i].r = pal[4*i + 2];
+			}
+		}
+
+	/* 1 and 4 bit rows are unpacked here, a byte per pixel */
+	unsigned char local[UNPACK_LOCAL], * idx = local;
+	if (bits < 8 && im->h.width > UNPACK_LOCAL)
+		idx = (unsigned char *) malloc (im->h.width);
+
+	if (idx == NULL || allocate_data_array(im)) {
+		fprintf(stderr,"ERROR: Error allocating data for image pixels\n");
+		if (idx != local)
+			free(idx);
+		release_block(im, im->c_index);
+		im->c_index = NULL;
+		return 1;
+		}
+
+	/* rows in the file are padded to multiples of 32 bits and stored bottom
+	up, so file row 0 is the last row of the image */
+	size_t row_bytes = (((size_t) im->h.width * im->h.bits + 31) / 32) * 4;
+	const unsigned char * row = buf + im->h.offset;
+
+	if (im->h.comp) {
+		/* compressed images always have a palette. Their runs go straight
+		into the rows */
+		rle_decode(buf + im->h.offset, len - im->h.offset, &im->h, colour_run, im);
+		}
+	else if (!im->is_rgb) {
+		unsigned char max = 0, min = 255;
+		memset(im->hist, 0, sizeof(im->hist));
+		for (i=im->h.height-1; i >= 0; i--, row += row_bytes) {
+			float * dst = GREY_ROW(im,i);
+			for (j=0; j < im->h.width; j++) {
+				unsigned char p = row[j];
+				dst[j] = (float) p;
+				im->hist[p]++;
+				max = p > max ? p : max;
+				min = p < min ? p : min;
+				}
+			}
+		im->max_val = max;
+		im->min_val = min;
+		im->has_hist = 1;
+		}
+	else if (im->is_planar) {
+		/* split the pixels into the three planes as we go */
+		for (i=im->h.height-1; i >= 0; i--, row += row_bytes) {
+			unsigned char * r = PLANE_ROW(im,PLANE_R,i);
+			unsigned char * g = PLANE_ROW(im,PLANE_G,i);
+			unsigned char * b = PLANE_ROW(im,PLANE_B,i);
+			if (im->is_indexed) {
+				const unsigned char * px = row_indices(row, im->h.width, bits, idx);
+				for (j=0; j < im->h.width; j++) {
+					colour c = im->c_index[px[j]];
+					r[j] = c.r; g[j] = c.g; b[j] = c.b;
+					}
+				}
+			else {
+				const unsigned char * src = row;
+				for (j=0; j < im->h.width; j++, src += 3) {
+					b[j] = src[0]; g[j] = src[1]; r[j] = src[2];
+					}
+				}
+			}
+		}
+	else if (im->is_indexed) {
+		for (i=im->h.height-1; i >= 0; i--, row += row_bytes) {
+			colour * dst = COLOUR_ROW(im,i);
+			const unsigned char * px = row_indices(row, im->h.width, bits, idx);
+			for (j=0; j < im->h.width; j++)
+				dst[j] = im->c_index[px[j]];
+			}
+		}
+	else {
+		/* 24 bit pixels are stored as blue, green and red */
+		for (i=im->h.height-1; i >= 0; i--, row += row_bytes) {
+			colour * dst = COLOUR_ROW(im,i);
+			const unsigned char * src = row;
+			for (j=0; j < im->h.width; j++, src += 3) {
+				dst[j].b = src[0];
+				dst[j].g = src[1];
+				dst[j].r = src[2];
+				}
+			}
+		}
+
+	if (idx != local)
+		free(idx);
+	return 0;
+	}
+
+
+
+
+/* imread_vector: This function takes a string, a pointer to an array of
+	floats, the length of the array and a threshold. It maps the named bmp file
+	and fills the array just like imread, colour_to_grey (averaging),
+	binarize and get_image_vector would one after the other, but in a single
+	scan over the pixels and without allocating an image (see imdecode_vector).
+	Returns 0 on success and 1 on failure */
+
+int imread_vector (char * imname, float * vect, int n, float t) {
+
+	size_t len;
+	unsigned char * map = map_image(imname, &len);
+
+	if (map == NULL)
+		return 1;
+
+	int ret = imdecode_vector(map, len, vect, n, t);
+
+	munmap(map, len);
+	return ret;
+	}
+
+
+
+
+/* imdecode_vector: This function takes a buffer holding an entire bmp file,
+	the length of the buffer, a pointer to an array of floats, the length of
+	the array and a threshold. Every pixel is converted to grey by averaging,
+	compared with the threshold and written rowwise in the array as 1.0 or 0.0.
+	The image must have exactly as many pixels as the array.
+	Returns 0 on success and 1 on failure */
+
+int imdecode_vector (const unsigned char * buf, size_t len, float * vect, int n, float t) {
+
+	header h;
+	int i,j;
+
+	if (buf == NULL || vect == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: buffer = %p, vector = %p\n",buf,vect);
+		return 1;
+		}
+
+	if (parse_header(&h, buf, len)) {
+		fprintf(stderr,"ERROR: Parsing the header failed\n");
+		return 1;
+		}
+
+	if ((long) h.width * h.height != n) {
+		fprintf(stderr,"ERROR: Image has %d x %d pixels, vector has %d\n",h.width,h.height,n);
+		return 1;
+		}
+
+	size_t row_bytes = (((size_t) h.width * h.bits + 31) / 32) * 4;
+	const unsigned char * row = buf + h.offset;
+
+	/* the rows are stored bottom up, so the vector is filled from its last row */
+	if (h.bits == 8 || h.bits == 4 || h.bits == 1) {
+		/* whatever the pixel means, grey level or palette index, its binary value
+		only depends on its value. So work it out once for all of them, the
+		same way colour_to_grey and binarize would */
+		float lut[256];
+		unsigned char local[UNPACK_LOCAL], * idx = local;
+		palette_to_grey(&h, buf + 14 + h.hsize, 'A', 1, t, lut);
+
+		if (h.comp) {
+			grey_target g = {vect, h.width, lut, NULL};
+			return rle_decode(row, len - h.offset, &h, grey_run, &g);
+			}
+
+		if (h.bits < 8 && h.width > UNPACK_LOCAL && (idx = (unsigned char *) malloc (h.width)) == NULL) {
+			fprintf(stderr,"ERROR: Could not allocate memory for unpacking a row\n");
+			return 1;
+			}
+
+		for (i=h.height-1; i >= 0; i--, row += row_bytes) {
+			float * dst = vect + (size_t) i * h.width;
+			const unsigned char * px = row_indices(row, h.width, h.bits, idx);
+			for (j=0; j < h.width; j++)
+				dst[j] = lut[px[j]];
+			}
+
+		if (idx != local)
+			free(idx);
+		}
+	else if (h.bits == 24 && h.num_c == 0) {
+		for (i=h.height-1; i >= 0; i--, row += row_bytes) {
+			float * dst = vect + (size_t) i * h.width;
+			const unsigned char * src = row;
+			for (j=0; j < h.width; j++, src += 3)
+				dst[j] = ((float) (src[0] + src[1] + src[2])) / 3 >= t ? 1.0 : 0.0;
+			}
+		}
+	else {
+		fprintf(stderr,"Unsupported image with %d bit encoding\n",h.bits);
+		return 1;
+		}
+
+	return 0;
+	}
+
+
+
+
+/* imread_grey: This function takes a string, a pointer to image structure and
+	a conversion method. It reads the named bmp file into a greyscale image, just
+	like imread followed by colour_to_grey would (see imdecode_grey).
+	Returns 0 on success and 1 on failure */
+
+int imread_grey (char * imname, image * im, char method) {
+
+	size_t len;
+	unsigned char * map = map_image(imname, &len);
+
+	if (map == NULL)
+		return 1;
+
+	im->pool = NULL;
+	im->parent = NULL;
+	int ret = decode_grey(map, len, im, method, 0, 0);
+
+	munmap(map, len);
+	return ret;
+	}
+
+
+
+/* imread_binary: This function takes a string, a pointer to image structure,
+	a conversion method and a threshold. It reads the named bmp file into a
+	binary image, just like imread followed by colour_to_grey and binarize
+	would (see imdecode_binary).
+	Returns 0 on success and 1 on failure */
+
+int imread_binary (char * imname, image * im, char method, float t) {
+
+	size_t len;
+	unsigned char * map = map_image(imname, &len);
+
+	if (map == NULL)
+		return 1;
+
+	im->pool = NULL;
+	im->parent = NULL;
+	int ret = decode_grey(map, len, im, method, 1, t);
+
+	munmap(map, len);
+	return ret;
+	}
+
+
+
+/* imdecode_grey: This function takes a buffer holding an entire bmp file, the
+	length of the buffer, a pointer to image structure and a conversion method
+	('L', 'A' or 'I', see colour_to_grey). It populates the image structure
+	with the greyscale image. For images of 1, 4 or 8 bits, indexed or not,
+	the at most 256 possible pixel values are converted to grey once and every
+	pixel is looked up in that table, so no colour data is ever allocated.
+	Returns 0 on success and 1 on failure */
+
+int imdecode_grey (const unsigned char * buf, size_t len, image * im, char method) {
+	if (im) {
+		im->pool = NULL;
+		im->parent = NULL;
+		}
+	return decode_grey(buf, len, im, method, 0, 0);
+	}
+
+
+
+/* imdecode_binary: This function takes the same arguments as imdecode_grey and
+	a threshold. It populates the image structure with the image binarized at
+	that threshold. For images of up to 8 bits the table holds the binary
+	values, so the pixels are only looked up once.
+	Returns 0 on success and 1 on failure */
+
+int imdecode_binary (const unsigned char * buf, size_t len, image * im, char method, float t) {
+	if (im) {
+		im->pool = NULL;
+		im->parent = NULL;
+		}
+	return decode_grey(buf, len, im, method, 1, t);
+	}
+
+
+
+/* decode_grey: does the work for imdecode_grey (binary = 0) and imdecode_binary
+	(binary = 1, threshold t) */
+
+static int decode_grey (const unsigned char * buf, size_t len, image * im, char method, int binary, float t) {
+
+	int i,j;
+
+	if (buf == NULL || im == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: buffer = %p, image = %p\n",buf,im);
+		return 1;
+		}
+
+	if (parse_header(&im->h, buf, len)) {
+		fprintf(stderr,"ERROR: Parsing the header failed\n");
+		return 1;
+		}
+
+	if (im->h.bits != 8 && im->h.bits != 4 && im->h.bits != 1) {
+		/* only pixels of up to 8 bits can go through a table. Decode the others
+		as usual, in planes so that the conversion can use the vector kernels */
+		int planar = im->is_planar;
+		im->is_planar = 1;
+		int ret = decode_bmp(buf, len, im);
+		im->is_planar = planar;
+		if (ret)
+			return 1;
+		colour_to_grey(im, method);
+		if (binary)
+			binarize(im, t);
+		return 0;
+		}
+
+	/* grey is the grey value of every possible pixel and lut what we actually
+	store for it, which is the binary value if we are binarizing */
+	float grey[256], lut[256];
+	palette_to_grey(&im->h, buf + 14 + im->h.hsize, method, 0, t, grey);
+	for (i=0; i < 256; i++)
+		lut[i] = binary ? (grey[i] >= t ? 1.0 : 0.0) : grey[i];
+
+	im->is_indexed = 0;
+	im->is_rgb = 0;
+	im->c_index = NULL;
+	im->g_data = NULL;
+	im->c_data = NULL;
+	im->planes = NULL;
+
+	unsigned char local[UNPACK_LOCAL], * idx = local;
+	if (im->h.bits < 8 && im->h.width > UNPACK_LOCAL)
+		idx = (unsigned char *) malloc (im->h.width);
+
+	if (idx == NULL || allocate_data_array(im)) {
+		fprintf(stderr,"ERROR: Error allocating data for image pixels\n");
+		if (idx != local)
+			free(idx);
+		return 1;
+		}
+
+	/* count how often each table entry is used, so that the minimum, maximum
+	and the grey level histogram come out of the table instead of being worked
+	out per pixel. Like binarize, the minimum and maximum stay those of the
+	grey values */
+	unsigned int used[256] = {0};
+	size_t row_bytes = (((size_t) im->h.width * im->h.bits + 31) / 32) * 4;
+	const unsigned char * row = buf + im->h.offset;
+
+	if (im->h.comp) {
+		/* runs of one value are filled and counted at once */
+		grey_target g = {im->g_data, im->stride, lut, used};
+		rle_decode(row, len - im->h.offset, &im->h, grey_run, &g);
+		}
+	else {
+		for (i=im->h.height-1; i >= 0; i--, row += row_bytes) {
+			float * dst = GREY_ROW(im,i);
+			const unsigned char * px = row_indices(row, im->h.width, im->h.bits, idx);
+			for (j=0; j < im->h.width; j++) {
+				dst[j] = lut[px[j]];
+				used[px[j]]++;
+				}
+			}
+		}
+
+	if (idx != local)
+		free(idx);
+
+	im->max_val = 0;
+	im->min_val = 255;
+	memset(im->hist, 0, sizeof(im->hist));
+	for (i=0; i < 256; i++) {
+		if (used[i]) {
+			im->max_val = grey[i] > im->max_val ? grey[i] : im->max_val;
+			im->min_val = grey[i] < im->min_val ? grey[i] : im->min_val;
+			im->hist[HIST_BIN(grey[i])] += used[i];
+			}
+		}
+	/* a binary image has no use for the histogram of its grey levels */
+	im->has_hist = !binary;
+
+	return 0;
+	}
+
+
+
+/* palette_to_grey: fills lut with the grey value of each of the 256 possible
+	pixel values of an 8 bit image described by header h. If the image has a
+	palette, pal points at it and the entries are converted with method, as
+	colour_to_grey would. Otherwise the pixel value is the grey value. If binary
+	is set the grey values are further binarized at threshold t */
+
+static void palette_to_grey (header * h, const unsigned char * pal, char method, int binary, float t, float * lut) {
+
+	int i;
+	float (* convert)();
+
+	switch (method) {
+		case 'A':	convert = averaging;
+					break;
+		case 'I':	convert = lightness;
+					break;
+		default:	convert = luminosity;
+					break;
+		}
+
+	if (h->num_c > 0) {
+		for (i=0; i < 256; i++)
+			lut[i] = 0.0;				// not in the palette: black
+		for (i=0; i < h->num_c && i < 256; i++) {
+			colour c;
+			c.b = pal[4*i]; c.g = pal[4*i + 1]; c.r = pal[4*i + 2];
+			lut[i] = convert(c);
+			}
+		}
+	else {
+		for (i=0; i < 256; i++)
+			lut[i] = (float) i;
+		}
+
+	if (binary) {
+		for (i=0; i < 256; i++)
+			lut[i] = lut[i] >= t ? 1.0 : 0.0;
+		}
+	}
+
+
+
+
 /* read_pixels: This function takes an image structure and a file handle,
 	it then calls an appropriate function to read the pixel data according to
 	the nature of the image */
@@ -116,6 +1012,13 @@ int read_pixels (image *im, FILE *fp) {
 	/* Check if the image is RGB. If so, call appropriate function to read the 
 	RGB pixel data. Otherwise, call the function to read the greyscale data */
 
+	/* the only compressions we know are RLE8 and RLE4, of indexed images */
+	if (im->h.comp != 0 && !(im->is_indexed && ((im->h.comp == 1 && im->h.bits == 8) ||
+			(im->h.comp == 2 && im->h.bits == 4)))) {
+		fprintf(stderr,"Unsupported compression %d of a %d bit image\n",im->h.comp,im->h.bits);
+		return 1;
+		}
+
 	if (im->is_rgb) {
 		return read_rgb_pixels(im,fp);
 		}
@@ -137,6 +1040,7 @@ int read_grey_pixels (image *im, FILE *fp) {
 	int i,j;
 	im->max_val=0;
 	im->min_val=255;
+	memset(im->hist, 0, sizeof(im->hist));
 	int bytes = im->h.bits/8;		// should be 1
 	unsigned char temp;
 	/* calculate the paddin in the image rows. bitmaps are rounded to be multiples of
@@ -155,14 +1059,19 @@ int read_grey_pixels (image *im, FILE *fp) {
 		
 
 	for (i=im->h.height-1; i >= 0; i--) {
+		float * dst = GREY_ROW(im,i);
 		for (j=0; j < im->h.width; j++) {
 			fread(&temp, 1, bytes, fp);
-			im->g_data[i][j] = (float) temp;
+			dst[j] = (float) temp;
+			im->hist[temp]++;
 			im->max_val = temp > im->max_val ? temp : im->max_val;
 			im->min_val = temp < im->min_val ? temp : im->min_val;
 			}
-		fread(&temp, 1, pad, fp);
+		fseek(fp, pad, SEEK_CUR);
 		}
+
+	im->has_hist = 1;
+	return 0;
 	}
 
 
@@ -171,15 +1080,28 @@ int read_grey_pixels (image *im, FILE *fp) {
 	accepts the file handle and the image structure and reads the rgb pixel
 	data
 
-	NOTE: We can handle 8 bit indexed image which can be greyscale (RGB having
+	NOTE: We can handle 1, 4 or 8 bit indexed image which can be greyscale (RGB having
 	same value) or coloured (RGB having different values in the palette). OR
-	we can handle 24 bit RGB image where each byte is R, G, and B.
+	we can handle 24 bit RGB image where each byte is B, G, and R.
 
 	WE DO NOT HANDLE 24 BIT INDEXED BMP IMAGES. I just think that should not happen.
 	there is no sense in having a colour palette if you have 24 bit encoding. This
 	kind of image will be simply read as an 24 but image ignoring the palette */
 
 
+/* store_colour: puts colour c at row i and column j of an rgb image, in the
+	triplets or in the planes depending on how the image is stored */
+
+static void store_colour (image * im, int i, int j, colour c) {
+	if (im->is_planar) {
+		PLANE_ROW(im,PLANE_R,i)[j] = c.r;
+		PLANE_ROW(im,PLANE_G,i)[j] = c.g;
+		PLANE_ROW(im,PLANE_B,i)[j] = c.b;
+		}
+	else
+		COLOUR_ROW(im,i)[j] = c;
+	}
+
 
 int read_rgb_pixels(image *im,FILE *fp) {
 	
@@ -194,6 +1116,11 @@ int read_rgb_pixels(image *im,FILE *fp) {
 
 	/* Following procedure is to read the indexed data */
 	if (im->is_indexed == 1) {
+		if (im->h.bits != 1 && im->h.bits != 4 && im->h.bits != 8) {
+			fprintf(stderr,"Unsupported indexed image with %d bit encoding\n",im->h.bits);
+			return 1;
+			}
+
 		if (read_colour_palette(im,fp)) {
 			return 1;
 			}
@@ -204,17 +1131,54 @@ int read_rgb_pixels(image *im,FILE *fp) {
 		fprintf(stderr,"ERROR: Could not locate image data\n");
 		}
 
-		for (i=im->h.height-1; i >= 0; i--) {
-			int temp=0;
-			for (j=0; j < im->h.width; j++) {
-				temp=0;
-				fread(&temp, 1, bytes, fp);
-				im->c_data[i][j].r = im->c_index[temp].r;
-				im->c_data[i][j].g = im->c_index[temp].g;
-				im->c_data[i][j].b = im->c_index[temp].b;
+		if (im->h.comp) {
+			/* compressed rows have no fixed length, so read all the pixel data
+			and expand the runs from memory */
+			long start = ftell(fp), end;
+			unsigned char * data;
+			size_t len;
+			if (start < 0 || fseek(fp, 0, SEEK_END) || (end = ftell(fp)) < start ||
+					fseek(fp, start, SEEK_SET)) {
+				fprintf(stderr,"ERROR: Could not locate image data\n");
+				return 1;
+				}
+			len = end - start;
+			data = (unsigned char *) malloc (len ? len : 1);
+			if (data == NULL) {
+				fprintf(stderr,"ERROR: Could not allocate memory for the compressed pixels\n");
+				return 1;
 				}
-			fread(&temp, 1, pad, fp);
+			len = fread(data, 1, len, fp);
+			int ret = rle_decode(data, len, &im->h, colour_run, im);
+			free(data);
+			return ret;
 			}
+
+		/* read a whole row at a time, padding and all, and get the palette
+		index of every pixel out of it. 1 and 4 bit pixels share their bytes */
+		size_t row_bytes = (((size_t) im->h.width * im->h.bits + 31) / 32) * 4;
+		unsigned char * row = (unsigned char *) malloc (row_bytes);
+		unsigned char * idx = (unsigned char *) malloc (im->h.width);
+		colour black = {0, 0, 0};
+
+		if (row == NULL || idx == NULL) {
+			fprintf(stderr,"ERROR: Could not allocate memory for reading a row\n");
+			free(row);
+			free(idx);
+			return 1;
+			}
+
+		for (i=im->h.height-1; i >= 0; i--) {
+			const unsigned char * px;
+			if (fread(row, 1, row_bytes, fp) != row_bytes)
+				memset(row, 0, row_bytes);		// missing rows read as index 0
+			px = row_indices(row, im->h.width, im->h.bits, idx);
+			for (j=0; j < im->h.width; j++)
+				store_colour(im, i, j, px[j] < im->h.num_c ? im->c_index[px[j]] : black);
+			}
+
+		free(row);
+		free(idx);
 		}
 	else {
 	/* Else the following procedure is to read 24 bit RGB data with no 
@@ -225,13 +1189,15 @@ int read_rgb_pixels(image *im,FILE *fp) {
 		}
 
 		for (i=im->h.height-1; i >= 0; i--) {
-			unsigned char temp;
+			colour c;
 			for (j=0; j < im->h.width; j++) {
-				fread(&im->c_data[i][j].r, 1, 1, fp);
-				fread(&im->c_data[i][j].g, 1, 1, fp);
-				fread(&im->c_data[i][j].b, 1, 1, fp);
+				/* pixels are stored as blue, green and red */
+				fread(&c.b, 1, 1, fp);
+				fread(&c.g, 1, 1, fp);
+				fread(&c.r, 1, 1, fp);
+				store_colour(im, i, j, c);
 				}
-			fread(&temp, 1, pad, fp);
+			fseek(fp, pad, SEEK_CUR);
 			}
 		}
 
@@ -250,8 +1216,9 @@ int read_colour_palette (image *im, FILE *fp) {
 	unsigned char trash;			// this is to hold the junk in colour palette
 	int i;
 
-	/* allocate the memory for colour palette */
-	im->c_index = (colour *) malloc (sizeof(colour) * im->h.num_c);
+	/* allocate the memory for colour palette. Room is made for all 256 values
+	a pixel can have, those missing from the palette being black */
+	im->c_index = (colour *) calloc (im->h.num_c > 256 ? im->h.num_c : 256, sizeof(colour));
 	if (im->c_index == NULL) {
 
 		/* clean up if we are not able to prepare the index. No point in continuing 
@@ -283,41 +1250,60 @@ int read_colour_palette (image *im, FILE *fp) {
 
 int allocate_data_array (image *im) {
 
-	/* allocate memory for pixel data. This is pointer to pointers. Depending
-	on whether the image is RGB or Grey, we need to allocate float or colour vector */
+	/* allocate memory for pixel data. This is a single block holding all the
+	rows one after the other. Depending on whether the image is RGB or Grey, we
+	need to allocate float or colour vector */
+
+	void * data = NULL;
+	size_t pixels, size;
+
+	im->width = im->h.width;
+	im->height = im->h.height;
+	im->stride = im->h.width;	// rows are not padded, so the block is also a vector
+	pixels = (size_t) im->stride * im->height;
 
 	if (im->is_rgb == 1)
-		im->c_data = (colour **) malloc (sizeof(colour *) * im->h.height );
+		size = pixels * (im->is_planar ? 3 : sizeof(colour));
 	else
-		im->g_data = (float **) malloc (sizeof(float *) * im->h.height );
-
-	if (im->g_data == NULL && im->c_data == NULL) {
+		size = pixels * sizeof(float);
+	/* round the size up to the alignment so that whole vectors can be loaded
+	past the last pixel */
+	size = (size + IMAGE_ALIGN - 1) & ~((size_t) IMAGE_ALIGN - 1);
+
+	if (im->pool) {
+		/* take the block from the pool, growing it only if it is too small */
+		int rgb = im->is_rgb == 1;
+		void ** block = rgb ? &im->pool->colour : &im->pool->grey;
+		size_t * block_size = rgb ? &im->pool->colour_size : &im->pool->grey_size;
+
+		if (*block_size < size) {
+			free(*block);
+			*block = NULL;
+			*block_size = 0;
+			if (posix_memalign(block, IMAGE_ALIGN, size)) {
+				*block = NULL;
+				fprintf(stderr,"ERROR: Could not allocate memory for the image data\n");
+				return 1;
+				}
+			*block_size = size;
+			}
+		data = *block;
+		}
+	else if (size == 0 || posix_memalign(&data, IMAGE_ALIGN, size)) {
 		fprintf(stderr,"ERROR: Could not allocate memory for the image data\n");
 		return 1;
 		}
 
-	int i;
-	for (i=0; i < im->h.height; i++ ) { 
-		/* Using calloc here to initialize the pixels to 0. just in case
-		if there is some problem with header and we find less number of 
-		pixel data than we should */
-		int flag=0;
-		if (im->is_rgb == 1) {
-			im->c_data[i] = (colour *) malloc ( sizeof(colour) * im->h.width );
-			flag = im->c_data[i] == NULL ? 1 : 0 ;
-			}
-		else {
-			im->g_data[i] = (float *) calloc( im->h.width, sizeof(float) );
-			flag = im->c_data[i] == NULL ? 1 : 0 ;
-			}
+	/* initialize the pixels to 0. just in case if there is some problem with
+	header and we find less number of pixel data than we should */
+	memset(data, 0, size);
 
-		if (flag == 1) {
-			fprintf(stderr,"ERROR: Could not allocate memory for the image data row\n");
-			free(im->c_data);
-			free(im->g_data);
-			return 1;
-			}
-		}
+	if (im->is_rgb == 1 && im->is_planar)
+		im->planes = (unsigned char *) data;
+	else if (im->is_rgb == 1)
+		im->c_data = (colour *) data;
+	else
+		im->g_data = (float *) data;
 
 	return 0;
 	}
@@ -356,6 +1342,90 @@ int read_header(header * h, FILE * fp) {
 	h->num_c = 0; fread(&h->num_c, 4, 1, fp);			// 4 bytes specifying number of colours in colour palette
 	h->imp_c = 0; fread(&h->imp_c, 4, 1, fp);			// 4 bytes specifying number of important colours. 0 when all are imp. Generally ignored.
 
+	/* 1 and 4 bit images, and run length encoded ones, always have a palette.
+	When the header gives no size for it, it has an entry for every possible
+	pixel value */
+	if (h->bits > 0 && (h->bits < 8 || h->comp == 1 || h->comp == 2) && h->bits <= 8 && h->num_c == 0)
+		h->num_c = 1 << h->bits;
+
+	return 0;
+	}
+
+
+/* parse_header: This function takes a pointer to a bmp header structure, a
+	buffer holding the bmp file and the length of the buffer. It populates the
+	header structure from the buffer and checks that the pixel data described
+	by the header actually fits in the buffer.
+	Returns 0 on success and 1 on failure */
+
+static int rd16 (const unsigned char * p) {
+	return p[0] | (p[1] << 8);
+	}
+
+static int rd32 (const unsigned char * p) {
+	return (int) ((unsigned) p[0] | ((unsigned) p[1] << 8) | ((unsigned) p[2] << 16) | ((unsigned) p[3] << 24));
+	}
+
+int parse_header (header * h, const unsigned char * buf, size_t len) {
+
+	/* file header is 14 bytes and the smallest info header we read is 40 */
+	if (len < 54) {
+		fprintf(stderr,"ERROR: File too short to be a bmp image\n");
+		return 1;
+		}
+
+	/* same fields in the same order as read_header, only read out of memory */
+	h->type = rd16(buf);
+	h->size = rd32(buf + 2);
+	h->reserved = rd32(buf + 6);
+	h->offset = rd32(buf + 10);
+
+	h->hsize = rd32(buf + 14);
+	h->width = rd32(buf + 18);
+	h->height = rd32(buf + 22);
+	h->c_planes = rd16(buf + 26);
+	h->bits = rd16(buf + 28);
+
+	h->comp = rd32(buf + 30);
+	h->imsize = rd32(buf + 34);
+	h->hres = rd32(buf + 38);
+	h->vres = rd32(buf + 42);
+	h->num_c = rd32(buf + 46);
+	h->imp_c = rd32(buf + 50);
+
+	/* 1 and 4 bit images, and run length encoded ones, always have a palette.
+	When the header gives no size for it, it has an entry for every possible
+	pixel value */
+	if (h->bits > 0 && (h->bits < 8 || h->comp == 1 || h->comp == 2) && h->bits <= 8 && h->num_c == 0)
+		h->num_c = 1 << h->bits;
+
+	if (h->type != ('B' | ('M' << 8))) {
+		fprintf(stderr,"ERROR: Not a bmp image\n");
+		return 1;
+		}
+
+	if (h->width <= 0 || h->height <= 0 || h->bits <= 0) {
+		fprintf(stderr,"ERROR: Unsupported image dimensions %d x %d, %d bits\n",h->width,h->height,h->bits);
+		return 1;
+		}
+
+	if (h->comp != 0 && !(h->comp == 1 && h->bits == 8) && !(h->comp == 2 && h->bits == 4)) {
+		fprintf(stderr,"ERROR: Unsupported compression %d of a %d bit image\n",h->comp,h->bits);
+		return 1;
+		}
+
+	/* make sure that the palette and every pixel row lie inside the buffer, so
+	that the decoder can walk them without any further checks. Compressed
+	pixel data has no rows, rle_decode checks it as it goes */
+	size_t row_bytes = (((size_t) h->width * h->bits + 31) / 32) * 4;
+	if (h->offset < 0 || (size_t) h->offset > len ||
+			(h->comp == 0 && row_bytes * h->height > len - h->offset) ||
+			h->num_c < 0 || h->hsize < 0 ||
+			14 + (size_t) h->hsize + 4 * (size_t) h->num_c > len) {
+		fprintf(stderr,"ERROR: Pixel data lies outside the bmp file\n");
+		return 1;
+		}
+
 	return 0;
 	}
 
@@ -382,11 +1452,286 @@ void binarize(image * im,float t) {
 		}
 	
 
-	for (i=0; i < im->h.height; i++) {
-		for (j=0; j < im->h.width; j++) {
-			im->g_data[i][j] = im->g_data[i][j] >= t ? 1.0 : 0.0;
+	for (i=0; i < im->height; i++) {
+		float * row = GREY_ROW(im,i);
+		for (j=0; j < im->width; j++) {
+			row[j] = row[j] >= t ? 1.0 : 0.0;
+			}
+		}
+
+	im->has_hist = 0;		// the grey levels are gone
+	}
+
+
+
+/* binarize_auto: This function takes a greyscale image and binarizes it at the
+	threshold picked by otsu_threshold from the grey level histogram. The
+	histogram gathered while decoding is used if there is one, otherwise it is
+	built first.
+	Returns the threshold used, or -1 on failure */
+
+float binarize_auto (image * im) {
+	int i,j;
+	float t;
+
+	if (im->is_rgb == 1) {
+		fprintf(stderr,"ERROR: Image binarization should be done on greyscale images.\n");
+		return -1;
+		}
+
+	if (! im->has_hist) {
+		memset(im->hist, 0, sizeof(im->hist));
+		for (i=0; i < im->height; i++) {
+			float * row = GREY_ROW(im,i);
+			for (j=0; j < im->width; j++)
+				im->hist[HIST_BIN(row[j])]++;
+			}
+		im->has_hist = 1;
+		}
+
+	t = otsu_threshold(im->hist);
+	binarize(im,t);
+	return t;
+	}
+
+
+
+/* otsu_threshold: This function takes a 256 bin grey level histogram and returns
+	the threshold which maximizes the variance between the pixels below it and
+	those at or above it (Otsu's method). Pixels >= threshold are the bright
+	class, as for binarize. Takes O(256) whatever the size of the image */
+
+float otsu_threshold (unsigned int * hist) {
+	int k;
+	double total = 0, sum = 0;
+
+	for (k=0; k < 256; k++) {
+		total += hist[k];
+		sum += (double) k * hist[k];
+		}
+
+	/* walk the split point up through the histogram keeping the weight and
+	the sum of the dark class. The between class variance for a split after
+	bin k is w0 * w1 * (mean0 - mean1)^2 */
+	double w0 = 0, sum0 = 0, best = -1;
+	int best_k = 0;
+	for (k=0; k < 255; k++) {
+		w0 += hist[k];
+		sum0 += (double) k * hist[k];
+		double w1 = total - w0;
+		if (w0 == 0 || w1 == 0)
+			continue;
+		double d = sum0 / w0 - (sum - sum0) / w1;
+		double var = w0 * w1 * d * d;
+		if (var > best) {
+			best = var;
+			best_k = k;
+			}
+		}
+
+	/* bins 0 to best_k are dark, so the bright class starts at the next level */
+	return best_k + 1;
+	}
+
+
+
+/* binarize_local: This function takes a greyscale image, a method, a window
+	size, a parameter k and a number of threads. Instead of one threshold for
+	the whole image, every pixel gets its own threshold from the mean m and
+	standard deviation s of the window x window pixels around it:
+	1. 'S': Sauvola-	m * (1 + k * (s / 128 - 1)), k around 0.2 to 0.5 (default)
+	2. 'N': Niblack-	m + k * s, k around -0.2
+	Pixels at or above their threshold become 1, the others 0, as for binarize.
+	The image is cut in bands of rows, one per thread, and every thread keeps
+	integral images of the grey levels and their squares for just the rows of
+	the window it is at, so the mean and deviation cost O(1) per pixel
+	whatever the window size and the memory does not grow with the height of
+	the image. Passing 0 threads uses one per processor.
+	Returns 0 on success and 1 on failure */
+
+/* dynamic range of the standard deviation in Sauvola's formula */
+#define SAUVOLA_R 128.0
+
+/* the grey level of a pixel in the integral images, whole so that they are exact */
+#define LOCAL_LEVEL(v) ((uint64_t) HIST_BIN((v) + 0.5f))
+
+/* work for one band of rows of binarize_local. Integral row R holds, for every
+	column j, the sum of the pixels in columns 0..j-1 of rows 'base'..R-1, so
+	the sum of a window is found from two of its rows. Only the 'ring' rows the
+	window reaches are kept, row R in slot (R - base) % ring. The rows of the
+	window above and below the band belong to the bands next to it, which may
+	binarize them first, so the band works on copies of them */
+
+typedef struct {
+	image * im;
+	int first, last;				// rows of this band, last excluded
+	int base;						// first row of the windows of the band
+	int half;						// half of the window size
+	char method;
+	float k;
+	float * above, * below;			// copies of rows base..first-1 and last..last+half-1
+	uint64_t * sum, * sq;			// the kept integral rows of the pixels and their squares
+	int ring;						// number of integral rows kept
+	} local_band;
+
+static const float * local_row (local_band * b, int r) {
+	if (r < b->first)
+		return b->above + (size_t) (r - b->base) * b->im->width;
+	if (r >= b->last)
+		return b->below + (size_t) (r - b->last) * b->im->width;
+	return GREY_ROW(b->im,r);
+	}
+
+static void * binarize_band (void * arg) {
+
+	local_band * b = (local_band *) arg;
+	image * im = b->im;
+	size_t w1 = im->width + 1;
+	int i,j,next;
+
+	/* integral row 'base' is all zeros */
+	memset(b->sum, 0, sizeof(uint64_t) * w1);
+	memset(b->sq, 0, sizeof(uint64_t) * w1);
+	next = b->base + 1;
+
+	for (i=b->first; i < b->last; i++) {
+		int r0 = i - b->half < 0 ? 0 : i - b->half;
+		int r1 = i + b->half >= im->height ? im->height - 1 : i + b->half;
+		float * row = GREY_ROW(im,i);
+
+		/* bring the integral rows down to the bottom of the window. A pixel row
+		is added before the band binarizes it, as the window runs ahead of it */
+		for (; next <= r1 + 1; next++) {
+			const float * src = local_row(b, next - 1);
+			const uint64_t * s_up = b->sum + (size_t) ((next - 1 - b->base) % b->ring) * w1;
+			const uint64_t * q_up = b->sq + (size_t) ((next - 1 - b->base) % b->ring) * w1;
+			uint64_t * s = b->sum + (size_t) ((next - b->base) % b->ring) * w1;
+			uint64_t * q = b->sq + (size_t) ((next - b->base) % b->ring) * w1;
+			uint64_t rs = 0, rq = 0;
+
+			s[0] = q[0] = 0;
+			for (j=0; j < im->width; j++) {
+				uint64_t v = LOCAL_LEVEL(src[j]);
+				rs += v;
+				rq += v * v;
+				s[j+1] = s_up[j+1] + rs;
+				q[j+1] = q_up[j+1] + rq;
+				}
+			}
+
+		uint64_t * s0 = b->sum + (size_t) ((r0 - b->base) % b->ring) * w1;
+		uint64_t * s1 = b->sum + (size_t) ((r1 + 1 - b->base) % b->ring) * w1;
+		uint64_t * q0 = b->sq + (size_t) ((r0 - b->base) % b->ring) * w1;
+		uint64_t * q1 = b->sq + (size_t) ((r1 + 1 - b->base) % b->ring) * w1;
+
+		for (j=0; j < im->width; j++) {
+			int c0 = j - b->half < 0 ? 0 : j - b->half;
+			int c1 = j + b->half >= im->width ? im->width : j + b->half + 1;
+			double n = (double) (r1 - r0 + 1) * (c1 - c0);
+			double m = (s1[c1] - s0[c1] - s1[c0] + s0[c0]) / n;
+			double var = (q1[c1] - q0[c1] - q1[c0] + q0[c0]) / n - m * m;
+			double sd = var > 0 ? sqrt(var) : 0;
+			double t;
+
+			if (b->method == 'N')
+				t = m + b->k * sd;
+			else
+				t = m * (1 + b->k * (sd / SAUVOLA_R - 1));
+
+			row[j] = row[j] >= t ? 1.0 : 0.0;
 			}
 		}
+
+	return NULL;
+	}
+
+int binarize_local (image * im, char method, int window, float k, int threads) {
+
+	int i;
+	int half, ring;
+	size_t w1, halo;
+	uint64_t * ints;
+	float * rows;
+
+	if (im == NULL || im->is_rgb == 1) {
+		fprintf(stderr,"ERROR: Image binarization should be done on greyscale images.\n");
+		return 1;
+		}
+
+	if (window < 1) {
+		fprintf(stderr,"ERROR: Window for local binarization can not be %d pixels\n",window);
+		return 1;
+		}
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > im->height)
+		threads = im->height;
+	if (threads < 1)
+		threads = 1;
+
+	/* a window reaches 2 * half + 1 rows, so that many and one more integral
+	rows are kept, but never more than the image has */
+	half = window / 2;
+	ring = 2 * half + 2 < im->height + 1 ? 2 * half + 2 : im->height + 1;
+	halo = (size_t) (half < im->height ? half : im->height) * im->width;
+	w1 = im->width + 1;
+
+	ints = (uint64_t *) malloc (sizeof(uint64_t) * 2 * threads * ring * w1);
+	rows = (float *) malloc (sizeof(float) * (2 * threads * halo + 1));
+	if (ints == NULL || rows == NULL) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the integral images\n");
+		free(ints);
+		free(rows);
+		return 1;
+		}
+
+	local_band bands[threads];
+	pthread_t tid[threads];
+	int started = 0;
+	for (i=0; i < threads; i++) {
+		local_band * b = &bands[i];
+		int r, end;
+
+		b->im = im;
+		b->first = (long) im->height * i / threads;
+		b->last = (long) im->height * (i + 1) / threads;
+		b->base = b->first - half < 0 ? 0 : b->first - half;
+		b->half = half;
+		b->method = method;
+		b->k = k;
+		b->ring = ring;
+		b->sum = ints + (size_t) 2 * i * ring * w1;
+		b->sq = b->sum + (size_t) ring * w1;
+		b->above = rows + 2 * i * halo;
+		b->below = b->above + halo;
+
+		/* the rows next to the band are copied before any band is binarized */
+		end = b->last + half < im->height ? b->last + half : im->height;
+		for (r=b->base; r < b->first; r++)
+			memcpy(b->above + (size_t) (r - b->base) * im->width, GREY_ROW(im,r), sizeof(float) * im->width);
+		for (r=b->last; r < end; r++)
+			memcpy(b->below + (size_t) (r - b->last) * im->width, GREY_ROW(im,r), sizeof(float) * im->width);
+		}
+
+	/* every band only reads its own rows and copies and writes its own rows,
+	so the bands need no locking */
+	for (i=1; i < threads; i++) {
+		if (pthread_create(&tid[i], NULL, binarize_band, &bands[i]))
+			break;
+		started++;
+		}
+	binarize_band(&bands[0]);
+	/* bands whose thread could not be started are done here */
+	for (i=started + 1; i < threads; i++)
+		binarize_band(&bands[i]);
+	for (i=1; i <= started; i++)
+		pthread_join(tid[i], NULL);
+
+	free(ints);
+	free(rows);
+	im->has_hist = 0;
+	return 0;
 	}
 
 
@@ -410,6 +1755,7 @@ int colour_to_grey (image *im, char method) {
 
 	im->max_val = 0;
 	im->min_val = 255;
+	memset(im->hist, 0, sizeof(im->hist));
 
 	switch (method) {
 		case 'L': 	convert = luminosity;
@@ -418,29 +1764,54 @@ int colour_to_grey (image *im, char method) {
 					break;
 		case 'I':	convert = lightness;
 					break;
-	default:	convert = luminosity;
+	default:	method = 'L';
+				convert = luminosity;
 					break;
 		}
 	
 	// first set the RGB flag to 0 and get a new memory allocated to the image data
 	im->is_rgb = 0;
-	allocate_data_array(im);
+	if (allocate_data_array(im)) {
+		im->is_rgb = 1;
+		return 1;
+		}
 
 	int i,j;
-	for (i=0; i < im->h.height; i++)
-		for (j=0; j < im->h.width; j++) {
-			im->g_data[i][j] = convert(im->c_data[i][j]);
-			im->max_val = im->g_data[i][j] > im->max_val ? im->g_data[i][j] : im->max_val;
-			im->min_val = im->g_data[i][j] < im->min_val ? im->g_data[i][j] : im->min_val;
+	if (im->planes) {
+		/* planes can be loaded a vector at a time, so use the best kernel the
+		processor has for a row at a time */
+		grey_kernel kernel = select_grey_kernel();
+		for (i=0; i < im->height; i++) {
+			float * dst = GREY_ROW(im,i);
+			kernel(method, PLANE_ROW(im,PLANE_R,i), PLANE_ROW(im,PLANE_G,i), PLANE_ROW(im,PLANE_B,i),
+				dst, im->width, &im->min_val, &im->max_val);
+			/* the row is still in cache, so count it while it is there */
+			for (j=0; j < im->width; j++)
+				im->hist[HIST_BIN(dst[j])]++;
+			}
+		}
+	else {
+		for (i=0; i < im->height; i++) {
+			colour * src = COLOUR_ROW(im,i);
+			float * dst = GREY_ROW(im,i);
+			for (j=0; j < im->width; j++) {
+				dst[j] = convert(src[j]);
+				im->hist[HIST_BIN(dst[j])]++;
+				im->max_val = dst[j] > im->max_val ? dst[j] : im->max_val;
+				im->min_val = dst[j] < im->min_val ? dst[j] : im->min_val;
+				}
 			}
+		}
 
 	
 	/* If we are here, we can now safely deallocate the colour data */
-	for (i=0; i < im->h.height; i++)
-		free(im->c_data[i]);
-	free(im->c_data);
+	release_block(im, im->c_data);
+	release_block(im, im->planes);
+	im->c_data = NULL;
+	im->planes = NULL;
 
 	im->is_indexed=0;
+	im->has_hist = 1;
 	return 0;
 	}
 
@@ -467,9 +1838,163 @@ float lightness (colour c) {
 
 
 float luminosity (colour c) {
-	/* 0.21 R + 0.71 G + 0.07 B is the formula. This is because humans are
-	more sensitive to green colour */
-	return ((0.21 * c.r + 0.71 * c.b + 0.07 * c.g) / 3);
+	/* 0.21 R + 0.72 G + 0.07 B is the formula. This is because humans are
+	more sensitive to green colour. The weights add up to 1, so there is
+	nothing to divide by */
+	return LUM_R * c.r + LUM_G * c.g + LUM_B * c.b;
+	}
+
+
+
+
+/* ______________ grey conversion kernels for planar rgb rows _______________ */
+
+
+/* grey_kernel: converts n pixels of a row given as red, green and blue planes
+	to grey using method 'L', 'A' or 'I' (see colour_to_grey), and updates the
+	minimum and maximum grey values. Every kernel gives exactly the same values
+	as the scalar functions above */
+
+static void grey_row_scalar (char method, const unsigned char * r, const unsigned char * g,
+		const unsigned char * b, float * dst, int n, float * min, float * max) {
+
+	int j;
+	for (j=0; j < n; j++) {
+		colour c;
+		c.r = r[j]; c.g = g[j]; c.b = b[j];
+		switch (method) {
+			case 'A':	dst[j] = averaging(c);
+						break;
+			case 'I':	dst[j] = lightness(c);
+						break;
+			default:	dst[j] = luminosity(c);
+						break;
+			}
+		*max = dst[j] > *max ? dst[j] : *max;
+		*min = dst[j] < *min ? dst[j] : *min;
+		}
+	}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+/* SSE2: four pixels at a time. Bytes are widened to 32 bit ints and then to
+	floats. SSE2 has no 32 bit integer min/max, so lightness works on floats,
+	which is exact for values up to 255 */
+
+__attribute__((target("sse2")))
+static __m128 load4_sse2 (const unsigned char * p) {
+	int v;
+	__m128i zero = _mm_setzero_si128();
+	memcpy(&v, p, 4);
+	__m128i x = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero);
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero));
+	}
+
+__attribute__((target("sse2")))
+static void grey_row_sse2 (char method, const unsigned char * r, const unsigned char * g,
+		const unsigned char * b, float * dst, int n, float * min, float * max) {
+
+	int j;
+	float lo[4], hi[4];
+	__m128 vmin = _mm_set1_ps(*min), vmax = _mm_set1_ps(*max);
+
+	for (j=0; j + 4 <= n; j += 4) {
+		__m128 vr = load4_sse2(r + j), vg = load4_sse2(g + j), vb = load4_sse2(b + j);
+		__m128 v;
+		switch (method) {
+			case 'A':	v = _mm_div_ps(_mm_add_ps(_mm_add_ps(vr, vb), vg), _mm_set1_ps(3));
+						break;
+			case 'I':	v = _mm_div_ps(_mm_add_ps(_mm_max_ps(_mm_max_ps(vr, vb), vg),
+								_mm_min_ps(_mm_min_ps(vr, vb), vg)), _mm_set1_ps(2));
+						break;
+			default:	v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(LUM_R), vr),
+								_mm_mul_ps(_mm_set1_ps(LUM_G), vg)), _mm_mul_ps(_mm_set1_ps(LUM_B), vb));
+						break;
+			}
+		_mm_storeu_ps(dst + j, v);
+		vmin = _mm_min_ps(vmin, v);
+		vmax = _mm_max_ps(vmax, v);
+		}
+
+	_mm_storeu_ps(lo, vmin);
+	_mm_storeu_ps(hi, vmax);
+	for (int k=0; k < 4; k++) {
+		*min = lo[k] < *min ? lo[k] : *min;
+		*max = hi[k] > *max ? hi[k] : *max;
+		}
+
+	grey_row_scalar(method, r + j, g + j, b + j, dst + j, n - j, min, max);
+	}
+
+
+/* AVX2: eight pixels at a time, widening the bytes with vpmovzxbd */
+
+__attribute__((target("avx2")))
+static __m256 load8_avx2 (const unsigned char * p) {
+	return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) p)));
+	}
+
+__attribute__((target("avx2")))
+static void grey_row_avx2 (char method, const unsigned char * r, const unsigned char * g,
+		const unsigned char * b, float * dst, int n, float * min, float * max) {
+
+	int j;
+	float lo[8], hi[8];
+	__m256 vmin = _mm256_set1_ps(*min), vmax = _mm256_set1_ps(*max);
+
+	for (j=0; j + 8 <= n; j += 8) {
+		__m256 vr = load8_avx2(r + j), vg = load8_avx2(g + j), vb = load8_avx2(b + j);
+		__m256 v;
+		switch (method) {
+			case 'A':	v = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(vr, vb), vg), _mm256_set1_ps(3));
+						break;
+			case 'I':	v = _mm256_div_ps(_mm256_add_ps(_mm256_max_ps(_mm256_max_ps(vr, vb), vg),
+								_mm256_min_ps(_mm256_min_ps(vr, vb), vg)), _mm256_set1_ps(2));
+						break;
+			default:	v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(LUM_R), vr),
+								_mm256_mul_ps(_mm256_set1_ps(LUM_G), vg)), _mm256_mul_ps(_mm256_set1_ps(LUM_B), vb));
+						break;
+			}
+		_mm256_storeu_ps(dst + j, v);
+		vmin = _mm256_min_ps(vmin, v);
+		vmax = _mm256_max_ps(vmax, v);
+		}
+
+	_mm256_storeu_ps(lo, vmin);
+	_mm256_storeu_ps(hi, vmax);
+	for (int k=0; k < 8; k++) {
+		*min = lo[k] < *min ? lo[k] : *min;
+		*max = hi[k] > *max ? hi[k] : *max;
+		}
+
+	grey_row_scalar(method, r + j, g + j, b + j, dst + j, n - j, min, max);
+	}
+
+#endif
+
+
+/* select_grey_kernel: returns the fastest grey conversion kernel that the
+	processor we are running on supports */
+
+static grey_kernel select_grey_kernel (void) {
+#if defined(__x86_64__) || defined(__i386__)
+	static grey_kernel best = NULL;
+	if (best == NULL) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			best = grey_row_avx2;
+		else if (__builtin_cpu_supports("sse2"))
+			best = grey_row_sse2;
+		else
+			best = grey_row_scalar;
+		}
+	return best;
+#else
+	return grey_row_scalar;
+#endif
 	}
 
 
@@ -488,10 +2013,15 @@ int get_image_vector (image *im, float *vect) {
 		return 1;
 		}
 	
-	int i,j,ind = 0;
-	for (i=0; i < im->h.height; i++)
-		for (j=0; j < im->h.width; j++)
-			vect[ind++] = im->g_data[i][j];
+	/* rows are back to back, so the whole image is one block */
+	if (im->stride == im->width) {
+		memcpy(vect, im->g_data, sizeof(float) * im->width * im->height);
+		return 0;
+		}
+
+	int i;
+	for (i=0; i < im->height; i++)
+		memcpy(vect + (size_t) i * im->width, GREY_ROW(im,i), sizeof(float) * im->width);
 	
 	return 0;
 	}
@@ -499,6 +2029,52 @@ int get_image_vector (image *im, float *vect) {
 
 
 
+/* image_view: This function takes a greyscale image, the first row and first
+	column of a rectangle in it, the height and width of the rectangle and a
+	pointer to image structure. It makes the structure a view of the
+	rectangle: its pixels are those of the image, rows 'stride' apart, and
+	nothing is copied. The view is valid as long as the image is, and
+	free_image on the view does not touch the pixels.
+	Returns 0 on success and 1 on failure */
+
+int image_view (image * im, int top, int left, int height, int width, image * view) {
+
+	if (im == NULL || view == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: image = %p, view = %p\n",im,view);
+		return 1;
+		}
+
+	if (im->is_rgb == 1 || im->is_indexed == 1 || im->g_data == NULL) {
+		fprintf(stderr,"ERROR: Views can only be made of greyscale images\n");
+		return 1;
+		}
+
+	if (top < 0 || left < 0 || height <= 0 || width <= 0 ||
+			top + height > im->height || left + width > im->width) {
+		fprintf(stderr,"ERROR: Rectangle %d x %d at (%d, %d) is not inside the %d x %d image\n",
+			width,height,left,top,im->width,im->height);
+		return 1;
+		}
+
+	*view = *im;
+	view->g_data = GREY_ROW(im,top) + left;
+	view->c_data = NULL;
+	view->planes = NULL;
+	view->c_index = NULL;
+	view->width = width;
+	view->height = height;
+	view->h.width = width;
+	view->h.height = height;
+	view->has_hist = 0;			// the histogram is that of the whole image
+	view->pool = NULL;
+	view->parent = im;
+
+	return 0;
+	}
+
+
+
+
 
 
 /* free_image: This function takes an image structure and deallocates all the 
@@ -507,20 +2083,245 @@ int get_image_vector (image *im, float *vect) {
 void free_image (image * im) {
 	
 	if (im->c_index)
-		free(im->c_index);				// free colour palette if any
-	
-	int i;
-	for (i=0; i < im->h.height; i++) {
-		if (im->is_indexed || im->is_rgb)
-			free(im->c_data[i]);
-		else
-			free(im->g_data[i]);
-		}
+		release_block(im, im->c_index);	// free colour palette if any
 	
+	/* each of the pixel buffers is a single block. Those of a pool stay
+	with the pool */
+	release_block(im, im->c_data);
+	release_block(im, im->g_data);
+	release_block(im, im->planes);
+
+	im->c_index = NULL;
+	im->c_data = NULL;
+	im->g_data = NULL;
+	im->planes = NULL;
 	im->is_indexed = -1;
 	im->is_rgb = -1;
 	im->h.height = 0;
 	im->h.width = 0;
+	im->height = 0;
+	im->width = 0;
+	im->stride = 0;
+	}
+
+
+
+
+
+/* open_bands: This function takes a band reader structure, a string, a number
+	of rows and a conversion method ('L', 'A' or 'I', see colour_to_grey). It
+	opens the named bmp file for reading in bands of that many rows.
+	Returns 0 on success and 1 on failure */
+
+int open_bands (band_reader * br, char * imname, int rows, char method) {
+
+	unsigned char pal[4 * 256];
+	void * data = NULL;
+	long file_size;
+
+	if (br == NULL || imname == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: band reader = %p, image name = %p\n",br,imname);
+		return 1;
+		}
+
+	memset(br, 0, sizeof(band_reader));
+
+	br->fp = fopen(imname,"rb");
+	if (br->fp == NULL) {
+		fprintf(stderr,"ERROR %d: Reading the image file: %s failed\n",errno,imname);
+		return 1;
+		}
+
+	header * h = &br->h;
+	if (read_header(h, br->fp) || h->type != ('B' | ('M' << 8))) {
+		fprintf(stderr,"ERROR: %s is not a bmp image\n",imname);
+		fclose(br->fp);
+		return 1;
+		}
+
+	if (h->width <= 0 || h->height <= 0 || h->comp != 0 ||
+			(h->bits != 1 && h->bits != 4 && h->bits != 8 && h->bits != 24)) {
+		fprintf(stderr,"Unsupported image for reading in bands: %d x %d, %d bits, compression %d\n",
+			h->width,h->height,h->bits,h->comp);
+		fclose(br->fp);
+		return 1;
+		}
+
+	/* every band is found by seeking, so make sure that all of them are there */
+	br->row_bytes = (((size_t) h->width * h->bits + 31) / 32) * 4;
+	if (fseek(br->fp, 0, SEEK_END) || (file_size = ftell(br->fp)) < 0 || h->offset < 0 ||
+			(size_t) h->offset + br->row_bytes * h->height > (size_t) file_size) {
+		fprintf(stderr,"ERROR: Pixel data lies outside the bmp file\n");
+		fclose(br->fp);
+		return 1;
+		}
+
+	/* pixels of up to 8 bits are converted through a table, the same way the
+	grey decoders do */
+	if (h->bits <= 8) {
+		int entries = h->num_c < 256 ? h->num_c : 256;
+		memset(pal, 0, sizeof(pal));
+		if (entries > 0 && (fseek(br->fp, 14 + h->hsize, SEEK_SET) ||
+				fread(pal, 4, entries, br->fp) != (size_t) entries)) {
+			fprintf(stderr,"ERROR: Could not read the colour palette\n");
+			fclose(br->fp);
+			return 1;
+			}
+		palette_to_grey(h, pal, method, 0, 0, br->lut);
+		}
+
+	br->method = method;
+	br->rows = rows < 1 ? 1 : rows > h->height ? h->height : rows;
+	br->top = 0;
+	br->next = 0;
+
+	/* a row of unpacked indices, or the three planes of a row of colours */
+	br->raw = (unsigned char *) malloc (br->row_bytes * br->rows);
+	br->scratch = (unsigned char *) malloc ((size_t) h->width * 3);
+	if (br->raw == NULL || br->scratch == NULL ||
+			posix_memalign(&data, IMAGE_ALIGN, sizeof(float) * h->width * br->rows)) {
+		fprintf(stderr,"ERROR: Could not allocate memory for a band of %d rows\n",br->rows);
+		close_bands(br);
+		return 1;
+		}
+
+	/* the band is a greyscale image which owns nothing, the reader does */
+	br->pixels = (float *) data;
+	br->band.h = *h;
+
+	return 0;
+	}
+
+
+
+/* read_band: This function takes a band reader and a pointer to image
+	pointer. It reads the next band of rows, converts it to grey scale and
+	points the image pointer at it. The band is an image of 'rows' rows (the
+	last band may have fewer) and 'top' in the reader tells where it lies in
+	the whole image. Its minimum, maximum and histogram are those of the band.
+	It is overwritten by the next call and must not be freed; binarize and
+	the other greyscale functions can be used on it.
+	Returns 1 if a band was read, 0 at the end of the image and -1 on failure,
+	so that a page cut short by a read error is not taken as a whole one */
+
+int read_band (band_reader * br, image ** out) {
+
+	header * h = &br->h;
+	image * band = &br->band;
+	int i,j,n;
+
+	if (br->fp == NULL) {
+		fprintf(stderr,"ERROR: The band reader has no open image\n");
+		return -1;
+		}
+	if (br->next >= h->height)
+		return 0;
+
+	n = h->height - br->next < br->rows ? h->height - br->next : br->rows;
+
+	/* image rows next .. next+n-1 are file rows height-next-n .. height-next-1 */
+	long first = h->height - br->next - n;
+	if (fseek(br->fp, h->offset + first * (long) br->row_bytes, SEEK_SET) ||
+			fread(br->raw, br->row_bytes, n, br->fp) != (size_t) n) {
+		fprintf(stderr,"ERROR: Could not read rows %d to %d of the image\n",br->next,br->next + n - 1);
+		return -1;
+		}
+
+	/* the band is set up again every time, so that nothing the caller did to
+	it can get in the way */
+	band->g_data = br->pixels;
+	band->width = h->width;
+	band->stride = h->width;
+	band->height = n;
+	band->h.height = n;
+	band->is_indexed = 0;
+	band->is_rgb = 0;
+	band->parent = br;
+	band->max_val = 0;
+	band->min_val = 255;
+	memset(band->hist, 0, sizeof(band->hist));
+
+	if (h->bits <= 8) {
+		unsigned int used[256] = {0};
+		for (i=0; i < n; i++) {
+			const unsigned char * px = row_indices(br->raw + (size_t) (n-1-i) * br->row_bytes,
+				h->width, h->bits, br->scratch);
+			float * dst = GREY_ROW(band,i);
+			for (j=0; j < h->width; j++) {
+				dst[j] = br->lut[px[j]];
+				used[px[j]]++;
+				}
+			}
+		for (j=0; j < 256; j++) {
+			if (used[j]) {
+				band->max_val = br->lut[j] > band->max_val ? br->lut[j] : band->max_val;
+				band->min_val = br->lut[j] < band->min_val ? br->lut[j] : band->min_val;
+				band->hist[HIST_BIN(br->lut[j])] += used[j];
+				}
+			}
+		}
+	else {
+		/* split every row in planes so that it goes through the vector kernels
+		of colour_to_grey */
+		grey_kernel kernel = select_grey_kernel();
+		char method = br->method == 'A' || br->method == 'I' ? br->method : 'L';
+		unsigned char * r = br->scratch;
+		unsigned char * g = r + h->width;
+		unsigned char * b = g + h->width;
+		for (i=0; i < n; i++) {
+			const unsigned char * src = br->raw + (size_t) (n-1-i) * br->row_bytes;
+			float * dst = GREY_ROW(band,i);
+			for (j=0; j < h->width; j++, src += 3) {
+				b[j] = src[0]; g[j] = src[1]; r[j] = src[2];
+				}
+			kernel(method, r, g, b, dst, h->width, &band->min_val, &band->max_val);
+			for (j=0; j < h->width; j++)
+				band->hist[HIST_BIN(dst[j])]++;
+			}
+		}
+	band->has_hist = 1;
+
+	br->top = br->next;
+	br->next += n;
+	*out = band;
+	return 1;
+	}
+
+
+
+/* rewind_bands: This function takes a band reader and makes the next call to
+	read_band read the first band of the image again, for callers which go
+	over the image twice, e.g. to gather its histogram and then binarize it */
+
+void rewind_bands (band_reader * br) {
+
+	if (br == NULL)
+		return;
+
+	br->top = 0;
+	br->next = 0;
+	}
+
+
+
+/* close_bands: This function takes a band reader, closes its file and
+	releases its buffers. */
+
+void close_bands (band_reader * br) {
+
+	if (br == NULL)
+		return;
+
+	if (br->fp)
+		fclose(br->fp);
+	free(br->raw);
+	free(br->scratch);
+	free(br->pixels);
+	br->fp = NULL;
+	br->raw = NULL;
+	br->scratch = NULL;
+	br->pixels = NULL;
+	br->band.g_data = NULL;
 	}
 
 
@@ -541,8 +2342,8 @@ float ** calculate_cov (image *im) {
 		}
 	
 	int i,j,k;
-	int m=im->h.height;
-	int n=im->h.width;
+	int m=im->height;
+	int n=im->width;
 	float ** cov;
 	
 	cov = (float **) malloc (sizeof(float *) * n);
@@ -559,23 +2360,30 @@ float ** calculate_cov (image *im) {
 			}
 		}
 	
+	/* column means are accumulated a row at a time so that the pixel
+	block is read front to back */
 	float mean[n];
-	float sum=0;
-	for (i=0; i < n; i++) {
-		for (j=0; j < m; j++)
-			sum += im->g_data[j][i];
-		mean[i] = sum / m;
-		sum = 0;
+	for (i=0; i < n; i++)
+		mean[i] = 0;
+	for (j=0; j < m; j++) {
+		float * row = GREY_ROW(im,j);
+		for (i=0; i < n; i++)
+			mean[i] += row[i];
 		}
-			
 	for (i=0; i < n; i++)
+		mean[i] /= m;
+			
+	for (i=0; i < n; i++) {
+		float * ri = GREY_ROW(im,i);
 		for (j=0; j < n; j++) {
+			float * rj = GREY_ROW(im,j);
 			cov[i][j] = 0;
 			for (k=0; k < m; k++)
-				cov[i][j] += (im->g_data[i][k] - mean[k]) * (im->g_data[j][k] - mean[k]);
+				cov[i][j] += (ri[k] - mean[k]) * (rj[k] - mean[k]);
 			cov[i][j] /= (m);
 			//cov[i][j] /= (m-1);
 			}
+		}
 	return cov;
 	}
 
@@ -4,9 +4,34 @@ image.h: This is a header file for giving basic functionality of the image
 	The file contains structure definitions of a bmp image, bmp header, and a
 	colour in colour paletter. Current functions include following:
 		imread:					Read a bmp file in a structure
+		imread_mmap:			Read a bmp file in a structure through a memory
+								mapping of the file
+		imdecode:				Decode a bmp file held in memory in a structure
+		imread_vector:			Read a bmp file straight into a binary input
+								vector
+		imdecode_vector:		Decode a bmp file held in memory straight into a
+								binary input vector
+		imread_into:			Read a bmp file in a structure using the buffers of
+								an image pool
+		imread_grey:			Read a bmp file in a greyscale image
+		imread_binary:			Read a bmp file in a binary image
+		imdecode_grey:			Decode a bmp file held in memory in a greyscale
+								image
+		imdecode_binary:		Decode a bmp file held in memory in a binary image
 		read_header:			Read the header of the bmp file in a structure
+		parse_header:			Parse the header of a bmp file held in memory
+		map_image:				Map a bmp file in memory
+		rle_decode:				Walk the runs of an RLE8 or RLE4 bmp file
+		image_view:				Make an image showing a rectangle of another
+								image without copying it
+		open_bands:				Start reading a bmp file a band of rows at a time
+		read_band:				Read the next band of rows of a bmp file
+		rewind_bands:			Go back to the first band of a bmp file
+		close_bands:			Stop reading a bmp file in bands
 
 NOTE: Currently takes into consideration only grayscale bmp files.
+	Pixels may be 1, 4 or 8 bit palette indices, 8 bit grey levels or 24 bit
+	colours. 8 and 4 bit images may be run length encoded (RLE8 and RLE4).
 _______________________________________________________________________________
 This file is part of 'reader'
 
@@ -71,9 +96,30 @@ typedef struct {
 	} colour;
 	
 
+/* A pool of pixel buffers which can be reused from one image to the next.
+	It holds one block for grey pixel data, one for colour pixel data and a
+	colour palette. An image read with imread_into takes its buffers from the
+	pool instead of allocating them. The blocks only ever grow, to fit the
+	largest image seen so far, so once they are big enough reading an image
+	does no heap allocation at all.
+	A pool holds the pixels of one image at a time: reading the next image
+	into the pool reuses the buffers of the previous one. */
+
+typedef struct {
+	void * grey;					// block for grey pixel data
+	size_t grey_size;				// its size in bytes
+	void * colour;					// block for colour pixel data
+	size_t colour_size;				// its size in bytes
+	colour palette[256];			// colour palette of indexed images
+	} image_pool;
+
+
 /* The structure for bmp image itself.
-	This structure has the double pointer to image pixel data. This is floating
-	point data.
+	This structure has a pointer to image pixel data. This is floating point
+	data held in one contiguous, aligned block: row i starts 'stride' pixels
+	after row i-1, so the pixels can be walked linearly from the first row to
+	the last. Use GREY_ROW/COLOUR_ROW (or GREY_PIXEL) below to get at them.
+	width and height are the dimensions of the pixel data.
 	The structure also contains a header for this bmp image file. (See structure 
 	for bmp file header above.
 	Along with the header and pixel data, the image structure has a pointer to
@@ -82,19 +128,85 @@ typedef struct {
 	Whether the image is indexed is shown by field 'is_indexed' which is set to 1
 	if the image is indexed 
 	fields min_val and max_val are minimum and maximum pixel value of the image data
+	'hist' is the histogram of the grey levels, pixel value v being counted in
+	bin (int) v. The decoders and colour_to_grey fill it in the same pass that
+	finds min_val and max_val, and set 'has_hist' to 1 when it is valid.
+	Colour pixels are normally colour triplets in c_data. If the caller sets
+	'is_planar' to 1 before reading the image, they are instead stored as three
+	separate planes of red, green and blue bytes in 'planes' (see PLANE_ROW),
+	which lets colour_to_grey convert whole vectors of pixels at once. The
+	reading functions leave 'is_planar' as the caller set it.
+	'pool' points at the pool the buffers of the image come from, if it was read
+	with imread_into, and is NULL when they were allocated for this image.
+	'parent' is set for a view made by image_view. A view has no pixels of its
+	own, it shows a rectangle of the pixels of its parent, so its stride is
+	that of the parent and free_image leaves its pixels alone.
 	*/
 
 typedef struct {
-	float ** g_data;				// pixel data of greyscale image
-	colour ** c_data;				// pixel data of colour image
+	float * g_data;					// pixel data of greyscale image
+	colour * c_data;				// pixel data of colour image
+	unsigned char * planes;			// pixel data of colour image, planar
+	int width, height;				// dimensions of the pixel data
+	int stride;						// pixels from the start of a row to the next
 	header h;						// bmp header structure
 	colour * c_index;				// pointer to the colour palette
 	int is_indexed;					// 'is the image indexed?' flag
 	int is_rgb;						// 'is the image rgb' flag
+	int is_planar;					// 'store rgb pixels as planes' flag
 	float max_val, min_val;			// minimum and maximum value of pixels
+	unsigned int hist[256];			// histogram of the grey levels
+	int has_hist;					// 'is the histogram valid' flag
+	image_pool * pool;				// pool of the pixel buffers (if any)
+	void * parent;					// image a view looks into (if any)
 	} image;
 
 
+/* The structure for reading a bmp file a band of rows at a time.
+	Only one band of the file is in memory at once, as raw file rows and as a
+	greyscale image, so a page scan of any height is read with the memory of
+	'rows' of its rows. Bands come from the top of the image to its bottom:
+	as the file stores its rows bottom up, each band is read by seeking
+	backwards to its block of file rows, which lie together, and reading them
+	with a single fread. */
+
+typedef struct {
+	FILE * fp;						// the bmp file
+	header h;						// its header
+	char method;					// conversion to grey ('L', 'A' or 'I')
+	int rows;						// rows in a full band
+	int top;						// image row of the first row of the band
+	int next;						// image row where the next band starts
+	size_t row_bytes;				// bytes of a padded file row
+	unsigned char * raw;			// file rows of the band
+	unsigned char * scratch;		// unpacked indices or planes of a row
+	float * pixels;					// grey pixels of the band
+	float lut[256];					// grey value of each pixel value
+	image band;						// the band, as a greyscale image
+	} band_reader;
+
+
+/* alignment in bytes of the pixel buffers. This is one cache line, which is
+	also enough for any vector load */
+
+#define IMAGE_ALIGN 64
+
+/* accessors for the pixel data. GREY_ROW and COLOUR_ROW give a pointer to the
+	first pixel of row i, GREY_PIXEL gives the pixel at row i and column j */
+
+#define GREY_ROW(im,i)		((im)->g_data + (size_t) (i) * (im)->stride)
+#define COLOUR_ROW(im,i)	((im)->c_data + (size_t) (i) * (im)->stride)
+#define GREY_PIXEL(im,i,j)	(GREY_ROW(im,i)[j])
+
+/* PLANE_ROW gives a pointer to the first byte of row i of plane p of a planar
+	colour image. Planes are red, green and blue in that order */
+
+#define PLANE_R 0
+#define PLANE_G 1
+#define PLANE_B 2
+#define PLANE_ROW(im,p,i)	((im)->planes + ((size_t) (p) * (im)->height + (i)) * (im)->stride)
+
+
 /* imread: This function takes a string and a pointer to image structure. 
 	It then opens the image named the string (assumes it is a bmp image) and 
 	populates the image structure with pixel data, bmp header and index of
@@ -104,6 +216,111 @@ typedef struct {
 int imread(char *, image *);
 
 
+/* imread_mmap: This function does the same job as imread, but instead of
+	reading the file through stdio, it maps the whole file in memory and
+	decodes the header and pixel rows straight out of the mapping (see
+	imdecode). It is meant as a drop in replacement for imread so that both
+	paths can be benchmarked against each other.
+	Returns 0 on success and 1 on failure */
+
+int imread_mmap(char *, image *);
+
+
+/* imdecode: This function takes a buffer holding an entire bmp file, the
+	length of the buffer and a pointer to image structure. It then parses the
+	header in place and populates the image structure by walking the pixel rows
+	of the buffer using the row stride. No library call is made per pixel.
+	Returns 0 on success and 1 on failure */
+
+int imdecode(const unsigned char *, size_t, image *);
+
+
+/* imread_into: This function takes a string, a pointer to image structure and
+	a pointer to an image pool. It reads the image like imread_mmap does, but
+	the pixel data, the palette and the grey data made later by colour_to_grey
+	all live in the buffers of the pool. free_image leaves the pool alone.
+	Returns 0 on success and 1 on failure */
+
+int imread_into(char *, image *, image_pool *);
+
+
+/* imdecode_into: This is imread_into for a bmp file held in memory. It takes
+	the buffer, its length, a pointer to image structure and an image pool.
+	Returns 0 on success and 1 on failure */
+
+int imdecode_into(const unsigned char *, size_t, image *, image_pool *);
+
+
+/* init_image_pool: This function takes a pointer to an image pool and sets it
+	up empty. Nothing is allocated until the first image is read into it. */
+
+void init_image_pool(image_pool *);
+
+
+/* reset_image_pool: This function takes a pointer to an image pool and releases
+	all its buffers at once. Images read into the pool must not be used after
+	this. The pool can be used again afterwards. */
+
+void reset_image_pool(image_pool *);
+
+
+/* imread_vector: This function takes a string, a pointer to an array of
+	floats, the length of the array and a threshold. It maps the named bmp file
+	and fills the array just like imread, colour_to_grey (averaging),
+	binarize and get_image_vector would one after the other, but in a single
+	scan over the pixels and without allocating an image (see imdecode_vector).
+	Returns 0 on success and 1 on failure */
+
+int imread_vector(char *, float *, int, float);
+
+
+/* imdecode_vector: This function takes a buffer holding an entire bmp file,
+	the length of the buffer, a pointer to an array of floats, the length of
+	the array and a threshold. Every pixel is converted to grey by averaging,
+	compared with the threshold and written rowwise in the array as 1.0 or 0.0.
+	The image must have exactly as many pixels as the array.
+	Returns 0 on success and 1 on failure */
+
+int imdecode_vector(const unsigned char *, size_t, float *, int, float);
+
+
+/* imread_grey: This function takes a string, a pointer to image structure and
+	a conversion method. It reads the named bmp file into a greyscale image, just
+	like imread followed by colour_to_grey would (see imdecode_grey).
+	Returns 0 on success and 1 on failure */
+
+int imread_grey(char *, image *, char);
+
+
+/* imread_binary: This function takes a string, a pointer to image structure,
+	a conversion method and a threshold. It reads the named bmp file into a
+	binary image, just like imread followed by colour_to_grey and binarize
+	would (see imdecode_binary).
+	Returns 0 on success and 1 on failure */
+
+int imread_binary(char *, image *, char, float);
+
+
+/* imdecode_grey: This function takes a buffer holding an entire bmp file, the
+	length of the buffer, a pointer to image structure and a conversion method
+	('L', 'A' or 'I', see colour_to_grey). It populates the image structure
+	with the greyscale image. For images of 1, 4 or 8 bits, indexed or not,
+	the at most 256 possible pixel values are converted to grey once and every
+	pixel is looked up in that table, so no colour data is ever allocated.
+	Returns 0 on success and 1 on failure */
+
+int imdecode_grey(const unsigned char *, size_t, image *, char);
+
+
+/* imdecode_binary: This function takes the same arguments as imdecode_grey and
+	a threshold. It populates the image structure with the image binarized at
+	that threshold. For images of up to 8 bits the table holds the binary
+	values, so the pixels are only looked up once.
+	Returns 0 on success and 1 on failure */
+
+int imdecode_binary(const unsigned char *, size_t, image *, char, float);
+
+
 /* read_header: This function takes a pointer to a bmp header structure and 
 	a file handle of a bmp file opened for reading. It then populates the
 	bmp header structure with header fields. 
@@ -111,6 +328,45 @@ int imread(char *, image *);
 
 int read_header(header *, FILE *);
 
+
+/* parse_header: This function takes a pointer to a bmp header structure, a
+	buffer holding the bmp file and the length of the buffer. It populates the
+	header structure from the buffer and checks that the pixel data described
+	by the header actually fits in the buffer.
+	Returns 0 on success and 1 on failure */
+
+int parse_header(header *, const unsigned char *, size_t);
+
+
+/* map_image: This function takes a string and a pointer to size_t. It maps
+	the named file in memory for reading it from front to back once and stores
+	the length of the mapping in the size_t. The caller unmaps it with munmap.
+	Returns the mapping on success and NULL on failure */
+
+unsigned char * map_image(char *, size_t *);
+
+
+/* The function rle_decode calls for every run of pixels. It takes the
+	argument given to rle_decode, the row and column where the run starts,
+	the number of pixels, the pixel values and a flag which is set if the run
+	is count copies of px[0] (and not count different values) */
+
+typedef void (* rle_run) (void *, int, int, int, const unsigned char *, int);
+
+
+/* rle_decode: This function takes the compressed pixel data of an RLE8 or RLE4
+	bmp file, its length, the header of the file, a function to call for every
+	run of pixels and an argument for it. It walks the runs and hands each one
+	to the function as the image row and column where it starts, its length,
+	the pixel values and a flag. If the flag is set, the run is count copies of
+	px[0], otherwise px holds count different values. Every pixel of the image
+	is handed over exactly once; pixels the data skips (with an end of line,
+	a delta or the end of the bitmap) are given value 0. Runs going past the
+	right edge are cut at the edge.
+	Returns 0 on success and 1 if the data is not RLE8 or RLE4 */
+
+int rle_decode(const unsigned char *, size_t, header *, rle_run, void *);
+
 /* binarize: This function takes an image and a floating point threshold
 	value. It then converts the image to binary such that pixels having
 	value greater than or equal to the threshold will be 1 and those below
@@ -119,6 +375,40 @@ int read_header(header *, FILE *);
 void binarize(image *,float);
 
 
+/* binarize_auto: This function takes a greyscale image and binarizes it at the
+	threshold picked by otsu_threshold from the grey level histogram. The
+	histogram gathered while decoding is used if there is one, otherwise it is
+	built first.
+	Returns the threshold used, or -1 on failure */
+
+float binarize_auto(image *);
+
+
+/* otsu_threshold: This function takes a 256 bin grey level histogram and returns
+	the threshold which maximizes the variance between the pixels below it and
+	those at or above it (Otsu's method). Pixels >= threshold are the bright
+	class, as for binarize. Takes O(256) whatever the size of the image */
+
+float otsu_threshold(unsigned int *);
+
+
+/* binarize_local: This function takes a greyscale image, a method, a window
+	size, a parameter k and a number of threads. Instead of one threshold for
+	the whole image, every pixel gets its own threshold from the mean m and
+	standard deviation s of the window x window pixels around it:
+	1. 'S': Sauvola-	m * (1 + k * (s / 128 - 1)), k around 0.2 to 0.5 (default)
+	2. 'N': Niblack-	m + k * s, k around -0.2
+	Pixels at or above their threshold become 1, the others 0, as for binarize.
+	The image is cut in bands of rows, one per thread, and every thread keeps
+	integral images of the grey levels and their squares for just the rows of
+	the window it is at, so the mean and deviation cost O(1) per pixel
+	whatever the window size and the memory does not grow with the height of
+	the image. Passing 0 threads uses one per processor.
+	Returns 0 on success and 1 on failure */
+
+int binarize_local(image *, char, int, float, int);
+
+
 /* read_pixels: This function takes an image structure and a file handle,
 	it then calls an appropriate function to read the pixel data according to
 	the nature of the image */
@@ -161,7 +451,10 @@ int read_colour_palette (image *, FILE *);
 
 /* allocate_data_array: This function allocates the memory for pixel data. It allocates
 	float data if the image is not an RGB (!24_bit && !indexed). Otherwise it
-	allocates the colour vectors for each pixel. */
+	allocates the colour vectors for each pixel, or the three colour planes if
+	the image is planar. Either way the pixels are one aligned block of height
+	rows of stride pixels each, sized from the header. If the image has a pool
+	the block is taken from the pool, growing it if it is too small. */
 
 int allocate_data_array (image *);
 
@@ -173,6 +466,9 @@ int allocate_data_array (image *);
 	2. 'A': Averaging- Averaging of the pixels
 	3. 'I': lIghtness- Average of the min and max of the colours.
 
+	Planar images are converted with SSE2 or AVX2 kernels when the processor
+	has them, and with plain C otherwise.
+
 	NOTE: Original image structure is altered. 
 		  Also, if the image is indexed image with all R, G and B values same
 		  (lame greyscale image) then you probably want to convert it using the
@@ -184,16 +480,62 @@ int colour_to_grey (image *, char );
 
 /* get_image_vector: This function takes an greyscale image and a pointer
 	to an array of floats. It then populates the array (vector) by rowvise
-	image pixel data.
+	image pixel data. When the rows are not padded (stride equals width) this
+	is a single copy of the pixel block.
 	NOTE: Assumes enough memory is allocated for the vector. Also assumes 
 	the vector to be a float vector */
 
 int get_image_vector (image *, float *);
 
 
+/* image_view: This function takes a greyscale image, the first row and first
+	column of a rectangle in it, the height and width of the rectangle and a
+	pointer to image structure. It makes the structure a view of the
+	rectangle: its pixels are those of the image, rows 'stride' apart, and
+	nothing is copied. The view is valid as long as the image is, and
+	free_image on the view does not touch the pixels.
+	Returns 0 on success and 1 on failure */
+
+int image_view (image *, int, int, int, int, image *);
+
+
+/* open_bands: This function takes a band reader structure, a string, a number
+	of rows and a conversion method ('L', 'A' or 'I', see colour_to_grey). It
+	opens the named bmp file for reading in bands of that many rows.
+	Returns 0 on success and 1 on failure */
+
+int open_bands (band_reader *, char *, int, char);
+
+
+/* read_band: This function takes a band reader and a pointer to image
+	pointer. It reads the next band of rows, converts it to grey scale and
+	points the image pointer at it. The band is an image of 'rows' rows (the
+	last band may have fewer) and 'top' in the reader tells where it lies in
+	the whole image. Its minimum, maximum and histogram are those of the band.
+	It is overwritten by the next call and must not be freed; binarize and
+	the other greyscale functions can be used on it.
+	Returns 1 if a band was read, 0 at the end of the image and -1 on failure,
+	so that a page cut short by a read error is not taken as a whole one */
+
+int read_band (band_reader *, image **);
+
+
+/* rewind_bands: This function takes a band reader and makes the next call to
+	read_band read the first band of the image again, for callers which go
+	over the image twice, e.g. to gather its histogram and then binarize it */
+
+void rewind_bands (band_reader *);
+
+
+/* close_bands: This function takes a band reader, closes its file and
+	releases its buffers. */
+
+void close_bands (band_reader *);
+
+
 
 /* free_image: This function takes an image structure and deallocates all the 
-478     memory in its arrays. */
+	memory in its arrays. */
 
 void free_image (image * );
 
@@ -0,0 +1,650 @@
+/*_____________________________________________________________________________
+ingest.c: This file provides the implementation of the function prototypes
+	given in ingest.h
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ingest.h"
+
+/* io_uring is used through its system calls directly, so that we do not need
+	liburing. Only the kernel header is needed to build it in */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+
+#define INGEST_BUF_SIZE 65536			// first buffer size, holds any usual glyph
+#define INGEST_MAX_THREADS 64
+
+
+/* A slot holds one file in flight */
+
+typedef struct {
+	int index;						// position of the file in the list
+	int fd;
+	unsigned char * buf;
+	size_t size;					// bytes allocated for buf
+	int op;							// request in flight with io_uring, -1 for none
+	} ingest_slot;
+
+
+static double now (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+	}
+
+
+
+/* grow_slot: makes the buffer of a slot at least len bytes.
+	Returns 0 on success and 1 on failure */
+
+static int grow_slot (ingest_slot * s, size_t len) {
+
+	unsigned char * buf;
+
+	if (len <= s->size)
+		return 0;
+	buf = (unsigned char *) realloc (s->buf, len);
+	if (buf == NULL) {
+		fprintf(stderr,"ERROR: Could not allocate %lu bytes for reading a file\n",(unsigned long) len);
+		return 1;
+		}
+	s->buf = buf;
+	s->size = len;
+	return 0;
+	}
+
+
+
+/* read_rest: a file filled the whole buffer of its slot, so it may be longer.
+	Grows the buffer to the size of the file and reads the rest of it behind
+	what is already there. Returns the length of the file, or -1 on failure */
+
+static long read_rest (ingest_slot * s, size_t done) {
+
+	struct stat st;
+
+	if (fstat(s->fd, &st))
+		return -1;
+	if ((size_t) st.st_size <= done)
+		return done;
+	if (grow_slot(s, st.st_size))
+		return -1;
+
+	while (done < (size_t) st.st_size) {
+		ssize_t r = pread(s->fd, s->buf + done, st.st_size - done, done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		done += r;
+		}
+	return done;
+	}
+
+
+
+
+/* The thread pool. Every thread takes the next file of the list, reads it
+	whole with ordinary system calls and hands it over. With depth threads
+	there are depth files in flight, the blocking happens in parallel */
+
+typedef struct {
+	char ** names;
+	int count;
+	int next;						// next file to take, taken atomically
+	ingest_handler handler;
+	void * arg;
+	long files, failed;
+	long long bytes;
+	} ingest_pool;
+
+
+static void * ingest_worker (void * arg) {
+
+	ingest_pool * p = (ingest_pool *) arg;
+	ingest_slot s = {0, -1, NULL, 0, -1};
+	int k;
+
+	while ((k = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->count) {
+		long len = -1;
+
+		s.fd = open(p->names[k], O_RDONLY);
+		if (s.fd < 0) {
+			fprintf(stderr,"ERROR %d: Opening the file: %s failed\n",errno,p->names[k]);
+			__atomic_fetch_add(&p->failed, 1, __ATOMIC_RELAXED);
+			continue;
+			}
+
+		if (grow_slot(&s, INGEST_BUF_SIZE) == 0)
+			len = read_rest(&s, 0);
+		close(s.fd);
+
+		if (len < 0) {
+			fprintf(stderr,"ERROR %d: Reading the file: %s failed\n",errno,p->names[k]);
+			__atomic_fetch_add(&p->failed, 1, __ATOMIC_RELAXED);
+			continue;
+			}
+
+		__atomic_fetch_add(&p->bytes, len, __ATOMIC_RELAXED);
+		if (p->handler(k, s.buf, len, p->arg))
+			__atomic_fetch_add(&p->failed, 1, __ATOMIC_RELAXED);
+		else
+			__atomic_fetch_add(&p->files, 1, __ATOMIC_RELAXED);
+		}
+
+	free(s.buf);
+	return NULL;
+	}
+
+
+
+static int ingest_threads (char ** names, int count, int depth, ingest_handler handler,
+		void * arg, ingest_stats * st) {
+
+	ingest_pool p = {names, count, 0, handler, arg, 0, 0, 0};
+	pthread_t workers[INGEST_MAX_THREADS];
+	int i, started = 0;
+
+	if (depth > INGEST_MAX_THREADS)
+		depth = INGEST_MAX_THREADS;
+	if (depth > count)
+		depth = count;
+
+	for (i=0; i < depth; i++) {
+		if (pthread_create(&workers[i], NULL, ingest_worker, &p))
+			break;
+		started++;
+		}
+
+	/* if no thread could be started the list is read right here */
+	if (started == 0)
+		ingest_worker(&p);
+	for (i=0; i < started; i++)
+		pthread_join(workers[i], NULL);
+
+	st->files = p.files;
+	st->failed = p.failed;
+	st->bytes = p.bytes;
+	st->uring = 0;
+	return 0;
+	}
+
+
+
+
+#ifdef HAVE_IO_URING
+
+/* The io_uring. The submission and completion queues are rings in memory
+	shared with the kernel. We write requests at the tail of the submission
+	ring and the kernel writes their results at the tail of the completion
+	ring. The tails and heads are published with release stores and read with
+	acquire loads, as the kernel is a concurrent reader and writer. */
+
+typedef struct {
+	int fd;
+	unsigned * sq_head, * sq_tail, * sq_mask, * sq_array;
+	unsigned * cq_head, * cq_tail, * cq_mask;
+	struct io_uring_sqe * sqes;
+	struct io_uring_cqe * cqes;
+	void * sq_map, * cq_map;
+	size_t sq_len, cq_len, sqe_len;
+	unsigned pending;				// requests written but not submitted yet
+	} uring;
+
+
+/* the operation of a request is kept in the low bits of its user data, the
+	slot in the rest */
+#define OP_OPEN 0
+#define OP_READ 1
+#define OP_CLOSE 2
+#define OP_CANCEL 3
+#define USER_DATA(slot,op)	(((unsigned long long) (slot) << 2) | (op))
+
+
+/* uring_supports: asks the kernel whether it knows the operations we need.
+	Returns 1 if it does and 0 if it does not */
+
+static int uring_supports (int fd) {
+
+	struct io_uring_probe * pr;
+	int ok = 0;
+	size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+
+	pr = (struct io_uring_probe *) calloc (1, len);
+	if (pr == NULL)
+		return 0;
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, pr, 256) == 0 &&
+			pr->last_op >= IORING_OP_CLOSE &&
+			(pr->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED) &&
+			(pr->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+			(pr->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+			(pr->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED))
+		ok = 1;
+
+	free(pr);
+	return ok;
+	}
+
+
+
+static void uring_exit (uring * r) {
+
+	if (r->sqes)
+		munmap(r->sqes, r->sqe_len);
+	if (r->cq_map && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_len);
+	if (r->sq_map)
+		munmap(r->sq_map, r->sq_len);
+	close(r->fd);
+	}
+
+
+
+/* uring_init: sets up an io_uring with room for entries requests.
+	Returns 0 on success and 1 if io_uring can not be used */
+
+static int uring_init (uring * r, unsigned entries) {
+
+	struct io_uring_params p;
+	unsigned char * sq, * cq;
+
+	memset(r, 0, sizeof(uring));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return 1;
+
+	if (!uring_supports(r->fd)) {
+		close(r->fd);
+		return 1;
+		}
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+		}
+
+	r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED) {
+		r->sq_map = NULL;
+		uring_exit(r);
+		return 1;
+		}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_map = r->sq_map;
+	else {
+		r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED) {
+			r->cq_map = NULL;
+			uring_exit(r);
+			return 1;
+			}
+		}
+
+	r->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = (struct io_uring_sqe *) mmap(NULL, r->sqe_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		uring_exit(r);
+		return 1;
+		}
+
+	sq = (unsigned char *) r->sq_map;
+	cq = (unsigned char *) r->cq_map;
+	r->sq_head = (unsigned *) (sq + p.sq_off.head);
+	r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) (sq + p.sq_off.array);
+	r->cq_head = (unsigned *) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return 0;
+	}
+
+
+
+/* uring_queue: writes a request at the tail of the submission ring. It is only
+	seen by the kernel at the next uring_enter. Every slot has at most one
+	request and one cancel of it outstanding, so the ring, twice as long as
+	the number of slots, can not overflow */
+
+static void uring_queue (uring * r, int op, int slot, int fd, void * addr, unsigned len) {
+
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe * sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	switch (op) {
+		case OP_OPEN:
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long) addr;
+			sqe->open_flags = O_RDONLY;
+			break;
+		case OP_READ:
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = fd;
+			sqe->addr = (unsigned long) addr;
+			sqe->len = len;
+			sqe->off = 0;
+			break;
+		case OP_CLOSE:
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = fd;
+			break;
+		case OP_CANCEL:
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (unsigned long) addr;		// user data of the request
+			break;
+		}
+	sqe->user_data = USER_DATA(slot, op);
+
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+	}
+
+
+
+/* uring_enter: submits the queued requests and waits for at least one result.
+	The kernel may take fewer requests than were queued, the rest are
+	submitted by the next call. Returns 0 on success and 1 on failure */
+
+static int uring_enter (uring * r) {
+
+	long ret;
+
+	while ((ret = syscall(__NR_io_uring_enter, r->fd, r->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0)) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return 1;
+		}
+	r->pending -= ret;
+	return 0;
+	}
+
+
+
+/* uring_drain: the ring failed with requests of the slots still in flight.
+	Asks the kernel to cancel every one of them and waits until each has
+	finished, closing the files opened on the way, so that no read is left
+	to write into the buffers of the slots once they are freed.
+	Returns 0 on success and 1 if the ring failed again */
+
+static int uring_drain (uring * r, ingest_slot * slots, int depth) {
+
+	int i, busy = 0;
+
+	for (i=0; i < depth; i++)
+		if (slots[i].op >= 0) {
+			uring_queue(r, OP_CANCEL, i, -1, (void *) (unsigned long) USER_DATA(i, slots[i].op), 0);
+			busy++;
+			}
+
+	while (busy) {
+		unsigned head, tail;
+
+		if (uring_enter(r))
+			return 1;
+
+		head = *r->cq_head;
+		tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe * cqe = &r->cqes[head & *r->cq_mask];
+			ingest_slot * s = &slots[cqe->user_data >> 2];
+			int op = cqe->user_data & 3;
+
+			if (op == OP_CANCEL)
+				continue;
+			if (op == OP_OPEN && cqe->res >= 0)
+				close(cqe->res);
+			else if (op == OP_READ)
+				close(s->fd);
+			s->op = -1;
+			busy--;
+			}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		}
+	return 0;
+	}
+
+
+
+static int ingest_uring (char ** names, int count, int depth, ingest_handler handler,
+		void * arg, ingest_stats * st) {
+
+	uring r;
+	ingest_slot * slots;
+	int i, next = 0, busy = 0, ret = 0;
+
+	if (depth > count)
+		depth = count;
+
+	if (uring_init(&r, 2 * depth))
+		return -1;						// not available, the caller falls back
+
+	slots = (ingest_slot *) calloc (depth, sizeof(ingest_slot));
+	if (slots == NULL) {
+		fprintf(stderr,"ERROR: Could not allocate memory for reading files\n");
+		uring_exit(&r);
+		return 1;
+		}
+
+	/* every slot starts on a file, then walks it through open, read and close
+	and moves on to the next file of the list */
+	for (i=0; i < depth; i++) {
+		slots[i].index = next++;
+		slots[i].op = OP_OPEN;
+		uring_queue(&r, OP_OPEN, i, -1, names[slots[i].index], 0);
+		busy++;
+		}
+
+	while (busy) {
+		unsigned head, tail;
+
+		if (uring_enter(&r)) {
+			fprintf(stderr,"ERROR %d: Waiting for file reads failed\n",errno);
+			ret = 1;
+			if (uring_drain(&r, slots, depth)) {
+				/* the kernel may still write into the buffers, so they are
+				left to it rather than freed */
+				fprintf(stderr,"ERROR %d: Cancelling the file reads failed\n",errno);
+				uring_exit(&r);
+				st->uring = 1;
+				return 1;
+				}
+			break;
+			}
+
+		head = *r.cq_head;
+		tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe * cqe = &r.cqes[head & *r.cq_mask];
+			int slot = cqe->user_data >> 2;
+			int op = cqe->user_data & 3;
+			int res = cqe->res;
+			ingest_slot * s = &slots[slot];
+			int done = 0;
+
+			switch (op) {
+				case OP_OPEN:
+					if (res < 0) {
+						fprintf(stderr,"ERROR %d: Opening the file: %s failed\n",-res,names[s->index]);
+						st->failed++;
+						done = 1;
+						break;
+						}
+					s->fd = res;
+					if (grow_slot(s, INGEST_BUF_SIZE)) {
+						st->failed++;
+						s->op = OP_CLOSE;
+						uring_queue(&r, OP_CLOSE, slot, s->fd, NULL, 0);
+						break;
+						}
+					s->op = OP_READ;
+					uring_queue(&r, OP_READ, slot, s->fd, s->buf, s->size);
+					break;
+
+				case OP_READ: {
+					long len = res;
+					if (len >= 0 && (size_t) len == s->size)
+						len = read_rest(s, len);		// the file may be longer
+					if (len < 0) {
+						fprintf(stderr,"ERROR %d: Reading the file: %s failed\n",res < 0 ? -res : errno,names[s->index]);
+						st->failed++;
+						}
+					else {
+						st->bytes += len;
+						if (handler(s->index, s->buf, len, arg))
+							st->failed++;
+						else
+							st->files++;
+						}
+					s->op = OP_CLOSE;
+					uring_queue(&r, OP_CLOSE, slot, s->fd, NULL, 0);
+					break;
+					}
+
+				case OP_CLOSE:
+					done = 1;
+					break;
+				}
+
+			if (done) {
+				if (next < count) {
+					s->index = next++;
+					s->op = OP_OPEN;
+					uring_queue(&r, OP_OPEN, slot, -1, names[s->index], 0);
+					}
+				else {
+					s->op = -1;
+					busy--;
+					}
+				}
+			}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+		}
+
+	for (i=0; i < depth; i++)
+		free(slots[i].buf);
+	free(slots);
+	uring_exit(&r);
+
+	st->uring = 1;
+	return ret;
+	}
+
+#endif
+
+
+
+
+/* ingest_files: This function takes an array of file names, the number of
+	files, the queue depth (number of files in flight at once), a method, a
+	handler, an argument for the handler and a pointer to statistics.
+	The method can be
+		'U': io_uring, falling back to threads when it is not available
+		'T': a pool of depth threads (at most 64)
+	Every file is read whole and handed to the handler. Files which can not be
+	read, or which the handler fails on, are counted in the statistics and the
+	rest of the list goes on. The statistics pointer may be NULL.
+	Returns 0 on success and 1 on failure */
+
+int ingest_files (char ** names, int count, int depth, char method, ingest_handler handler,
+		void * arg, ingest_stats * stats) {
+
+	ingest_stats st = {0, 0, 0, 0.0, 0};
+	double start;
+	int ret = -1;
+
+	if (names == NULL || handler == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: names = %p, handler = %p\n",names,handler);
+		return 1;
+		}
+
+	if (method != 'U' && method != 'T') {
+		fprintf(stderr,"ERROR: Unknown method '%c' for reading files\n",method);
+		return 1;
+		}
+
+	if (depth < 1)
+		depth = 1;
+
+	start = now();
+	if (count > 0) {
+#ifdef HAVE_IO_URING
+		if (method == 'U')
+			ret = ingest_uring(names, count, depth, handler, arg, &st);
+#endif
+		if (ret < 0)
+			ret = ingest_threads(names, count, depth, handler, arg, &st);
+		}
+	else
+		ret = 0;
+	st.seconds = now() - start;
+
+	if (stats)
+		*stats = st;
+	return ret;
+	}
+
+
+
+/* print_ingest_stats: This function takes the statistics of a run and prints
+	them with the throughput in files/s and MB/s */
+
+void print_ingest_stats (ingest_stats * st) {
+
+	double secs = st->seconds > 0 ? st->seconds : 1e-9;
+
+	printf("Read %ld files (%ld failed), %.2f MB in %.3f s using %s: %.0f files/s, %.2f MB/s\n",
+		st->files, st->failed, st->bytes / 1e6, st->seconds, st->uring ? "io_uring" : "threads",
+		(st->files + st->failed) / secs, st->bytes / 1e6 / secs);
+	}
@@ -0,0 +1,84 @@
+/*_____________________________________________________________________________
+ingest.h: This is a header file for giving batched reading of many small files.
+	Reading a glyph with imread costs an open, a few reads and a close, each a
+	system call waited for one after the other. For directories of thousands
+	of tiny bmp files that round trip is most of the time spent. The functions
+	here keep many files in flight at once and hand every file, once it is
+	completely read, to a handler which decodes it from memory (imdecode,
+	imdecode_vector and friends).
+	On Linux the opens, reads and closes are batched through an io_uring, a
+	ring of requests shared with the kernel, so one system call submits and
+	collects many of them. Where io_uring is not available (old kernel, or
+	forbidden in a container) a pool of threads reading files is used instead.
+	Current functions include following:
+		ingest_files:			Read a list of files and hand each to a handler
+		print_ingest_stats:		Print the throughput of an ingest_files run
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#ifndef _INGEST_GUARD
+#define _INGEST_GUARD
+
+#include <stddef.h>
+
+
+/* The structure for the statistics of one ingest_files run */
+
+typedef struct {
+	long files;						// files read and accepted by the handler
+	long failed;					// files which could not be read or handled
+	long long bytes;				// bytes read
+	double seconds;					// wall clock time of the run
+	int uring;						// 1 if io_uring was used, 0 for threads
+	} ingest_stats;
+
+
+/* The handler called for every file read. It takes the position of the file
+	in the list, the buffer holding the whole file, the length of the buffer
+	and the argument given to ingest_files. The buffer is only valid during
+	the call. Handlers may be called from several threads at once and in any
+	order of the list.
+	Returns 0 on success and 1 on failure */
+
+typedef int (* ingest_handler) (int, const unsigned char *, size_t, void *);
+
+
+/* ingest_files: This function takes an array of file names, the number of
+	files, the queue depth (number of files in flight at once), a method, a
+	handler, an argument for the handler and a pointer to statistics.
+	The method can be
+		'U': io_uring, falling back to threads when it is not available
+		'T': a pool of depth threads (at most 64)
+	Every file is read whole and handed to the handler. Files which can not be
+	read, or which the handler fails on, are counted in the statistics and the
+	rest of the list goes on. The statistics pointer may be NULL.
+	Returns 0 on success and 1 on failure */
+
+int ingest_files (char **, int, int, char, ingest_handler, void *, ingest_stats *);
+
+
+/* print_ingest_stats: This function takes the statistics of a run and prints
+	them with the throughput in files/s and MB/s */
+
+void print_ingest_stats (ingest_stats *);
+
+
+#endif
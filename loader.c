@@ -0,0 +1,228 @@
+/*_____________________________________________________________________________
+loader.c: This file provides the implementation of the function prototypes
+	given in loader.h
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image.h"
+#include "loader.h"
+
+
+/* states of a slot of the queue */
+#define SLOT_EMPTY 0				// being decoded, or not taken yet
+#define SLOT_READY 1				// decoded, waiting for the caller
+#define SLOT_FAILED 2				// could not be decoded
+
+
+/* loader_worker: takes the next image of the list as long as there is room for
+	it in the queue, and decodes it straight into its slot. The lock is only
+	held to take an image and to publish it, never while decoding */
+
+static void * loader_worker (void * arg) {
+
+	loader * l = (loader *) arg;
+
+	pthread_mutex_lock(&l->lock);
+	while (1) {
+		while (!l->stop && l->next < l->count && l->next >= l->consumed + l->depth)
+			pthread_cond_wait(&l->space, &l->lock);
+		if (l->stop || l->next >= l->count)
+			break;
+
+		int k = l->next++;
+		int slot = k % l->depth;
+		pthread_mutex_unlock(&l->lock);
+
+		int failed = imread_vector(l->names[k], l->vectors + (size_t) slot * l->stride,
+			l->vec_len, l->threshold);
+
+		pthread_mutex_lock(&l->lock);
+		l->state[slot] = failed ? SLOT_FAILED : SLOT_READY;
+		pthread_cond_broadcast(&l->ready);
+		}
+	pthread_mutex_unlock(&l->lock);
+
+	return NULL;
+	}
+
+
+
+/* start_loader: This function takes a loader structure, an array of image
+	names, the number of images, the length of the input vector, a threshold,
+	the number of worker threads and the depth of the queue. It starts the
+	workers, which decode the images with imread_vector (averaging to grey and
+	binarizing at the threshold). Passing 0 threads uses one per processor and
+	passing 0 depth makes the queue twice as deep as there are workers.
+	The array of names has to stay valid until stop_loader.
+	Returns 0 on success and 1 on failure */
+
+int start_loader (loader * l, char ** names, int count, int vec_len, float t, int threads, int depth) {
+
+	int i;
+	void * data = NULL;
+
+	if (l == NULL || names == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: loader = %p, names = %p\n",l,names);
+		return 1;
+		}
+
+	if (vec_len <= 0) {
+		fprintf(stderr,"ERROR: Input vector of the loader can not be %d long\n",vec_len);
+		return 1;
+		}
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+	if (depth <= 0)
+		depth = 2 * threads;
+
+	l->names = names;
+	l->count = count;
+	l->vec_len = vec_len;
+	l->threshold = t;
+	l->depth = depth;
+	/* keep every slot on its own cache lines, so that workers writing
+	neighbouring slots do not fight over them */
+	l->stride = ((sizeof(float) * vec_len + IMAGE_ALIGN - 1) & ~((size_t) IMAGE_ALIGN - 1)) / sizeof(float);
+	l->next = 0;
+	l->consumed = 0;
+	l->holding = 0;
+	l->stop = 0;
+	l->num_workers = 0;
+
+	if (posix_memalign(&data, IMAGE_ALIGN, sizeof(float) * l->stride * depth)) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the loader queue\n");
+		return 1;
+		}
+	l->vectors = (float *) data;
+	l->state = (int *) calloc (depth, sizeof(int));
+	l->workers = (pthread_t *) malloc (sizeof(pthread_t) * threads);
+	if (l->state == NULL || l->workers == NULL) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the loader\n");
+		free(l->vectors);
+		free(l->state);
+		free(l->workers);
+		return 1;
+		}
+
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->ready, NULL);
+	pthread_cond_init(&l->space, NULL);
+
+	for (i=0; i < threads; i++) {
+		if (pthread_create(&l->workers[i], NULL, loader_worker, l))
+			break;
+		l->num_workers++;
+		}
+
+	if (l->num_workers == 0) {
+		fprintf(stderr,"ERROR: Could not start any loader thread\n");
+		stop_loader(l);
+		return 1;
+		}
+
+	return 0;
+	}
+
+
+
+/* loader_next: This function takes a loader, a pointer to a float pointer and a
+	pointer to an int. It waits for the next image of the list to be decoded
+	and points the float pointer at its input vector and the int at its
+	position in the list. The vector stays valid until the next call. Images
+	which could not be decoded are skipped.
+	Returns 1 if a vector was handed out and 0 when the list is finished */
+
+int loader_next (loader * l, float ** vect, int * index) {
+
+	pthread_mutex_lock(&l->lock);
+
+	/* the vector handed out last time is not needed any more, so its slot can
+	take the next image */
+	if (l->holding) {
+		l->state[l->consumed % l->depth] = SLOT_EMPTY;
+		l->consumed++;
+		l->holding = 0;
+		pthread_cond_broadcast(&l->space);
+		}
+
+	while (l->consumed < l->count) {
+		int slot = l->consumed % l->depth;
+
+		while (l->state[slot] == SLOT_EMPTY)
+			pthread_cond_wait(&l->ready, &l->lock);
+
+		if (l->state[slot] == SLOT_FAILED) {
+			l->state[slot] = SLOT_EMPTY;
+			l->consumed++;
+			pthread_cond_broadcast(&l->space);
+			continue;
+			}
+
+		l->holding = 1;
+		*vect = l->vectors + (size_t) slot * l->stride;
+		*index = l->consumed;
+		pthread_mutex_unlock(&l->lock);
+		return 1;
+		}
+
+	pthread_mutex_unlock(&l->lock);
+	return 0;
+	}
+
+
+
+/* stop_loader: This function takes a loader, stops its workers (even if the
+	list is not finished) and releases its memory. */
+
+void stop_loader (loader * l) {
+
+	int i;
+
+	if (l == NULL)
+		return;
+
+	pthread_mutex_lock(&l->lock);
+	l->stop = 1;
+	pthread_cond_broadcast(&l->space);
+	pthread_mutex_unlock(&l->lock);
+
+	for (i=0; i < l->num_workers; i++)
+		pthread_join(l->workers[i], NULL);
+
+	pthread_mutex_destroy(&l->lock);
+	pthread_cond_destroy(&l->ready);
+	pthread_cond_destroy(&l->space);
+
+	free(l->vectors);
+	free(l->state);
+	free(l->workers);
+	l->vectors = NULL;
+	l->state = NULL;
+	l->workers = NULL;
+	l->num_workers = 0;
+	}
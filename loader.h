@@ -0,0 +1,97 @@
+/*_____________________________________________________________________________
+loader.h: This is a header file for giving a parallel image loader.
+	The loader works through a list of images with a pool of worker threads.
+	The workers decode the next images of the list into network input vectors
+	while the caller is busy with the current one, so reading and decoding the
+	images overlaps with running the network on them. Decoded vectors are
+	handed to the caller in the order of the list through a bounded queue.
+	Current functions include following:
+		start_loader:			Start the workers on a list of images
+		loader_next:			Get the next decoded input vector
+		stop_loader:			Stop the workers and release the loader
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#ifndef _LOADER_GUARD
+#define _LOADER_GUARD
+
+#include <pthread.h>
+
+
+/* The structure for a loader.
+	The queue is a ring of 'depth' slots, each holding one input vector. Image
+	k of the list always goes in slot k % depth, and a worker only takes image
+	k once image k - depth has been handed out and released by the caller, so
+	at most 'depth' images are decoded ahead of the caller. */
+
+typedef struct {
+	char ** names;					// list of images
+	int count;						// number of images in the list
+	int vec_len;					// number of floats in each vector
+	float threshold;				// threshold for binarization
+
+	int depth;						// number of slots in the queue
+	int stride;						// floats from one slot to the next
+	float * vectors;				// the slots
+	int * state;					// state of each slot
+
+	int next;						// next image for a worker to decode
+	int consumed;					// next image to hand to the caller
+	int holding;					// 'caller holds image consumed' flag
+	int stop;						// 'workers have to stop' flag
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready;			// signalled when a slot is decoded
+	pthread_cond_t space;			// signalled when a slot is released
+	pthread_t * workers;
+	int num_workers;
+	} loader;
+
+
+/* start_loader: This function takes a loader structure, an array of image
+	names, the number of images, the length of the input vector, a threshold,
+	the number of worker threads and the depth of the queue. It starts the
+	workers, which decode the images with imread_vector (averaging to grey and
+	binarizing at the threshold). Passing 0 threads uses one per processor and
+	passing 0 depth makes the queue twice as deep as there are workers.
+	The array of names has to stay valid until stop_loader.
+	Returns 0 on success and 1 on failure */
+
+int start_loader (loader *, char **, int, int, float, int, int);
+
+
+/* loader_next: This function takes a loader, a pointer to a float pointer and a
+	pointer to an int. It waits for the next image of the list to be decoded
+	and points the float pointer at its input vector and the int at its
+	position in the list. The vector stays valid until the next call. Images
+	which could not be decoded are skipped.
+	Returns 1 if a vector was handed out and 0 when the list is finished */
+
+int loader_next (loader *, float **, int *);
+
+
+/* stop_loader: This function takes a loader, stops its workers (even if the
+	list is not finished) and releases its memory. */
+
+void stop_loader (loader *);
+
+
+#endif
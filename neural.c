@@ -26,9 +26,402 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "neural.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 
+/* A kernel computing the products of a weight matrix with 'count' input vectors,
+   out_s = W x_s, W being a matrix of 'rows' rows of 'cols' weights, rows 'stride' floats
+   apart. The inputs are 'xstride' floats apart and the outputs 'ostride' floats apart.
+   Every output is summed in the same order whether its input comes on its own or in a
+   block with others, so a batch gives exactly the outputs of its inputs one at a time */
+
+typedef void (* gemm_kernel) (const float *, int, int, int, const float *, int, int, float *, int);
+static gemm_kernel select_gemm_kernel (void);
+
+
+/* gemm_scalar: one row after the other, summing each in order into one accumulator */
+
+static void gemm_scalar (const float *w, int stride, int rows, int cols, const float *x, int xstride,
+		int count, float *out, int ostride) {
+	int r,c,s;
+
+	for (s=0; s < count; s++) {
+		const float * xs = x + (size_t) s * xstride;
+		float * os = out + (size_t) s * ostride;
+
+		for (r=0; r < rows; r++) {
+			const float * row = w + (size_t) r * stride;
+			float sigma_wx = 0.0;
+
+			for (c=0; c < cols; c++)
+				sigma_wx += row[c] * xs[c];
+			os[r] = sigma_wx;
+			}
+		}
+	}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+/* The vector kernels run blocks of four rows by several inputs, keeping one accumulator
+	for each pair in a register, so every load of a weight feeds all the inputs of the
+	block and every load of an input feeds four rows. The weights of a layer are then
+	read once for every block of inputs instead of once for every input. Inputs left
+	over at the end of a batch are run one at a time, eight rows at once so that eight
+	independent sums are in flight. When fewer rows than that are left, the missing ones
+	repeat the last row and their sums are dropped */
+
+#define GEMM_ROWS 4
+#define GEMV_ROWS 8
+
+static void gemm_rows (const float *w, int stride, int rows, int r, int n, const float **p) {
+	int k;
+	for (k=0; k < n; k++)
+		p[k] = w + (size_t) (r + k < rows ? r + k : rows - 1) * stride;
+	}
+
+
+/* SSE2: four columns at a time, blocks of four rows by two inputs */
+
+__attribute__((target("sse2")))
+static float hsum_sse2 (__m128 v) {
+	v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+	return _mm_cvtss_f32(v);
+	}
+
+/* finish_sse2: adds up the lanes of an accumulator and the columns from c on */
+
+__attribute__((target("sse2")))
+static float finish_sse2 (__m128 acc, const float *row, const float *x, int c, int cols) {
+	float sum = hsum_sse2(acc);
+	for (; c < cols; c++)
+		sum += row[c] * x[c];
+	return sum;
+	}
+
+__attribute__((target("sse2")))
+static void gemv_sse2 (const float *w, int stride, int rows, int cols, const float *x, float *out) {
+	int r,c,k;
+	const float * p[GEMV_ROWS];
+
+	for (r=0; r < rows; r += GEMV_ROWS) {
+		__m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+		__m128 a4 = _mm_setzero_ps(), a5 = _mm_setzero_ps(), a6 = _mm_setzero_ps(), a7 = _mm_setzero_ps();
+
+		gemm_rows(w, stride, rows, r, GEMV_ROWS, p);
+		for (c=0; c + 4 <= cols; c += 4) {
+			__m128 x0 = _mm_loadu_ps(x + c);
+			a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(p[0] + c), x0));
+			a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(p[1] + c), x0));
+			a2 = _mm_add_ps(a2, _mm_mul_ps(_mm_loadu_ps(p[2] + c), x0));
+			a3 = _mm_add_ps(a3, _mm_mul_ps(_mm_loadu_ps(p[3] + c), x0));
+			a4 = _mm_add_ps(a4, _mm_mul_ps(_mm_loadu_ps(p[4] + c), x0));
+			a5 = _mm_add_ps(a5, _mm_mul_ps(_mm_loadu_ps(p[5] + c), x0));
+			a6 = _mm_add_ps(a6, _mm_mul_ps(_mm_loadu_ps(p[6] + c), x0));
+			a7 = _mm_add_ps(a7, _mm_mul_ps(_mm_loadu_ps(p[7] + c), x0));
+			}
+
+		__m128 acc[GEMV_ROWS] = { a0, a1, a2, a3, a4, a5, a6, a7 };
+		for (k=0; k < GEMV_ROWS && r + k < rows; k++)
+			out[r + k] = finish_sse2(acc[k], p[k], x, c, cols);
+		}
+	}
+
+__attribute__((target("sse2")))
+static void gemm_sse2 (const float *w, int stride, int rows, int cols, const float *x, int xstride,
+		int count, float *out, int ostride) {
+	int r,c,k,s;
+	const float * p[GEMM_ROWS];
+
+	for (s=0; s + 2 <= count; s += 2) {
+		const float * x0 = x + (size_t) s * xstride, * x1 = x0 + xstride;
+		float * o0 = out + (size_t) s * ostride, * o1 = o0 + ostride;
+
+		for (r=0; r < rows; r += GEMM_ROWS) {
+			__m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+			__m128 b0 = _mm_setzero_ps(), b1 = _mm_setzero_ps(), b2 = _mm_setzero_ps(), b3 = _mm_setzero_ps();
+
+			gemm_rows(w, stride, rows, r, GEMM_ROWS, p);
+			for (c=0; c + 4 <= cols; c += 4) {
+				__m128 u = _mm_loadu_ps(x0 + c), v = _mm_loadu_ps(x1 + c), wk;
+				wk = _mm_loadu_ps(p[0] + c);
+				a0 = _mm_add_ps(a0, _mm_mul_ps(wk, u));
+				b0 = _mm_add_ps(b0, _mm_mul_ps(wk, v));
+				wk = _mm_loadu_ps(p[1] + c);
+				a1 = _mm_add_ps(a1, _mm_mul_ps(wk, u));
+				b1 = _mm_add_ps(b1, _mm_mul_ps(wk, v));
+				wk = _mm_loadu_ps(p[2] + c);
+				a2 = _mm_add_ps(a2, _mm_mul_ps(wk, u));
+				b2 = _mm_add_ps(b2, _mm_mul_ps(wk, v));
+				wk = _mm_loadu_ps(p[3] + c);
+				a3 = _mm_add_ps(a3, _mm_mul_ps(wk, u));
+				b3 = _mm_add_ps(b3, _mm_mul_ps(wk, v));
+				}
+
+			__m128 acc0[GEMM_ROWS] = { a0, a1, a2, a3 }, acc1[GEMM_ROWS] = { b0, b1, b2, b3 };
+			for (k=0; k < GEMM_ROWS && r + k < rows; k++) {
+				o0[r + k] = finish_sse2(acc0[k], p[k], x0, c, cols);
+				o1[r + k] = finish_sse2(acc1[k], p[k], x1, c, cols);
+				}
+			}
+		}
+
+	for (; s < count; s++)
+		gemv_sse2(w, stride, rows, cols, x + (size_t) s * xstride, out + (size_t) s * ostride);
+	}
+
+
+/* AVX2 with FMA: eight columns at a time, blocks of four rows by two inputs */
+
+__attribute__((target("avx2,fma")))
+static float hsum_avx2 (__m256 v) {
+	__m128 h = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+	h = _mm_add_ss(h, _mm_shuffle_ps(h, h, 1));
+	return _mm_cvtss_f32(h);
+	}
+
+__attribute__((target("avx2,fma")))
+static float finish_avx2 (__m256 acc, const float *row, const float *x, int c, int cols) {
+	float sum = hsum_avx2(acc);
+	for (; c < cols; c++)
+		sum += row[c] * x[c];
+	return sum;
+	}
+
+__attribute__((target("avx2,fma")))
+static void gemv_avx2 (const float *w, int stride, int rows, int cols, const float *x, float *out) {
+	int r,c,k;
+	const float * p[GEMV_ROWS];
+
+	for (r=0; r < rows; r += GEMV_ROWS) {
+		__m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+		__m256 a4 = _mm256_setzero_ps(), a5 = _mm256_setzero_ps(), a6 = _mm256_setzero_ps(), a7 = _mm256_setzero_ps();
+
+		gemm_rows(w, stride, rows, r, GEMV_ROWS, p);
+		for (c=0; c + 8 <= cols; c += 8) {
+			__m256 x0 = _mm256_loadu_ps(x + c);
+			a0 = _mm256_fmadd_ps(_mm256_loadu_ps(p[0] + c), x0, a0);
+			a1 = _mm256_fmadd_ps(_mm256_loadu_ps(p[1] + c), x0, a1);
+			a2 = _mm256_fmadd_ps(_mm256_loadu_ps(p[2] + c), x0, a2);
+			a3 = _mm256_fmadd_ps(_mm256_loadu_ps(p[3] + c), x0, a3);
+			a4 = _mm256_fmadd_ps(_mm256_loadu_ps(p[4] + c), x0, a4);
+			a5 = _mm256_fmadd_ps(_mm256_loadu_ps(p[5] + c), x0, a5);
+			a6 = _mm256_fmadd_ps(_mm256_loadu_ps(p[6] + c), x0, a6);
+			a7 = _mm256_fmadd_ps(_mm256_loadu_ps(p[7] + c), x0, a7);
+			}
+
+		__m256 acc[GEMV_ROWS] = { a0, a1, a2, a3, a4, a5, a6, a7 };
+		for (k=0; k < GEMV_ROWS && r + k < rows; k++)
+			out[r + k] = finish_avx2(acc[k], p[k], x, c, cols);
+		}
+	}
+
+__attribute__((target("avx2,fma")))
+static void gemm_avx2 (const float *w, int stride, int rows, int cols, const float *x, int xstride,
+		int count, float *out, int ostride) {
+	int r,c,k,s;
+	const float * p[GEMM_ROWS];
+
+	for (s=0; s + 2 <= count; s += 2) {
+		const float * x0 = x + (size_t) s * xstride, * x1 = x0 + xstride;
+		float * o0 = out + (size_t) s * ostride, * o1 = o0 + ostride;
+
+		for (r=0; r < rows; r += GEMM_ROWS) {
+			__m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+			__m256 b0 = _mm256_setzero_ps(), b1 = _mm256_setzero_ps(), b2 = _mm256_setzero_ps(), b3 = _mm256_setzero_ps();
+
+			gemm_rows(w, stride, rows, r, GEMM_ROWS, p);
+			for (c=0; c + 8 <= cols; c += 8) {
+				__m256 u = _mm256_loadu_ps(x0 + c), v = _mm256_loadu_ps(x1 + c), wk;
+				wk = _mm256_loadu_ps(p[0] + c);
+				a0 = _mm256_fmadd_ps(wk, u, a0);
+				b0 = _mm256_fmadd_ps(wk, v, b0);
+				wk = _mm256_loadu_ps(p[1] + c);
+				a1 = _mm256_fmadd_ps(wk, u, a1);
+				b1 = _mm256_fmadd_ps(wk, v, b1);
+				wk = _mm256_loadu_ps(p[2] + c);
+				a2 = _mm256_fmadd_ps(wk, u, a2);
+				b2 = _mm256_fmadd_ps(wk, v, b2);
+				wk = _mm256_loadu_ps(p[3] + c);
+				a3 = _mm256_fmadd_ps(wk, u, a3);
+				b3 = _mm256_fmadd_ps(wk, v, b3);
+				}
+
+			__m256 acc0[GEMM_ROWS] = { a0, a1, a2, a3 }, acc1[GEMM_ROWS] = { b0, b1, b2, b3 };
+			for (k=0; k < GEMM_ROWS && r + k < rows; k++) {
+				o0[r + k] = finish_avx2(acc0[k], p[k], x0, c, cols);
+				o1[r + k] = finish_avx2(acc1[k], p[k], x1, c, cols);
+				}
+			}
+		}
+
+	for (; s < count; s++)
+		gemv_avx2(w, stride, rows, cols, x + (size_t) s * xstride, out + (size_t) s * ostride);
+	}
+
+
+/* AVX-512: sixteen columns at a time, the last few columns through a mask. With twice
+	as many registers the blocks are four rows by four inputs */
+
+__attribute__((target("avx512f")))
+static __mmask16 tail_mask (int left) {
+	return left >= 16 ? 0xffff : (__mmask16) ((1u << left) - 1);
+	}
+
+__attribute__((target("avx512f")))
+static void gemv_avx512 (const float *w, int stride, int rows, int cols, const float *x, float *out) {
+	int r,c,k;
+	const float * p[GEMV_ROWS];
+
+	for (r=0; r < rows; r += GEMV_ROWS) {
+		__m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+		__m512 a4 = _mm512_setzero_ps(), a5 = _mm512_setzero_ps(), a6 = _mm512_setzero_ps(), a7 = _mm512_setzero_ps();
+
+		gemm_rows(w, stride, rows, r, GEMV_ROWS, p);
+		for (c=0; c < cols; c += 16) {
+			__mmask16 m = tail_mask(cols - c);
+			__m512 x0 = _mm512_maskz_loadu_ps(m, x + c);
+			a0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, p[0] + c), x0, a0);
+			a1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, p[1] + c), x0, a1);
+			a2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, p[2] + c), x0, a2);
+			a3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, p[3] + c), x0, a3);
+			a4 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, p[4] + c), x0, a4);
+			a5 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, p[5] + c), x0, a5);
+			a6 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, p[6] + c), x0, a6);
+			a7 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, p[7] + c), x0, a7);
+			}
+
+		__m512 acc[GEMV_ROWS] = { a0, a1, a2, a3, a4, a5, a6, a7 };
+		for (k=0; k < GEMV_ROWS && r + k < rows; k++)
+			out[r + k] = _mm512_reduce_add_ps(acc[k]);
+		}
+	}
+
+__attribute__((target("avx512f")))
+static void gemm_avx512 (const float *w, int stride, int rows, int cols, const float *x, int xstride,
+		int count, float *out, int ostride) {
+	int r,c,k,s;
+	const float * p[GEMM_ROWS];
+
+	for (s=0; s + 4 <= count; s += 4) {
+		const float * x0 = x + (size_t) s * xstride, * x1 = x0 + xstride;
+		const float * x2 = x1 + xstride, * x3 = x2 + xstride;
+		float * o0 = out + (size_t) s * ostride;
+
+		for (r=0; r < rows; r += GEMM_ROWS) {
+			__m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+			__m512 b0 = _mm512_setzero_ps(), b1 = _mm512_setzero_ps(), b2 = _mm512_setzero_ps(), b3 = _mm512_setzero_ps();
+			__m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps(), c2 = _mm512_setzero_ps(), c3 = _mm512_setzero_ps();
+			__m512 d0 = _mm512_setzero_ps(), d1 = _mm512_setzero_ps(), d2 = _mm512_setzero_ps(), d3 = _mm512_setzero_ps();
+
+			gemm_rows(w, stride, rows, r, GEMM_ROWS, p);
+			for (c=0; c < cols; c += 16) {
+				__mmask16 m = tail_mask(cols - c);
+				__m512 u0 = _mm512_maskz_loadu_ps(m, x0 + c), u1 = _mm512_maskz_loadu_ps(m, x1 + c);
+				__m512 u2 = _mm512_maskz_loadu_ps(m, x2 + c), u3 = _mm512_maskz_loadu_ps(m, x3 + c), wk;
+				wk = _mm512_maskz_loadu_ps(m, p[0] + c);
+				a0 = _mm512_fmadd_ps(wk, u0, a0);
+				b0 = _mm512_fmadd_ps(wk, u1, b0);
+				c0 = _mm512_fmadd_ps(wk, u2, c0);
+				d0 = _mm512_fmadd_ps(wk, u3, d0);
+				wk = _mm512_maskz_loadu_ps(m, p[1] + c);
+				a1 = _mm512_fmadd_ps(wk, u0, a1);
+				b1 = _mm512_fmadd_ps(wk, u1, b1);
+				c1 = _mm512_fmadd_ps(wk, u2, c1);
+				d1 = _mm512_fmadd_ps(wk, u3, d1);
+				wk = _mm512_maskz_loadu_ps(m, p[2] + c);
+				a2 = _mm512_fmadd_ps(wk, u0, a2);
+				b2 = _mm512_fmadd_ps(wk, u1, b2);
+				c2 = _mm512_fmadd_ps(wk, u2, c2);
+				d2 = _mm512_fmadd_ps(wk, u3, d2);
+				wk = _mm512_maskz_loadu_ps(m, p[3] + c);
+				a3 = _mm512_fmadd_ps(wk, u0, a3);
+				b3 = _mm512_fmadd_ps(wk, u1, b3);
+				c3 = _mm512_fmadd_ps(wk, u2, c3);
+				d3 = _mm512_fmadd_ps(wk, u3, d3);
+				}
+
+			__m512 acc[4][GEMM_ROWS] = { { a0, a1, a2, a3 }, { b0, b1, b2, b3 },
+				{ c0, c1, c2, c3 }, { d0, d1, d2, d3 } };
+			for (k=0; k < GEMM_ROWS && r + k < rows; k++) {
+				int j;
+				for (j=0; j < 4; j++)
+					o0[(size_t) j * ostride + r + k] = _mm512_reduce_add_ps(acc[j][k]);
+				}
+			}
+		}
+
+	for (; s < count; s++)
+		gemv_avx512(w, stride, rows, cols, x + (size_t) s * xstride, out + (size_t) s * ostride);
+	}
+
+#endif
+
+
+/* select_gemm_kernel: returns the fastest matrix product kernel that the processor we
+   are running on supports */
+
+static gemm_kernel select_gemm_kernel (void) {
+#if defined(__x86_64__) || defined(__i386__)
+	static gemm_kernel best = NULL;
+	if (best == NULL) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			best = gemm_avx512;
+		else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+			best = gemm_avx2;
+		else if (__builtin_cpu_supports("sse2"))
+			best = gemm_sse2;
+		else
+			best = gemm_scalar;
+		}
+	return best;
+#else
+	return gemm_scalar;
+#endif
+	}
+
+
+
+/* layer_gemm: computes out_s = W x_s for 'count' inputs one after the other in x, putting
+   the outputs one after the other in out, with the best kernel the processor has */
+
+static void layer_gemm (const float *w, int stride, int rows, int cols, const float *x, int count,
+		float *out) {
+	select_gemm_kernel()(w, stride, rows, cols, x, cols, count, out, rows);
+	}
+
+
+
+/* layer_gemv: computes the matrix-vector product out = W x, the batch of one input of
+   layer_gemm */
+
+static void layer_gemv (const float *w, int stride, int rows, int cols, const float *x, float *out) {
+	layer_gemm(w, stride, rows, cols, x, 1, out);
+	}
+
+
+
+/* activate: applies an activation function to a weighted sum. The step and linear
+   functions of this file are worked out here instead of being called through the
+   pointer */
+
+static inline float activate (activation a, float sigma) {
+	if (a == step_activation)
+		return (sigma > 0);
+	if (a == linear_activation)
+		return sigma;
+	return a(sigma);
+	}
+
+
+
+
 
 
 /* initialize_neuron: This is a function to initialize a neuron. It should take a
@@ -41,23 +434,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
    Success will be returned as 1 and failure as 0 */
 
-int initialize_neuron (neuron *n, int num_weights, activation a) {
+/* fill_neuron: sets up a neuron with the given array for its weights, drawing the weights
+   and the bias weight at random */
 
-	if (n == NULL) {	// this shouldnt happen
-		printf("Null pointer passed: neuron = %p\n",n);
-		return 0;
-		}
+static void fill_neuron (neuron *n, float *weights, int num_weights, activation a) {
 
 	n->ex_output = 0.0;	// expected output should be set by the calling program later
 	n->output = 0.0;	// set output to 0
 	n->bias = 1.0;		// set bias to 0
-	
-	n->weights = (float *) malloc (sizeof(float) * num_weights );
-	
-	if (n->weights == NULL) {	// check for malloc failures
-		printf("Could not allocate memory for weights");
-		return 0;
-		}
+	n->weights = weights;
 
 	int i;
 	for (i=0; i < num_weights; i++) {
@@ -67,6 +452,24 @@ int initialize_neuron (neuron *n, int num_weights, activation a) {
 
 	n->num_in = num_weights;	// now set the number of inputs
 	n->act = a;
+	}
+
+
+int initialize_neuron (neuron *n, int num_weights, activation a) {
+
+	if (n == NULL) {	// this shouldnt happen
+		printf("Null pointer passed: neuron = %p\n",n);
+		return 0;
+		}
+
+	float * weights = (float *) malloc (sizeof(float) * num_weights );
+	
+	if (weights == NULL) {	// check for malloc failures
+		printf("Could not allocate memory for weights");
+		return 0;
+		}
+
+	fill_neuron(n, weights, num_weights, a);
 
 	// all well which ends well
 	return 1;
@@ -195,7 +598,6 @@ int perceptron_update (neuron *n, float *in, float eta) {
 
 int perceptron_update_output (neuron *n,float *in) {
 //int perceptron_update_output (neuron *n,float *in, activation act) {
-	int i;
 	float sigma_wx = 0.0;
 
         if (n == NULL || in == NULL) {
@@ -203,17 +605,52 @@ int perceptron_update_output (neuron *n,float *in) {
                 return 0;
                 }
 
-	for (i = 0; i < n->num_in; i++) {
-		sigma_wx += n->weights[i] * in[i];
-	}
+	layer_gemv(n->weights, n->num_in, 1, n->num_in, in, &sigma_wx);
 
-	n->output = n->act(sigma_wx + n->bias_wt);
+	n->output = activate(n->act, sigma_wx + n->bias_wt);
 	
 	return 1;
 	}
 
 
 
+/* layer_gemm_t: computes out_s = W' d_s for 'count' vectors d_s, one after the other in d,
+   putting the results one after the other in out, W being laid out as for layer_gemv. The
+   columns are taken a block of GEMM_T_BLOCK at a time, and the block of every row is used
+   for all the vectors of the batch before the next block, so the weights come from memory
+   once for the batch, while the sums of the block stay in the first level cache. The rows are
+   added up one after the other, so the matrix is read in the order it is stored rather
+   than a column at a time */
+
+#define GEMM_T_BLOCK 64
+
+static void layer_gemm_t (const float *w, int stride, int rows, int cols, const float *d, int count,
+		float *out) {
+	float acc[GEMM_T_BLOCK];
+	int c0,c,r,s;
+
+	for (c0=0; c0 < cols; c0 += GEMM_T_BLOCK) {
+		int width = (cols - c0 < GEMM_T_BLOCK ? cols - c0 : GEMM_T_BLOCK);
+
+		for (s=0; s < count; s++) {
+			const float * ds = d + (size_t) s * rows;
+
+			for (c=0; c < width; c++)
+				acc[c] = 0.0;
+			for (r=0; r < rows; r++) {
+				const float * row = w + (size_t) r * stride + c0;
+				float dr = ds[r];
+
+				for (c=0; c < width; c++)
+					acc[c] += dr * row[c];
+				}
+			memcpy(out + (size_t) s * cols + c0, acc, sizeof(float) * width);
+			}
+		}
+	}
+
+
+
 /* initialize_ann: this function takes a pointer to an ANN and initializes it in the 
    sense that it allocates and initializes all the arrays in following manner:
 
@@ -222,6 +659,9 @@ int perceptron_update_output (neuron *n,float *in) {
 
    It will then allocate arrays to the inputs and the number of neurons in each layer. It will also
    initiate the arrays as appropriate. All neurons in layer i-1 are connected to those in layer i. 
+   The weights of each layer are allocated as one matrix, and its neurons are set up as views of
+   it, so they must not be passed to free_neuron. The workspace for training is allocated here
+   as well, so that training allocates no memory.
 
    Returns 1 on success and 0 on failure */
 
@@ -240,6 +680,9 @@ int initialize_ann (ann *net, float e, int layers, int inputs, int *n) {
 		return 0;
 		}
 
+	/* pick the kernel for the weighted sums now, before any thread runs the network */
+	select_gemm_kernel();
+
 	/* initialize the basic parameters */
 	net->num_layers = layers;
 	net->num_in = inputs;
@@ -274,12 +717,28 @@ int initialize_ann (ann *net, float e, int layers, int inputs, int *n) {
 			return 0;
 			}
 
-		// now initialize these neurons
+		/* the weights of the whole layer are one matrix, each row padded to whole
+		aligned blocks with zeros */
+		int ins_this_layer = (i == 0 ? net->num_in : net->num_neurons[i-1] );
+		int per_block = NEURAL_ALIGN / sizeof(float);
+		void * data = NULL;
+
+		net->stride[i] = (ins_this_layer + per_block - 1) / per_block * per_block;
+		net->bias_wts[i] = (float *) malloc ( sizeof(float) * n1 );
+		if (posix_memalign(&data, NEURAL_ALIGN, sizeof(float) * net->stride[i] * n1) ||
+				net->bias_wts[i] == NULL) {
+			printf("Error allocating memory for weights of layer %d\n",i);
+			return 0;
+			}
+		net->weights[i] = (float *) data;
+		memset(net->weights[i], 0, sizeof(float) * net->stride[i] * n1);
+
+		// now initialize these neurons as views of their rows
 		int x;
 		for (x = 0; x < n1; x++) {
-			int ins_this_layer;
-			ins_this_layer = (i == 0 ? net->num_in : net->num_neurons[i-1] );
-			initialize_neuron ( &net->layers[i][x], ins_this_layer, step_activation);
+			neuron * v = &net->layers[i][x];
+			fill_neuron ( v, net->weights[i] + (size_t) x * net->stride[i], ins_this_layer, step_activation);
+			net->bias_wts[i][x] = v->bias_wt;
 			}
 		i++;
 		}
@@ -290,13 +749,22 @@ int initialize_ann (ann *net, float e, int layers, int inputs, int *n) {
 		net->outputs[i] = NULL;
 		net->layers[i] = NULL;
 		net->num_neurons[i] = 0;
+		net->stride[i] = 0;
+		net->weights[i] = NULL;
+		net->bias_wts[i] = NULL;
 		}
 
+	/* the workspace has room for one sample to begin with, which is all that
+	err_backpropogation needs */
+	if (allocate_work(net, 1, &net->work) == 0)
+		return 0;
+
 	return 1;
 	}
 
 
-/* free_ann: This function takes a pointer to an ANN and frees all the memory allocated for it.
+/* free_ann: This function takes a pointer to an ANN and frees all the memory allocated for it,
+   including the weight matrices its neurons are views of.
    The things on stack will still remain 
 
    Returns 1 on success and 0 on failure */
@@ -310,18 +778,18 @@ int free_ann (ann *net) {
 		return 1;
 		}
 
-	/* first free the neuron array and outputs */
+	/* first free the weights, the neuron array and outputs. The neurons only point
+	into the weight matrices, so they have nothing of their own to free */
 
 	for (i=0; i < MAXLAYERS; i++) {
-		int j;
-		for (j=0; j < net->num_neurons[i]; j++) {
-			free_neuron ( &(net->layers[i][j]) );	// first free the neuron
-			}
+		free ( net->weights[i] );
+		free ( net->bias_wts[i] );
 		free ( net->outputs[i] );
 		free ( net->layers[i] );
 		}
 
-	// then free the input and expected output array
+	// then free the workspace, the input and expected output array
+	free_work ( &net->work );
 	free ( net->in );
 	free ( net->ex_output );
 	return 1;
@@ -373,14 +841,29 @@ int print_ann (ann *net) {
 
 
 
+/* take_bias_views: takes the bias weight of every neuron of the network into the bias
+   weight vector of its layer, so that a bias weight set through the neuron (by set_neuron
+   or perceptron_update) is the one the network runs with. It is done at the start of every
+   pass, and every step of the network writes the vectors back to the neurons */
+
+static void take_bias_views (ann * net) {
+	int i,k;
+
+	for (i=0; i < net->num_layers; i++)
+		for (k=0; k < net->num_neurons[i]; k++)
+			net->bias_wts[i][k] = net->layers[i][k].bias_wt;
+	}
+
+
+
 /* err_backpropogation: This function takes a pointer to an ANN and propogates the input through
    the network. It then propogates the error backwards to update the weights of all the neurons
-   in the ANN.
+   in the ANN. The deltas are kept in the workspace of the network, so no memory is allocated.
 
    Returns 1 on success and 0 on failure */
 
 int err_backpropogation (ann * net) {
-	int i;
+	int i,j,k;
 
 	if(! net) {
 		printf("Null pointer passed: ann = %p\n",net);
@@ -389,17 +872,16 @@ int err_backpropogation (ann * net) {
 
 	/* first thing to do is to find delta for output layer. The delta is given for output as:
 			delta = g' * (t - y)	
-	as given on http://www.willamette.edu/~gorr/classes/cs449/backprop.html. g' is 1 in our case */
+	as given on http://www.willamette.edu/~gorr/classes/cs449/backprop.html. g' is 1 in our case.
+	The deltas go in the workspace of the network, so a step allocates nothing */
 
 
 	int last_layer_index = net->num_layers - 1;
+	float * delta = net->work.delta;
+	float * delta1 = net->work.delta1;
+	float * swap;
 
-	float * delta = (float *) malloc ( sizeof(float) * net->num_neurons[last_layer_index] );
-
-	if (! delta ) {
-		printf("Error allocating memory for delta array\n");
-		return 0;
-		}
+	take_bias_views(net);
 
 	for (i = 0; i < net->num_neurons[last_layer_index]; i++) {
 		delta[i] = net->ex_output[i] - net->outputs[last_layer_index][i];
@@ -410,57 +892,60 @@ int err_backpropogation (ann * net) {
 	for (i = net->num_layers - 1; i > 0; i--) {
 
 		// i here is the previous layer (closer to input) hence we have to use (i-1) for indexing
-		float * delta1 = (float *) malloc ( sizeof(float) * net->num_neurons[i-1] );
-		if ( ! delta1 ) {
-			printf("Error allocating memory for delta-1 array\n");
-			return 0;
-			}
-		
-		// now compute the delta for this layer (closer to the input)
-		int j;
-		for (j = 0; j < net->num_neurons[i-1]; j++) {
-			
-			/* for each neuron in this layer, we have to compute delta as
-					delta^i_j = sum ( delta^i+1_j * weight^i+1_j )			*/
-			float delta_sum = 0.0;
-			int k;
-
-			for (k=0; k < net->num_neurons[i]; k++) {
-				delta_sum += delta[k] * net->layers[i][k].weights[j] ;
+		int rows = net->num_neurons[i], cols = net->num_neurons[i-1];
+		float * out = net->outputs[i-1];
+
+		/* for each neuron in the layer closer to the input, we have to compute delta as
+				delta^i_j = sum ( delta^i+1_k * weight^i+1_kj )
+		which for the whole layer is the product of the transposed weight matrix with the
+		deltas. Each row of the matrix is read once, for its part of that product and for the
+		update of its weights, every weight being read before it is updated */
+		for (j = 0; j < cols; j++)
+			delta1[j] = 0.0;
+
+		for (k = 0; k < rows; k++) {
+			float * row = net->weights[i] + (size_t) k * net->stride[i];
+			float dk = delta[k];
+			float step = net->eta * dk;
+
+			/* a neuron which got its output right neither passes on nor takes a step */
+			if (dk == 0)
+				continue;
+			for (j = 0; j < cols; j++) {
+				delta1[j] += dk * row[j];
+				row[j] += step * out[j];
 				}
-
-			// take derivative of tanh if needed
-			if (net->layers[i-1][j].act == tanh_activation) {
-				float der = ( 1 - pow(net->outputs[i-1][j],2) );
-				delta_sum *= der;
+			net->bias_wts[i][k] += step * net->layers[i][k].bias;
+			net->layers[i][k].bias_wt = net->bias_wts[i][k];
 			}
-			delta1[j] = delta_sum;
-			
 
-			/* now we have to update the weights of the layer i+1 (index i) */
-			for (k=0; k < net->num_neurons[i]; k++) {
-				net->layers[i][k].weights[j] += net->eta * delta[k] * net->outputs[i-1][j];
-				net->layers[i][k].bias_wt += net->eta * delta[k] * net->layers[i][k].bias;
+		// take derivative of tanh if needed
+		for (j = 0; j < cols; j++) {
+			if (net->layers[i-1][j].act == tanh_activation) {
+				float der = ( 1 - pow(out[j],2) );
+				delta1[j] *= der;
 				}
-
 			}
 
-
 		// now that delta is calculated, switch the pointers such that delta1 is new delta
-		free (delta);
+		swap = delta;
 		delta = delta1;
-		delta1 = NULL;
+		delta1 = swap;
 		}
 
 		// now we still have to update the weights for the layer closest to the input
 		for (i=0; i < net->num_neurons[0]; i++) {
-			int j;
+			float * row = net->weights[0] + (size_t) i * net->stride[0];
+			float step = net->eta * delta[i];
+
+			if (step == 0)
+				continue;
 			for (j=0; j < net->num_in; j++) 
-				net->layers[0][i].weights[j] += net->eta * delta[i] * net->in[j];
-				net->layers[0][i].bias_wt += net->eta * delta[i] * net->layers[0][i].bias;
+				row[j] += step * net->in[j];
+			net->bias_wts[0][i] += step * net->layers[0][i].bias;
+			net->layers[0][i].bias_wt = net->bias_wts[0][i];
 			}
 
-	free(delta);
 	return 1;
 	}
 
@@ -480,6 +965,8 @@ int fwd_propogation (ann * net) {
 		return 0;
 		}
 
+	take_bias_views(net);
+
 	/* iterate over all the layers */
 
 	for (i=0; i < net->num_layers; i++) {
@@ -491,13 +978,16 @@ int fwd_propogation (ann * net) {
 			in = net->outputs[i-1];
 			}
 		
-		/* now update the outputs of all the neurons */
+		/* the weighted sums of the whole layer are one matrix-vector product, then
+		each neuron adds its bias weight and applies its activation */
+		int num_src = (i == 0 ? net->num_in : net->num_neurons[i-1]);
+		float * out = net->outputs[i];
+
+		layer_gemv(net->weights[i], net->stride[i], net->num_neurons[i], num_src, in, out);
 		for (j=0; j < net->num_neurons[i]; j++) {
-			
-			/* update the output of this selected neuron */
-			perceptron_update_output( &net->layers[i][j], in);
-			//perceptron_update_output( &net->layers[i][j], in, step_activation);
-			net->outputs[i][j] = net->layers[i][j].output;
+			neuron * n = &net->layers[i][j];
+			n->output = activate(n->act, out[j] + net->bias_wts[i][j]);
+			out[j] = n->output;
 			} 
 		}
 
@@ -506,6 +996,315 @@ int fwd_propogation (ann * net) {
 
 
 
+/* layer_forward_batch: runs layer i of the network on 'count' input vectors, one after the
+   other in src, putting as many output vectors one after the other in dst. The weighted
+   sums of the whole batch are one matrix product, so each weight is loaded once for a
+   block of inputs rather than once for every input */
+
+static void layer_forward_batch (ann * net, int i, const float * src, int count, float * dst) {
+	int j,s;
+	int num_src = (i == 0 ? net->num_in : net->num_neurons[i-1]);
+	int num_dst = net->num_neurons[i];
+
+	layer_gemm(net->weights[i], net->stride[i], num_dst, num_src, src, count, dst);
+	for (s=0; s < count; s++) {
+		float * y = dst + (size_t) s * num_dst;
+
+		for (j=0; j < num_dst; j++)
+			y[j] = activate(net->layers[i][j].act, y[j] + net->bias_wts[i][j]);
+		}
+	}
+
+
+
+/* layer_gradient_step: adds the steps of 'count' samples for the weights of layer i,
+   eta * delta_k * x for neuron k, x being the inputs of the layer and delta its deltas,
+   both one vector after the other for each sample, to the matrix w and the vector b laid
+   out as the weights and bias weights of the layer. The steps of the whole batch are
+   summed for a block of GRAD_BLOCK weights of a neuron before being added to them, so
+   each weight is read and written once for the batch, and the block of inputs of the
+   batch stays in cache while it is used for every neuron */
+
+#define GRAD_BLOCK 256
+
+static void layer_gradient_step (ann * net, int i, const float * x, const float * delta, int count,
+		float * w, float * b) {
+	int rows = net->num_neurons[i];
+	int cols = (i == 0 ? net->num_in : net->num_neurons[i-1]);
+	float acc[GRAD_BLOCK];
+	int c0,c,k,s;
+
+	for (c0=0; c0 < cols; c0 += GRAD_BLOCK) {
+		int width = (cols - c0 < GRAD_BLOCK ? cols - c0 : GRAD_BLOCK);
+
+		for (k=0; k < rows; k++) {
+			float * row = w + (size_t) k * net->stride[i] + c0;
+
+			memset(acc, 0, sizeof(float) * width);
+			for (s=0; s < count; s++) {
+				float step = net->eta * delta[(size_t) s * rows + k];
+				const float * xs = x + (size_t) s * cols + c0;
+
+				/* a sample the neuron already gets right adds nothing */
+				if (step == 0)
+					continue;
+				for (c=0; c < width; c++)
+					acc[c] += step * xs[c];
+				}
+			for (c=0; c < width; c++)
+				row[c] += acc[c];
+			}
+		}
+
+	for (k=0; k < rows; k++) {
+		float sum = 0.0;
+		for (s=0; s < count; s++)
+			sum += net->eta * delta[(size_t) s * rows + k] * net->layers[i][k].bias;
+		b[k] += sum;
+		}
+	}
+
+
+
+/* grow_work: makes the workspace of the network hold batches of count samples. The
+	workspace only grows when a batch is larger than any before, and the old one is
+	only freed once the new one is allocated, so the network keeps a workspace it
+	can use when there is no memory for the larger one.
+	Returns 1 on success and 0 on failure */
+
+static int grow_work (ann * net, int count) {
+	ann_work work;
+
+	if (count <= net->work.size)
+		return 1;
+	if (allocate_work(net, count, &work) == 0)
+		return 0;
+	free_work(&net->work);
+	net->work = work;
+	return 1;
+	}
+
+
+
+/* fwd_propogation_batch: This function propogates a batch of inputs through the neural
+   network. It takes a pointer to a neural network, an array of input vectors one after
+   the other, the number of vectors and an array for as many output vectors of the last
+   layer. Each layer is run on the whole batch before the next one, so its weights are
+   brought into cache once for the batch rather than once for every input. The outputs
+   are the same fwd_propogation gives for each input, but the outputs kept in the
+   network and its neurons are not changed. The outputs of the hidden layers go in the
+   workspace of the network, which only grows when a batch is larger than any before.
+
+   Returns 1 on success and 0 on failure */
+
+int fwd_propogation_batch (ann * net, float * in, int count, float * out) {
+	int i;
+
+	if (! net || ! in || ! out) {
+		printf("Null pointer passed: ann = %p, inputs = %p, outputs = %p\n",net,in,out);
+		return 0;
+		}
+
+	if (count <= 0)
+		return 1;
+
+	take_bias_views(net);
+
+	if (grow_work(net, count) == 0)
+		return 0;
+
+	for (i=0; i < net->num_layers; i++) {
+		float * src = (i == 0 ? in : net->work.acts[i-1]);
+		float * dst = (i == net->num_layers - 1 ? out : net->work.acts[i]);
+
+		layer_forward_batch(net, i, src, count, dst);
+		}
+
+	return 1;
+	}
+
+
+
+/* allocate_work: This function takes a pointer to a neural network, a number of samples and
+   a pointer to a workspace. It allocates the buffers of the workspace for propogating
+   batches of up to that many samples through the network.
+
+   Returns 1 on success and 0 on failure */
+
+int allocate_work (ann * net, int size, ann_work * work) {
+	int i;
+	int widest = 0, failed = 0;
+
+	if (! net || ! work) {
+		printf("Null pointer passed: ann = %p, workspace = %p\n",net,work);
+		return 0;
+		}
+
+	if (size < 1)
+		size = 1;
+	work->size = size;
+
+	/* the outputs of every layer but the last for the whole batch, and the deltas
+	of two layers at a time */
+	for (i=0; i < MAXLAYERS; i++) {
+		work->acts[i] = NULL;
+		if (i < net->num_layers && net->num_neurons[i] > widest)
+			widest = net->num_neurons[i];
+		if (i < net->num_layers - 1) {
+			work->acts[i] = (float *) malloc ( sizeof(float) * size * net->num_neurons[i] );
+			failed |= (work->acts[i] == NULL);
+			}
+		}
+	work->delta = (float *) malloc ( sizeof(float) * size * widest );
+	work->delta1 = (float *) malloc ( sizeof(float) * size * widest );
+
+	if (failed || ! work->delta || ! work->delta1) {
+		printf("Error allocating memory for the workspace\n");
+		free_work(work);
+		return 0;
+		}
+
+	return 1;
+	}
+
+
+
+/* free_work: This function takes a pointer to a workspace and frees its buffers */
+
+void free_work (ann_work * work) {
+	int i;
+
+	if (! work)
+		return;
+
+	for (i=0; i < MAXLAYERS; i++) {
+		free(work->acts[i]);
+		work->acts[i] = NULL;
+		}
+	free(work->delta);
+	free(work->delta1);
+	work->delta = work->delta1 = NULL;
+	work->size = 0;
+	}
+
+
+
+/* backpropogate_batch: This function takes a pointer to a neural network, a workspace, an
+   array of input vectors one after the other, the number of vectors, an array of as many
+   expected output vectors, an array for as many output vectors of the last layer and the
+   weight matrices and bias weight vectors to add the steps to, one of each for every
+   layer and laid out as those of the network. The whole batch is propogated forward a
+   layer at a time, the outputs of the last layer being left in the output array, then
+   the deltas of the batch are propogated backwards as one matrix for each layer, with
+   the weights of the network. The steps every sample would take are added up for the
+   batch and added to the given matrices, which are the network's own to update it or
+   others to gather the steps. Neither the weights of the network nor its outputs are
+   changed otherwise, so this can be run on several batches at once. The bias weights are
+   taken from the vectors of the network, not from its neurons.
+   NOTE: Assumes the workspace has room for the batch
+
+   Returns 1 on success and 0 on failure */
+
+int backpropogate_batch (ann * net, ann_work * work, float * in, int count, float * ex_output,
+		float * out, float ** wts, float ** bias_wts) {
+	int i,j,s;
+	int last;
+	float * delta, * delta1, * swap;
+	float * acts[MAXLAYERS];
+
+	if (! net || ! work || ! in || ! ex_output || ! out || ! wts || ! bias_wts) {
+		printf("Null pointer passed: ann = %p, workspace = %p, inputs = %p, expected outputs = %p, outputs = %p\n",
+			net,work,in,ex_output,out);
+		return 0;
+		}
+
+	if (count > work->size) {
+		printf("Batch of %d samples is larger than the workspace (%d samples)\n",count,work->size);
+		return 0;
+		}
+
+	last = net->num_layers - 1;
+	for (i=0; i < last; i++)
+		acts[i] = work->acts[i];
+	acts[last] = out;
+	delta = work->delta;
+	delta1 = work->delta1;
+
+	for (i=0; i < net->num_layers; i++)
+		layer_forward_batch(net, i, (i == 0 ? in : acts[i-1]), count, acts[i]);
+
+	/* the deltas of the output layer are (t - y) for every sample, as in err_backpropogation */
+	for (j=0; j < count * net->num_neurons[last]; j++)
+		delta[j] = ex_output[j] - out[j];
+
+	for (i = last; i > 0; i--) {
+		int rows = net->num_neurons[i], cols = net->num_neurons[i-1];
+
+		/* the deltas of the layer closer to the input, with the weights before the update */
+		layer_gemm_t(net->weights[i], net->stride[i], rows, cols, delta, count, delta1);
+
+		// take derivative of tanh if needed
+		for (j=0; j < cols; j++) {
+			if (net->layers[i-1][j].act != tanh_activation)
+				continue;
+			for (s=0; s < count; s++) {
+				float der = ( 1 - pow(acts[i-1][(size_t) s * cols + j],2) );
+				delta1[(size_t) s * cols + j] *= der;
+				}
+			}
+
+		layer_gradient_step(net, i, acts[i-1], delta, count, wts[i], bias_wts[i]);
+
+		swap = delta;
+		delta = delta1;
+		delta1 = swap;
+		}
+
+	layer_gradient_step(net, 0, in, delta, count, wts[0], bias_wts[0]);
+	return 1;
+	}
+
+
+
+/* err_backpropogation_batch: This function trains the network on a mini-batch. It takes a
+   pointer to a neural network, an array of input vectors one after the other, the number
+   of vectors, an array of as many expected output vectors and an array for as many output
+   vectors of the last layer. The batch is run through backpropogate_batch and the weights
+   of each layer updated once with the steps of all its samples, so a batch of one sample
+   takes the same step as err_backpropogation. The batch is run in the workspace of the
+   network, which only grows when a batch is larger than any before. The outputs kept in
+   the network and its neurons are not changed.
+
+   Returns 1 on success and 0 on failure */
+
+int err_backpropogation_batch (ann * net, float * in, int count, float * ex_output, float * out) {
+	int i,k;
+
+	if (! net) {
+		printf("Null pointer passed: ann = %p\n",net);
+		return 0;
+		}
+
+	if (count <= 0)
+		return 1;
+
+	take_bias_views(net);
+
+	if (grow_work(net, count) == 0)
+		return 0;
+
+	if (backpropogate_batch(net, &net->work, in, count, ex_output, out, net->weights, net->bias_wts) == 0)
+		return 0;
+
+	for (i=0; i < net->num_layers; i++)
+		for (k=0; k < net->num_neurons[i]; k++)
+			net->layers[i][k].bias_wt = net->bias_wts[i][k];
+
+	return 1;
+	}
+
+
+
 
 
 
@@ -22,6 +22,14 @@ neural.h
 		err_backpropogation:		Updates the weights of a multilayered feed-
 									forward perceptron network using error back-
 									propogation algorithm
+		fwd_propogation_batch:		Propogates a batch of inputs through the
+									network
+		allocate_work:				Allocates the buffers for running batches
+		free_work:					Frees the buffers for running batches
+		backpropogate_batch:		Finds the steps of the weights for a batch
+									of samples
+		err_backpropogation_batch:	Updates the weights of the network once for
+									a mini-batch of samples
 
 _______________________________________________________________________________
 This file is part of 'reader'
@@ -154,6 +162,37 @@ int perceptron_update_output (neuron *,float *);//,activation);
 
 
 #define MAXLAYERS 3
+#define NEURAL_ALIGN 64			// alignment in bytes of the weight matrices and their rows
+
+/* Structure of the buffers for propogating a batch of samples forward and backward through
+   a network. Whoever runs a batch owns its workspace, so several batches can be run at
+   once, each with a workspace of its own. A network keeps one for its own training, so
+   that err_backpropogation and err_backpropogation_batch allocate nothing. */
+
+typedef struct {
+	int size;						// number of samples there is room for
+	float * acts[MAXLAYERS];		// outputs of each layer but the last for the batch
+	float * delta;					// deltas of a layer for the batch
+	float * delta1;					// deltas of the layer before it
+	} ann_work;
+
+
+/* Structure of a network of neurons.
+   The weights of each layer are one aligned, contiguous matrix stored rowwise, a row
+   for each neuron of the layer holding its weights for the outputs of the layer before
+   (or the inputs of the network). Rows are stride[i] floats apart, which is the number
+   of inputs of the layer rounded up to a whole number of NEURAL_ALIGN bytes, the padding
+   being 0. The bias weights of the layer are one vector beside it. Running a layer
+   forward is then one matrix-vector product, or one matrix product for a batch, and
+   finding the deltas of the layer before it one product with the transpose of the same
+   matrix.
+
+   The neurons of the layers stay as views of the matrices for the functions taking a
+   single neuron: the weights of neuron j of layer i point to row j of weights[i], so
+   they can be read and changed in place. Its bias weight is a copy of bias_wts[i][j]:
+   the network takes the bias weights of its neurons into the vectors at the start of
+   every pass and writes them back after every step, so a bias weight set through the
+   neuron is used as well. Its output is a copy which fwd_propogation keeps up to date. */
 
 typedef struct {
 
@@ -167,6 +206,12 @@ typedef struct {
 	float * outputs[MAXLAYERS];		// array for output of each layer
 	neuron * layers[MAXLAYERS];		// array of neuron layers
 
+	int stride[MAXLAYERS];			// floats from one row of a weight matrix to the next
+	float * weights[MAXLAYERS];		// weight matrix of each layer, a row for each neuron
+	float * bias_wts[MAXLAYERS];	// bias weight of each neuron of each layer
+
+	ann_work work;					// buffers for training the network
+
 	} ann;
 
 
@@ -180,6 +225,9 @@ typedef struct {
 
    It will then allocate arrays to the inputs and the number of neurons in each layer. It will also
    initiate the arrays as appropriate. All neurons in layer i-1 are connected to those in layer i. 
+   The weights of each layer are allocated as one matrix, and its neurons are set up as views of
+   it, so they must not be passed to free_neuron. The workspace for training is allocated here
+   as well, so that training allocates no memory.
 
    Returns 1 on success and 0 on failure */
 
@@ -187,7 +235,8 @@ typedef struct {
 int initialize_ann (ann *, float, int, int, int *);
 
 
-/* free_ann: This function takes a pointer to an ANN and frees all the memory allocated for it.
+/* free_ann: This function takes a pointer to an ANN and frees all the memory allocated for it,
+   including the weight matrices its neurons are views of.
    The things on stack will still remain 
 
    Returns 1 on success and 0 on failure */
@@ -205,7 +254,7 @@ int print_ann (ann *);
 
 /* err_backpropogation: This function takes a pointer to an ANN and propogates the input through
    the network. It then propogates the error backwards to update the weights of all the neurons
-   in the ANN.
+   in the ANN. The deltas are kept in the workspace of the network, so no memory is allocated.
 
    Returns 1 on success and 0 on failure */
 
@@ -221,6 +270,67 @@ int err_backpropogation (ann *);
 int fwd_propogation (ann *);
 
 
+/* fwd_propogation_batch: This function propogates a batch of inputs through the neural
+   network. It takes a pointer to a neural network, an array of input vectors one after
+   the other, the number of vectors and an array for as many output vectors of the last
+   layer. Each layer is run on the whole batch before the next one, so its weights are
+   brought into cache once for the batch rather than once for every input. The outputs
+   are the same fwd_propogation gives for each input, but the outputs kept in the
+   network and its neurons are not changed. The outputs of the hidden layers go in the
+   workspace of the network, which only grows when a batch is larger than any before.
+
+   Returns 1 on success and 0 on failure */
+
+int fwd_propogation_batch (ann *, float *, int, float *);
+
+
+/* allocate_work: This function takes a pointer to a neural network, a number of samples and
+   a pointer to a workspace. It allocates the buffers of the workspace for propogating
+   batches of up to that many samples through the network.
+
+   Returns 1 on success and 0 on failure */
+
+int allocate_work (ann *, int, ann_work *);
+
+
+/* free_work: This function takes a pointer to a workspace and frees its buffers */
+
+void free_work (ann_work *);
+
+
+/* backpropogate_batch: This function takes a pointer to a neural network, a workspace, an
+   array of input vectors one after the other, the number of vectors, an array of as many
+   expected output vectors, an array for as many output vectors of the last layer and the
+   weight matrices and bias weight vectors to add the steps to, one of each for every
+   layer and laid out as those of the network. The whole batch is propogated forward a
+   layer at a time, the outputs of the last layer being left in the output array, then
+   the deltas of the batch are propogated backwards as one matrix for each layer, with
+   the weights of the network. The steps every sample would take are added up for the
+   batch and added to the given matrices, which are the network's own to update it or
+   others to gather the steps. Neither the weights of the network nor its outputs are
+   changed otherwise, so this can be run on several batches at once. The bias weights are
+   taken from the vectors of the network, not from its neurons.
+   NOTE: Assumes the workspace has room for the batch
+
+   Returns 1 on success and 0 on failure */
+
+int backpropogate_batch (ann *, ann_work *, float *, int, float *, float *, float **, float **);
+
+
+/* err_backpropogation_batch: This function trains the network on a mini-batch. It takes a
+   pointer to a neural network, an array of input vectors one after the other, the number
+   of vectors, an array of as many expected output vectors and an array for as many output
+   vectors of the last layer. The batch is run through backpropogate_batch and the weights
+   of each layer updated once with the steps of all its samples, so a batch of one sample
+   takes the same step as err_backpropogation. The batch is run in the workspace of the
+   network, which only grows when a batch is larger than any before. The outputs kept in
+   the network and its neurons are not changed.
+
+   Returns 1 on success and 0 on failure */
+
+int err_backpropogation_batch (ann *, float *, int, float *, float *);
+
+
 
 
 
@@ -0,0 +1,223 @@
+/*_____________________________________________________________________________
+normalize.c: This file provides the implementation of the function prototypes
+	given in normalize.h
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "normalize.h"
+
+
+/* area_weights: builds the resampling table of one axis. Output pixel o covers
+	the source interval [(o - off) * scale, (o - off + 1) * scale), clipped to
+	the src source pixels. It takes count[o] source pixels from first[o] on,
+	each weighted by the part of it covered, divided by scale. The weights of
+	output pixel o are w[o * max] onwards, padded with zeros to max of them,
+	so that every output pixel can be made with the same number of steps */
+
+static void area_weights (int src, int out, double scale, double off, int max,
+	int * first, int * count, float * w) {
+
+	int o,c;
+
+	for (o=0; o < out; o++) {
+		double a = (o - off) * scale;
+		double b = a + scale;
+
+		if (a < 0)
+			a = 0;
+		if (b > src)
+			b = src;
+
+		first[o] = a < src ? (int) floor(a) : src;
+		count[o] = 0;
+		for (c=first[o]; c < b && count[o] < max; c++) {
+			double lo = a > c ? a : c;
+			double hi = b < c + 1 ? b : c + 1;
+			w[o * max + count[o]++] = (float) ((hi - lo) / scale);
+			}
+		for (c=count[o]; c < max; c++)
+			w[o * max + c] = 0;
+		}
+	}
+
+
+
+/* normalize_box: This function takes a bit image, the first row, first column,
+	last row and last column of a box holding the ink of a glyph, a width, a
+	height and a pointer to an array of width * height floats. It scales the
+	box to fit width x height keeping its aspect ratio, centres it and fills
+	the array rowwise with the area averaged values, as normalize_bits does.
+	Pixels outside the box are not looked at, so the box can be one glyph of
+	a whole page.
+	NOTE: Assumes enough memory is allocated for the vector
+	Returns 0 on success and 1 on failure */
+
+int normalize_box (bitimage * b, int top, int left, int bottom, int right,
+	int width, int height, float * vect) {
+
+	int bw, bh, max_x, max_y;
+	int i,j,x,y;
+	double scale;
+	float * acc, * line, * wx, * wy;
+	int * fx, * cx, * fy, * cy;
+	int unpacked = -1;
+
+	if (b == NULL || vect == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: bit image = %p, vector = %p\n",b,vect);
+		return 1;
+		}
+
+	if (width <= 0 || height <= 0) {
+		fprintf(stderr,"ERROR: Glyph can not be normalized to %d x %d\n",width,height);
+		return 1;
+		}
+
+	if (top < 0 || left < 0 || bottom >= b->height || right >= b->width || top > bottom || left > right) {
+		fprintf(stderr,"ERROR: Box %d,%d - %d,%d is not inside the %d x %d bit image\n",
+			top,left,bottom,right,b->width,b->height);
+		return 1;
+		}
+
+	bw = right - left + 1;
+	bh = bottom - top + 1;
+	scale = (double) bw / width > (double) bh / height ? (double) bw / width : (double) bh / height;
+	max_x = max_y = (int) ceil(scale) + 1;
+
+	/* the row sums are padded with max_x zeros for the padded weights */
+	void * mem = malloc (sizeof(float) * (2 * bw + max_x + width * max_x + height * max_y) +
+		sizeof(int) * 2 * (width + height));
+	if (mem == NULL) {
+		fprintf(stderr,"ERROR: Could not allocate memory for normalizing the glyph\n");
+		return 1;
+		}
+	acc = (float *) mem;
+	line = acc + bw + max_x;
+	wx = line + bw;
+	wy = wx + width * max_x;
+	fx = (int *) (wy + height * max_y);
+	cx = fx + width;
+	fy = cx + width;
+	cy = fy + height;
+
+	/* the box covers bw / scale by bh / scale inputs, centred in the input */
+	area_weights(bw, width, scale, (width - bw / scale) / 2, max_x, fx, cx, wx);
+	area_weights(bh, height, scale, (height - bh / scale) / 2, max_y, fy, cy, wy);
+
+	for (y=0; y < height; y++) {
+		float * out = vect + (size_t) y * width;
+
+		/* add up the source rows covered by this input row. The loops
+		run along whole rows, so the compiler can vectorize them */
+		memset(acc, 0, sizeof(float) * (bw + max_x));
+		for (i=0; i < cy[y]; i++) {
+			int r = top + fy[y] + i;
+			float w = wy[y * max_y + i];
+
+			/* neighbouring input rows share their edge row, so it is only
+			unpacked once */
+			if (r != unpacked) {
+				uint64_t * row = BIT_ROW(b,r);
+				for (j=0; j < bw; j++)
+					line[j] = (float) (int) ((row[(left + j) >> 6] >> ((left + j) & 63)) & 1);
+				unpacked = r;
+				}
+			for (j=0; j < bw; j++)
+				acc[j] += w * line[j];
+			}
+
+		/* every input takes max_x steps, whatever its real number of
+		source pixels, so the loop has no branch to mispredict */
+		for (x=0; x < width; x++) {
+			float * w = wx + x * max_x;
+			float * src = acc + fx[x];
+			float cover = 0;
+			for (j=0; j < max_x; j++)
+				cover += w[j] * src[j];
+			out[x] = cover;
+			}
+		if (b->inverted)
+			for (x=0; x < width; x++)
+				out[x] = 1 - out[x];
+		}
+
+	free(mem);
+	return 0;
+	}
+
+
+
+/* normalize_bits: This function takes a bit image, a width, a height and a
+	pointer to an array of width * height floats. It crops the image to the
+	bounding box of its set pixels, scales the box to fit width x height
+	keeping its aspect ratio, centres it and fills the array rowwise with the
+	area averaged values. The values are those bit_image_vector gives, so the
+	unset pixels are 1.0 for an inverted image and 0.0 otherwise, and edges
+	get the values in between. An image without set pixels gives an array of
+	unset pixels.
+	NOTE: Assumes enough memory is allocated for the vector
+	Returns 0 on success and 1 on failure */
+
+int normalize_bits (bitimage * b, int width, int height, float * vect) {
+
+	int top, left, bottom, right;
+	int i;
+
+	if (b == NULL || vect == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: bit image = %p, vector = %p\n",b,vect);
+		return 1;
+		}
+
+	if (bit_bounding_box(b, &top, &left, &bottom, &right)) {
+		for (i=0; i < width * height; i++)
+			vect[i] = (float) b->inverted;
+		return 0;
+		}
+
+	return normalize_box(b, top, left, bottom, right, width, height, vect);
+	}
+
+
+
+/* normalize_glyph: This function takes a greyscale image of a glyph, a
+	threshold, a width, a height and a pointer to an array of width * height
+	floats. The pixels below the threshold are taken as the ink of the glyph
+	(dark ink on light paper), which is then normalized as in normalize_bits.
+	The image is not altered.
+	NOTE: Assumes enough memory is allocated for the vector
+	Returns 0 on success and 1 on failure */
+
+int normalize_glyph (image * im, float t, int width, int height, float * vect) {
+
+	bitimage b;
+	int failed;
+
+	if (binarize_bits(im, t, 1, &b))
+		return 1;
+
+	failed = normalize_bits(&b, width, height, vect);
+	free_bitimage(&b);
+
+	return failed;
+	}
@@ -0,0 +1,80 @@
+/*_____________________________________________________________________________
+normalize.h: This is a header file for giving glyph normalization, which brings
+	glyphs of any size to the input size of the network.
+	A glyph cut from a page (see components.h) has the size of its ink, while
+	the network wants every glyph in the same number of inputs. Normalizing
+	crops the glyph to the bounding box of its ink, scales the box to fit the
+	input with its aspect ratio kept, and centres it. Every input is the
+	average of the glyph area it covers, so a glyph made smaller keeps its
+	thin strokes as grey values instead of losing them between samples.
+	Current functions include following:
+		normalize_box:			Normalize a box of a bit image into an input vector
+		normalize_bits:			Normalize a bit image into an input vector
+		normalize_glyph:		Normalize a greyscale glyph into an input vector
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#ifndef _NORMALIZE_GUARD
+#define _NORMALIZE_GUARD
+
+#include "image.h"
+#include "bitimage.h"
+
+
+/* normalize_box: This function takes a bit image, the first row, first column,
+	last row and last column of a box holding the ink of a glyph, a width, a
+	height and a pointer to an array of width * height floats. It scales the
+	box to fit width x height keeping its aspect ratio, centres it and fills
+	the array rowwise with the area averaged values, as normalize_bits does.
+	Pixels outside the box are not looked at, so the box can be one glyph of
+	a whole page.
+	NOTE: Assumes enough memory is allocated for the vector
+	Returns 0 on success and 1 on failure */
+
+int normalize_box (bitimage *, int, int, int, int, int, int, float *);
+
+
+/* normalize_bits: This function takes a bit image, a width, a height and a
+	pointer to an array of width * height floats. It crops the image to the
+	bounding box of its set pixels, scales the box to fit width x height
+	keeping its aspect ratio, centres it and fills the array rowwise with the
+	area averaged values. The values are those bit_image_vector gives, so the
+	unset pixels are 1.0 for an inverted image and 0.0 otherwise, and edges
+	get the values in between. An image without set pixels gives an array of
+	unset pixels.
+	NOTE: Assumes enough memory is allocated for the vector
+	Returns 0 on success and 1 on failure */
+
+int normalize_bits (bitimage *, int, int, float *);
+
+
+/* normalize_glyph: This function takes a greyscale image of a glyph, a
+	threshold, a width, a height and a pointer to an array of width * height
+	floats. The pixels below the threshold are taken as the ink of the glyph
+	(dark ink on light paper), which is then normalized as in normalize_bits.
+	The image is not altered.
+	NOTE: Assumes enough memory is allocated for the vector
+	Returns 0 on success and 1 on failure */
+
+int normalize_glyph (image *, float, int, int, float *);
+
+
+#endif
@@ -0,0 +1,413 @@
+/*_____________________________________________________________________________
+segment.c: This file provides the implementation of the function prototypes
+	given in segment.h
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "segment.h"
+#include "normalize.h"
+
+
+/* compare_int: orders two ints for qsort */
+
+static int compare_int (const void * a, const void * b) {
+
+	int x = * (const int *) a, y = * (const int *) b;
+	return (x > y) - (x < y);
+	}
+
+
+
+/* compare_left: orders two pointers to components by their left column for
+	qsort */
+
+static int compare_left (const void * a, const void * b) {
+
+	int x = (* (component * const *) a)->left, y = (* (component * const *) b)->left;
+	return (x > y) - (x < y);
+	}
+
+
+
+/* add_glyph: appends a glyph to the layout, making room for it if needed.
+	Returns 0 on success and 1 on failure */
+
+static int add_glyph (page_layout * p, int * size, glyph_box * g) {
+
+	if (p->num_glyphs == *size) {
+		int grown = *size ? 2 * *size : 256;
+		glyph_box * glyphs = (glyph_box *) realloc (p->glyphs, sizeof(glyph_box) * grown);
+		if (glyphs == NULL)
+			return 1;
+		p->glyphs = glyphs;
+		*size = grown;
+		}
+
+	p->glyphs[p->num_glyphs++] = *g;
+	return 0;
+	}
+
+
+
+/* add_line: appends a line to the layout, making room for it if needed.
+	Returns 0 on success and 1 on failure */
+
+static int add_line (page_layout * p, int * size, text_line * l) {
+
+	if (p->num_lines == *size) {
+		int grown = *size ? 2 * *size : 64;
+		text_line * lines = (text_line *) realloc (p->lines, sizeof(text_line) * grown);
+		if (lines == NULL)
+			return 1;
+		p->lines = lines;
+		*size = grown;
+		}
+
+	p->lines[p->num_lines++] = *l;
+	return 0;
+	}
+
+
+
+/* joins: returns 1 if the columns of the component c overlap those of the
+	glyph g by at least half the width of the narrower of the two, and 0
+	otherwise */
+
+static int joins (component * c, glyph_box * g) {
+
+	int lo = c->left > g->left ? c->left : g->left;
+	int hi = c->right < g->right ? c->right : g->right;
+	int cw = c->right - c->left + 1, gw = g->right - g->left + 1;
+
+	return 2 * (hi - lo + 1) >= (cw < gw ? cw : gw);
+	}
+
+
+
+/* split_line: finds the glyphs and words of the line l of the page and adds
+	them to the layout. The components of the line are the 'num' ones of
+	'order'. Taken left to right, a component whose columns overlap those of
+	the glyph before it by half the narrower of the two is part of that glyph,
+	as the dot of an i is, and any other one starts a glyph.
+	Returns 0 on success and 1 on failure */
+
+static int split_line (page_layout * p, text_line * l, component ** order, int num,
+	int word_gap, int * size) {
+
+	int k, reach = -1;
+	glyph_box g;
+
+	l->first = p->num_glyphs;
+	l->count = 0;
+	l->words = 0;
+
+	qsort(order, num, sizeof(component *), compare_left);
+
+	for (k=0; k < num; k++) {
+		component * c = order[k];
+
+		if (k > 0 && joins(c, &g)) {
+			/* the components come by their left column, so the glyph can
+			only grow to the right */
+			g.top = c->top < g.top ? c->top : g.top;
+			g.bottom = c->bottom > g.bottom ? c->bottom : g.bottom;
+			g.right = c->right > g.right ? c->right : g.right;
+			}
+		else {
+			if (k > 0) {
+				if (add_glyph(p, size, &g))
+					return 1;
+				l->count++;
+				}
+			/* glyphs closer than the word gap to all those before them are in
+			the same word */
+			if (reach < 0 || c->left - reach - 1 >= word_gap)
+				l->words++;
+			g.top = c->top;
+			g.left = c->left;
+			g.bottom = c->bottom;
+			g.right = c->right;
+			g.word = l->words - 1;
+			g.first = p->num_members;
+			g.count = 0;
+			}
+		p->members[p->num_members++] = c - p->parts.list;
+		g.count++;
+		reach = g.right > reach ? g.right : reach;
+		}
+
+	if (num > 0) {
+		if (add_glyph(p, size, &g))
+			return 1;
+		l->count++;
+		}
+
+	return 0;
+	}
+
+
+
+/* measure_line_height: This function takes a bit image of a page, the set
+	pixels being the ink, and returns the median height of its runs of rows
+	holding ink, which is the height of its lines whatever the resolution it
+	was scanned at. Dots and accents make short runs of their own but are few
+	beside the lines, so they do not move the median. Returns 0 for a page
+	without ink and -1 on failure */
+
+int measure_line_height (bitimage * b) {
+
+	int i = 0, count = 0, height;
+	int * prof, * runs;
+
+	if (b == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed for the bit image\n");
+		return -1;
+		}
+
+	prof = (int *) malloc (sizeof(int) * b->height);
+	runs = (int *) malloc (sizeof(int) * (b->height / 2 + 1));
+	if (prof == NULL || runs == NULL) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the row profile of the page\n");
+		free(prof);
+		free(runs);
+		return -1;
+		}
+
+	bit_row_profile(b, prof);
+	while (i < b->height) {
+		int top;
+		while (i < b->height && prof[i] == 0)
+			i++;
+		if (i == b->height)
+			break;
+		for (top=i; i < b->height && prof[i]; i++)
+			;
+		runs[count++] = i - top;
+		}
+
+	if (count)
+		qsort(runs, count, sizeof(int), compare_int);
+	height = count ? runs[count / 2] : 0;
+
+	free(prof);
+	free(runs);
+	return height;
+	}
+
+
+
+/* segment_page: This function takes a bit image of a page, the number of
+	blank rows which separate two lines, the number of blank columns which
+	separate two words and a layout structure. The set pixels of the image are
+	taken as the ink (see bit_invert for a page binarized the other way). It
+	finds the lines of the page, the glyphs and words of every line and
+	stores them in the layout. Fewer blank rows than the line gap do not end
+	a line, so the dots and accents over letters stay on their lines. The
+	components of a line whose columns overlap by half the narrower of them
+	make one glyph, others are glyphs of their own even when their boxes
+	overlap. Glyphs touching each other are found as one glyph. The word gap
+	is counted from the rightmost column of all the glyphs before.
+	Returns 0 on success and 1 on failure */
+
+int segment_page (bitimage * b, int line_gap, int word_gap, page_layout * p) {
+
+	int i = 0, gap, next = 0, num;
+	int line_size = 0, glyph_size = 0;
+	int * prof;
+	component ** order;
+	text_line l;
+
+	if (b == NULL || p == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: bit image = %p, layout = %p\n",b,p);
+		return 1;
+		}
+
+	p->lines = NULL;
+	p->num_lines = 0;
+	p->glyphs = NULL;
+	p->num_glyphs = 0;
+	p->members = NULL;
+	p->num_members = 0;
+
+	if (label_components(b, 8, 0, &p->parts))
+		return 1;
+
+	prof = (int *) malloc (sizeof(int) * b->height);
+	order = (component **) malloc (sizeof(component *) * (p->parts.count + 1));
+	p->members = (int *) malloc (sizeof(int) * (p->parts.count + 1));
+	if (prof == NULL || order == NULL || p->members == NULL) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the profiles of the page\n");
+		free(prof);
+		free(order);
+		free_layout(p);
+		return 1;
+		}
+
+	/* the row profile is one popcount per word of the page */
+	bit_row_profile(b, prof);
+
+	while (i < b->height) {
+		while (i < b->height && prof[i] == 0)
+			i++;
+		if (i == b->height)
+			break;
+
+		/* a line goes on over blank gaps shorter than line_gap */
+		l.top = l.bottom = i;
+		while (i < b->height) {
+			if (prof[i]) {
+				l.bottom = i++;
+				continue;
+				}
+			for (gap=0; i < b->height && prof[i] == 0; i++)
+				gap++;
+			if (i == b->height || gap >= line_gap)
+				break;
+			}
+
+		/* the components come by their first row and no component crosses
+		the blank rows between two lines, so those of the line are the next
+		ones starting above its bottom */
+		for (num=0; next < p->parts.count && p->parts.list[next].top <= l.bottom; num++)
+			order[num] = &p->parts.list[next++];
+
+		if (split_line(p, &l, order, num, word_gap, &glyph_size) || add_line(p, &line_size, &l)) {
+			fprintf(stderr,"ERROR: Could not allocate memory for the layout of the page\n");
+			free(prof);
+			free(order);
+			free_layout(p);
+			return 1;
+			}
+		}
+
+	free(prof);
+	free(order);
+	return 0;
+	}
+
+
+
+/* or_mask: ORs the mask of a component into the bit image of a glyph, with
+	its first row and column at the given row and column of the glyph */
+
+static void or_mask (bitimage * g, bitimage * mask, int row, int col) {
+
+	int i,k,shift = col & 63;
+
+	for (i=0; i < mask->height; i++) {
+		uint64_t * src = BIT_ROW(mask,i);
+		uint64_t * dst = BIT_ROW(g,row + i) + (col >> 6);
+		for (k=0; k < mask->words; k++) {
+			dst[k] |= src[k] << shift;
+			/* the bits shifted out of the word go in the next one, if the
+			glyph has it; if not they are padding and so 0 */
+			if (shift && (col >> 6) + k + 1 < g->words)
+				dst[k+1] |= src[k] >> (64 - shift);
+			}
+		}
+	}
+
+
+
+/* line_batch: This function takes the bit image of a page, its layout, the
+	number of a line, a width, a height and a pointer to an array of
+	width * height floats for every glyph of the line. It normalizes the
+	glyphs of the line one after the other into the array (see
+	normalize_bits), ready to be run through the network as one batch. Only
+	the pixels of the components of a glyph are normalized, not the whole
+	box of the page.
+	NOTE: Assumes enough memory is allocated for the batch
+	Returns 0 on success and 1 on failure */
+
+int line_batch (bitimage * b, page_layout * p, int line, int width, int height, float * batch) {
+
+	int i,k,rows = 1,cols = 1;
+	text_line * l;
+	bitimage scratch;
+
+	if (b == NULL || p == NULL || batch == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: bit image = %p, layout = %p, batch = %p\n",b,p,batch);
+		return 1;
+		}
+
+	if (line < 0 || line >= p->num_lines) {
+		fprintf(stderr,"ERROR: The page has no line %d\n",line);
+		return 1;
+		}
+
+	/* one bit image big enough for every glyph of the line is used for all
+	of them in turn */
+	l = &p->lines[line];
+	for (k=0; k < l->count; k++) {
+		glyph_box * g = &p->glyphs[l->first + k];
+		rows = g->bottom - g->top + 1 > rows ? g->bottom - g->top + 1 : rows;
+		cols = g->right - g->left + 1 > cols ? g->right - g->left + 1 : cols;
+		}
+	if (allocate_bitimage(&scratch, cols, rows))
+		return 1;
+
+	for (k=0; k < l->count; k++) {
+		glyph_box * g = &p->glyphs[l->first + k];
+		bitimage glyph;
+
+		glyph.bits = scratch.bits;
+		glyph.width = g->right - g->left + 1;
+		glyph.height = g->bottom - g->top + 1;
+		glyph.words = (glyph.width + 63) / 64;
+		glyph.inverted = b->inverted;
+		memset(glyph.bits, 0, sizeof(uint64_t) * glyph.words * glyph.height);
+		for (i=0; i < g->count; i++) {
+			component * c = &p->parts.list[p->members[g->first + i]];
+			or_mask(&glyph, &c->mask, c->top - g->top, c->left - g->left);
+			}
+
+		if (normalize_bits(&glyph, width, height, batch + (size_t) k * width * height)) {
+			free_bitimage(&scratch);
+			return 1;
+			}
+		}
+
+	free_bitimage(&scratch);
+	return 0;
+	}
+
+
+
+/* free_layout: This function takes a layout and deallocates its lines and
+	glyphs */
+
+void free_layout (page_layout * p) {
+
+	if (p == NULL)
+		return;
+
+	free(p->lines);
+	free(p->glyphs);
+	free(p->members);
+	free_components(&p->parts);
+	p->lines = NULL;
+	p->glyphs = NULL;
+	p->members = NULL;
+	p->num_lines = p->num_glyphs = p->num_members = 0;
+	}
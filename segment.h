@@ -0,0 +1,129 @@
+/*_____________________________________________________________________________
+segment.h: This is a header file for giving the segmentation of a page of text
+	into lines, words and glyphs.
+	The rows of a page holding no ink separate its lines; the row profile
+	comes straight from the packed rows, as a popcount of every row. Within
+	a line the glyphs are made of the connected components of the ink (see
+	components.h), so two letters whose boxes overlap, as in "AV", are still
+	two glyphs, while a dot or an accent over a letter goes with it. Wider
+	gaps between glyphs separate the words. Every glyph is drawn from the
+	masks of its own components, so a neighbour reaching into its box is left
+	out, and the glyphs of every line can then be normalized together into one
+	batch of network inputs.
+	Current functions include following:
+		measure_line_height:	Measure the height of the lines of a page
+		segment_page:			Find the lines, words and glyphs of a page
+		line_batch:				Normalize the glyphs of a line into a batch
+		free_layout:			Release the lines and glyphs found
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#ifndef _SEGMENT_GUARD
+#define _SEGMENT_GUARD
+
+#include "bitimage.h"
+#include "components.h"
+
+
+/* The structure for a glyph of a page. The box is the smallest one holding
+	the ink of the glyph, with the last row and column included. Its
+	components are 'count' components of the page, whose numbers are the
+	members of the layout from 'first' on */
+
+typedef struct {
+	int top, left;					// first row and column of the box
+	int bottom, right;				// last row and column of the box
+	int word;						// number of the word within its line
+	int first, count;				// components of the glyph
+	} glyph_box;
+
+
+/* The structure for a line of a page. Its glyphs are 'count' glyphs of the
+	page from 'first' on, left to right */
+
+typedef struct {
+	int top, bottom;				// first and last row of the line
+	int first, count;				// glyphs of the line
+	int words;						// number of words in the line
+	} text_line;
+
+
+/* The structure for the layout of a page: its lines, top to bottom, the
+	glyphs of all of them, the connected components of the page and the
+	numbers of the components of every glyph, glyph after glyph */
+
+typedef struct {
+	text_line * lines;
+	int num_lines;
+	glyph_box * glyphs;
+	int num_glyphs;
+	component_set parts;
+	int * members;
+	int num_members;
+	} page_layout;
+
+
+/* measure_line_height: This function takes a bit image of a page, the set
+	pixels being the ink, and returns the median height of its runs of rows
+	holding ink, which is the height of its lines whatever the resolution it
+	was scanned at. Dots and accents make short runs of their own but are few
+	beside the lines, so they do not move the median. Returns 0 for a page
+	without ink and -1 on failure */
+
+int measure_line_height (bitimage *);
+
+
+/* segment_page: This function takes a bit image of a page, the number of
+	blank rows which separate two lines, the number of blank columns which
+	separate two words and a layout structure. The set pixels of the image are
+	taken as the ink (see bit_invert for a page binarized the other way). It
+	finds the lines of the page, the glyphs and words of every line and
+	stores them in the layout. Fewer blank rows than the line gap do not end
+	a line, so the dots and accents over letters stay on their lines. The
+	components of a line whose columns overlap by half the narrower of them
+	make one glyph, others are glyphs of their own even when their boxes
+	overlap. Glyphs touching each other are found as one glyph. The word gap
+	is counted from the rightmost column of all the glyphs before.
+	Returns 0 on success and 1 on failure */
+
+int segment_page (bitimage *, int, int, page_layout *);
+
+
+/* line_batch: This function takes the bit image of a page, its layout, the
+	number of a line, a width, a height and a pointer to an array of
+	width * height floats for every glyph of the line. It normalizes the
+	glyphs of the line one after the other into the array (see
+	normalize_bits), ready to be run through the network as one batch. Only
+	the pixels of the components of a glyph are normalized, not the whole
+	box of the page.
+	NOTE: Assumes enough memory is allocated for the batch
+	Returns 0 on success and 1 on failure */
+
+int line_batch (bitimage *, page_layout *, int, int, int, float *);
+
+
+/* free_layout: This function takes a layout and deallocates its lines and
+	glyphs */
+
+void free_layout (page_layout *);
+
+
+#endif
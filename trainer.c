@@ -0,0 +1,357 @@
+/*_____________________________________________________________________________
+trainer.c: This file provides the implementation of the function prototypes
+	given in trainer.h
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trainer.h"
+
+
+/* trainer_barrier: waits until every worker of the trainer has reached it */
+
+static void trainer_barrier (trainer * t) {
+
+	pthread_mutex_lock(&t->lock);
+	int phase = t->phase;
+	if (++t->arrived == t->num_workers) {
+		t->arrived = 0;
+		t->phase++;
+		pthread_cond_broadcast(&t->met);
+		}
+	else {
+		while (phase == t->phase)
+			pthread_cond_wait(&t->met, &t->lock);
+		}
+	pthread_mutex_unlock(&t->lock);
+	}
+
+
+
+/* run_share: runs the share of worker w of the batch handed out, and adds the
+	steps of all the workers for its rows of the weights */
+
+static void run_share (train_worker * w) {
+
+	trainer * t = w->t;
+	ann * net = t->net;
+	int num_in = net->num_in;
+	int num_out = net->num_neurons[net->num_layers-1];
+	int first = (long) t->count * w->id / t->num_workers;
+	int last = (long) t->count * (w->id + 1) / t->num_workers;
+	int i,k,g,c,s;
+
+	w->failed = 0;
+
+	/* a worker on its own has nobody to wait for or to add up steps with */
+	if (t->num_workers == 1) {
+		if (backpropogate_batch(net, &w->work, t->in, t->count, t->ex_output, t->out,
+				net->weights, net->bias_wts) == 0)
+			w->failed = 1;
+		for (i=0; i < net->num_layers; i++)
+			for (k=0; k < net->num_neurons[i]; k++)
+				net->layers[i][k].bias_wt = net->bias_wts[i][k];
+		return;
+		}
+
+	if (t->hogwild) {
+		/* every sample steps the shared weights straight away */
+		for (s=first; s < last && !w->failed; s++)
+			if (backpropogate_batch(net, &w->work, t->in + (size_t) s * num_in, 1,
+					t->ex_output + (size_t) s * num_out, t->out + (size_t) s * num_out,
+					net->weights, net->bias_wts) == 0)
+				w->failed = 1;
+		trainer_barrier(t);
+		return;
+		}
+
+	if (last > first &&
+			backpropogate_batch(net, &w->work, t->in + (size_t) first * num_in, last - first,
+				t->ex_output + (size_t) first * num_out, t->out + (size_t) first * num_out,
+				w->wts, w->bias_wts) == 0)
+		w->failed = 1;
+	/* a worker whose share failed still has to meet the others, or they would
+	wait for it for ever */
+	trainer_barrier(t);
+
+	/* the steps of every worker are added in the order of the workers, and
+	cleared for the next batch on the way */
+	for (i=0; i < net->num_layers; i++) {
+		int rows = net->num_neurons[i];
+		int lo = (long) rows * w->id / t->num_workers;
+		int hi = (long) rows * (w->id + 1) / t->num_workers;
+
+		for (k=lo; k < hi; k++) {
+			float * row = net->weights[i] + (size_t) k * net->stride[i];
+
+			for (g=0; g < t->num_workers; g++) {
+				train_worker * o = &t->workers[g];
+				float * step = o->wts[i] + (size_t) k * net->stride[i];
+
+				for (c=0; c < net->stride[i]; c++) {
+					row[c] += step[c];
+					step[c] = 0;
+					}
+				net->bias_wts[i][k] += o->bias_wts[i][k];
+				o->bias_wts[i][k] = 0;
+				}
+			net->layers[i][k].bias_wt = net->bias_wts[i][k];
+			}
+		}
+	trainer_barrier(t);
+	}
+
+
+
+/* trainer_worker: runs the share of its worker of every batch handed out until
+	the trainer is stopped */
+
+static void * trainer_worker (void * arg) {
+
+	train_worker * w = (train_worker *) arg;
+	trainer * t = w->t;
+	int seen = 0;
+
+	pthread_mutex_lock(&t->lock);
+	while (1) {
+		while (!t->stop && t->round == seen)
+			pthread_cond_wait(&t->go, &t->lock);
+		if (t->stop)
+			break;
+
+		seen = t->round;
+		pthread_mutex_unlock(&t->lock);
+		run_share(w);
+		pthread_mutex_lock(&t->lock);
+		}
+	pthread_mutex_unlock(&t->lock);
+
+	return NULL;
+	}
+
+
+
+/* start_trainer: This function takes a trainer structure, a neural network,
+	the largest number of samples in a batch, the number of threads and the
+	Hogwild flag. It starts the workers and gives each one the buffers for
+	its share of a batch. Passing 0 threads uses one per processor. The
+	network has to stay valid until stop_trainer.
+	Returns 0 on success and 1 on failure */
+
+int start_trainer (trainer * t, ann * net, int batch, int threads, int hogwild) {
+
+	int i,j;
+	int share, failed = 0;
+
+	if (t == NULL || net == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: trainer = %p, network = %p\n",t,net);
+		return 1;
+		}
+
+	if (batch < 1)
+		batch = 1;
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > batch)
+		threads = batch;
+	if (threads < 1)
+		threads = 1;
+
+	t->net = net;
+	t->batch = batch;
+	t->hogwild = hogwild;
+	t->in = t->ex_output = t->out = NULL;
+	t->count = 0;
+	t->round = 0;
+	t->arrived = 0;
+	t->phase = 0;
+	t->stop = 0;
+	t->num_workers = 0;
+
+	t->workers = (train_worker *) calloc (threads, sizeof(train_worker));
+	t->tid = (pthread_t *) malloc (sizeof(pthread_t) * threads);
+	if (t->workers == NULL || t->tid == NULL) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the trainer\n");
+		free(t->workers);
+		free(t->tid);
+		return 1;
+		}
+
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->go, NULL);
+	pthread_cond_init(&t->met, NULL);
+
+	/* the caller is the first worker. The others only touch their buffers once
+	a batch is handed out, so they can be started before the buffers exist */
+	for (i=0; i < threads; i++) {
+		t->workers[i].t = t;
+		t->workers[i].id = i;
+		}
+	t->num_workers = 1;
+	for (i=1; i < threads; i++) {
+		if (pthread_create(&t->tid[i], NULL, trainer_worker, &t->workers[i]))
+			break;
+		t->num_workers++;
+		}
+
+	/* the shares are only known once it is known how many workers started */
+	share = (batch + t->num_workers - 1) / t->num_workers;
+	for (i=0; i < t->num_workers && !failed; i++) {
+		train_worker * w = &t->workers[i];
+
+		if (allocate_work(net, hogwild && t->num_workers > 1 ? 1 : share, &w->work) == 0) {
+			failed = 1;
+			break;
+			}
+		for (j=0; j < net->num_layers && !hogwild && t->num_workers > 1; j++) {
+			size_t size = sizeof(float) * net->stride[j] * net->num_neurons[j];
+			void * data = NULL;
+
+			if (posix_memalign(&data, NEURAL_ALIGN, size)) {
+				failed = 1;
+				break;
+				}
+			w->wts[j] = (float *) data;
+			memset(w->wts[j], 0, size);
+			w->bias_wts[j] = (float *) calloc (net->num_neurons[j], sizeof(float));
+			if (w->bias_wts[j] == NULL) {
+				failed = 1;
+				break;
+				}
+			}
+		}
+
+	if (failed) {
+		fprintf(stderr,"ERROR: Could not allocate memory for the trainer workers\n");
+		stop_trainer(t);
+		return 1;
+		}
+
+	return 0;
+	}
+
+
+
+/* train_batch: This function takes a trainer, an array of input vectors one
+	after the other, the number of vectors, an array of as many expected
+	output vectors and an array for as many output vectors of the last layer.
+	It trains the network on the batch with all the workers and leaves the
+	outputs the network gave for the batch, before it was trained on it, in
+	the last array (in the Hogwild mode, as it stood when each sample came
+	up). Without the Hogwild flag the network ends up as
+	err_backpropogation_batch would leave it, whatever the number of threads,
+	up to the order in which the steps are added. The outputs kept in the
+	network and its neurons are not changed.
+	Returns 0 on success and 1 if the share of any worker failed */
+
+int train_batch (trainer * t, float * in, int count, float * ex_output, float * out) {
+
+	int i,k,failed = 0;
+
+	if (t == NULL || in == NULL || ex_output == NULL || out == NULL) {
+		fprintf(stderr,"ERROR: Null pointer passed: trainer = %p, inputs = %p, expected outputs = %p, outputs = %p\n",
+			t,in,ex_output,out);
+		return 1;
+		}
+
+	if (count > t->batch) {
+		fprintf(stderr,"ERROR: Batch of %d samples is larger than the trainer allows (%d samples)\n",
+			count,t->batch);
+		return 1;
+		}
+
+	if (count <= 0)
+		return 0;
+
+	/* a bias weight set through a neuron of the network counts, as in neural.c.
+	The workers are all waiting, so nobody reads the vectors yet */
+	for (i=0; i < t->net->num_layers; i++)
+		for (k=0; k < t->net->num_neurons[i]; k++)
+			t->net->bias_wts[i][k] = t->net->layers[i][k].bias_wt;
+
+	pthread_mutex_lock(&t->lock);
+	t->in = in;
+	t->ex_output = ex_output;
+	t->out = out;
+	t->count = count;
+	t->round++;
+	pthread_cond_broadcast(&t->go);
+	pthread_mutex_unlock(&t->lock);
+
+	run_share(&t->workers[0]);
+
+	/* every worker has passed the last barrier, so their flags are settled */
+	for (i=0; i < t->num_workers; i++)
+		failed |= t->workers[i].failed;
+	if (failed)
+		fprintf(stderr,"ERROR: Training on the batch of %d samples failed\n",count);
+
+	/* in the Hogwild mode nobody kept the bias weights of the neurons up to date */
+	if (t->hogwild) {
+		ann * net = t->net;
+		for (i=0; i < net->num_layers; i++)
+			for (k=0; k < net->num_neurons[i]; k++)
+				net->layers[i][k].bias_wt = net->bias_wts[i][k];
+		}
+
+	return failed;
+	}
+
+
+
+/* stop_trainer: This function takes a trainer, stops its workers and releases
+	its memory. The network is not released. */
+
+void stop_trainer (trainer * t) {
+
+	int i,j;
+
+	if (t == NULL || t->workers == NULL)
+		return;
+
+	pthread_mutex_lock(&t->lock);
+	t->stop = 1;
+	pthread_cond_broadcast(&t->go);
+	pthread_mutex_unlock(&t->lock);
+
+	for (i=1; i < t->num_workers; i++)
+		pthread_join(t->tid[i], NULL);
+
+	for (i=0; i < t->num_workers; i++) {
+		free_work(&t->workers[i].work);
+		for (j=0; j < MAXLAYERS; j++) {
+			free(t->workers[i].wts[j]);
+			free(t->workers[i].bias_wts[j]);
+			}
+		}
+
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->go);
+	pthread_cond_destroy(&t->met);
+	free(t->workers);
+	free(t->tid);
+	t->workers = NULL;
+	t->tid = NULL;
+	t->num_workers = 0;
+	}
@@ -0,0 +1,121 @@
+/*_____________________________________________________________________________
+trainer.h: This is a header file for giving a data parallel trainer for the
+	neural networks of neural.h.
+	The trainer keeps a pool of worker threads for the whole training, the
+	calling thread being the first of them. Every mini-batch is split into one
+	share for each worker, and each worker runs its share forward and backward
+	through the network with its own buffers. The steps of the shares are then
+	added into the weights of the network, every worker adding those of all
+	the workers for its own rows of the weight matrices, so no two workers
+	ever write the same weight and no locking is needed. In the Hogwild mode
+	the workers instead step the shared weights after every sample, without
+	any locking at all, and the rare steps lost to a race are the price for
+	never waiting on each other.
+	Current functions include following:
+		start_trainer:			Start the workers for a network
+		train_batch:			Train the network on a mini-batch
+		stop_trainer:			Stop the workers and release the trainer
+_______________________________________________________________________________
+This file is part of 'reader'
+
+Copyright (C) 2013  Aniket Oak
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+_______________________________________________________________________________*/
+
+
+#ifndef _TRAINER_GUARD
+#define _TRAINER_GUARD
+
+#include <pthread.h>
+#include "neural.h"
+
+
+/* The structure for one worker of a trainer. Everything a worker writes
+	while it runs its share of a batch is its own */
+
+typedef struct {
+	struct trainer * t;
+	int id;							// number of the worker, 0 being the caller
+	ann_work work;					// buffers for its share of a batch
+	float * wts[MAXLAYERS];			// steps of its share for the weights
+	float * bias_wts[MAXLAYERS];	// and for the bias weights
+	int failed;						// 'its share of the batch failed' flag
+	} train_worker;
+
+
+/* The structure for a trainer.
+	A batch is handed out by counting up 'round'. The workers meet at a
+	barrier once their steps are found, so that no weight is changed while
+	another worker still reads it, and again once the steps are added, so
+	that the caller only goes on with the updated network. */
+
+typedef struct trainer {
+	ann * net;
+	int batch;						// largest batch it has room for
+	int hogwild;					// 'step the weights without waiting' flag
+
+	int num_workers;				// workers, the caller being the first
+	train_worker * workers;
+	pthread_t * tid;				// threads of the workers but the first
+
+	float * in;						// the batch being trained on
+	float * ex_output;
+	float * out;
+	int count;
+
+	int round;						// number of batches handed out
+	int arrived;					// workers waiting at the barrier
+	int phase;						// number of times the barrier was passed
+	int stop;						// 'workers have to stop' flag
+
+	pthread_mutex_t lock;
+	pthread_cond_t go;				// signalled when a batch is handed out
+	pthread_cond_t met;				// signalled when the barrier is passed
+	} trainer;
+
+
+/* start_trainer: This function takes a trainer structure, a neural network,
+	the largest number of samples in a batch, the number of threads and the
+	Hogwild flag. It starts the workers and gives each one the buffers for
+	its share of a batch. Passing 0 threads uses one per processor. The
+	network has to stay valid until stop_trainer.
+	Returns 0 on success and 1 on failure */
+
+int start_trainer (trainer *, ann *, int, int, int);
+
+
+/* train_batch: This function takes a trainer, an array of input vectors one
+	after the other, the number of vectors, an array of as many expected
+	output vectors and an array for as many output vectors of the last layer.
+	It trains the network on the batch with all the workers and leaves the
+	outputs the network gave for the batch, before it was trained on it, in
+	the last array (in the Hogwild mode, as it stood when each sample came
+	up). Without the Hogwild flag the network ends up as
+	err_backpropogation_batch would leave it, whatever the number of threads,
+	up to the order in which the steps are added. The outputs kept in the
+	network and its neurons are not changed.
+	Returns 0 on success and 1 if the share of any worker failed */
+
+int train_batch (trainer *, float *, int, float *, float *);
+
+
+/* stop_trainer: This function takes a trainer, stops its workers and releases
+	its memory. The network is not released. */
+
+void stop_trainer (trainer *);
+
+
+#endif